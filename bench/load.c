@@ -0,0 +1,295 @@
+#include <getopt.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#include "../src/irc.h"
+#include "../src/metrics.h"
+
+// Load generator: opens N v1 connections, spreads them over M channels, sends seq-numbered
+// messages round-robin at a fixed total rate and times every delivery against its send.
+// Prints one JSON object to stdout; progress goes to stderr. Given several ports, every
+// channel's members are spread over all of them, so each message has to cross server links.
+#define BENCH_MAX_RECV_THREADS 64
+#define BENCH_EVENT_QTY 64
+#define BENCH_MAGIC "B "
+#define BENCH_MAX_PORTS 16
+
+typedef struct _bench_config {
+    char* host;
+    in_port_t ports[BENCH_MAX_PORTS];       // of federated servers, all on host
+    int port_qty;
+    int conn_qty;
+    int channel_qty;
+    int rate;                               // messages per second over all connections
+    int msg_size;                           // bytes of data per message, newline included
+    int duration;                           // seconds of sending
+    int recv_threads;
+} bench_config_t;
+
+typedef struct _bench_conn {
+    irc_sock_t sock;
+    int channel;
+    bool open;
+} bench_conn_t;
+
+typedef struct _bench bench_t;
+
+typedef struct _bench_receiver {
+    pthread_t thread;
+    bench_t* bench;
+    int epoll;
+    uint64_t delivered;
+    hist_t latency;                         // ns, one sample per delivery
+} bench_receiver_t;
+
+struct _bench {
+    bench_config_t config;
+    bench_conn_t* conns;
+    int* members;                           // connections per channel
+    uint64_t* sent_ns;                      // by seq
+    uint64_t* last_ns;                      // by seq, arrival at its last recipient so far
+    uint64_t seq_cap;
+    uint64_t sent;
+    bool stop;
+    bench_receiver_t receivers[BENCH_MAX_RECV_THREADS];
+};
+
+static void bench_usage(char* name) {
+    fprintf(stderr, "usage: %s [-h host] [-p port[,port...]] [-n connections] [-c channels] [-r msgs_per_sec] "
+                    "[-s msg_bytes] [-d seconds] [-t recv_threads]\n", name);
+    exit(1);
+}
+
+static bool bench_connect(bench_t* bench, bench_conn_t* conn, int id) {
+    bench_config_t* config = &bench->config;
+    in_port_t port = config->ports[(id / config->channel_qty) % config->port_qty];
+    conn->sock = irc_sock_new(AF_INET, config->host, port);
+    if (connect(conn->sock.sock, (const struct sockaddr*) &conn->sock.addr, conn->sock.addr_len) == -1) {
+        perror("bench_connect::connect");
+        return false;
+    }
+    setsockopt(conn->sock.sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    char name[IRC_NAME_LEN] = {0};
+    snprintf(name, IRC_NAME_LEN, "bench%d", id);
+    send(conn->sock.sock, name, IRC_NAME_LEN, 0);
+
+    char handshake[9];
+    if (recv(conn->sock.sock, handshake, 9, MSG_WAITALL) != 9 || strcmp(handshake, "accepted")) {
+        fprintf(stderr, "bench_connect: %s was rejected\n", name);
+        return false;
+    }
+
+    irc_packet_t pkt = {0};
+    strncpy(pkt.user, name, IRC_NAME_LEN-1);
+    pkt.length = snprintf(pkt.data, MSG_LEN, "/join #bench%d\n", conn->channel);
+    conn->open = irc_send(&conn->sock, &pkt, 0) > 0;
+    return conn->open;
+}
+
+static void bench_record_delivery(bench_t* bench, bench_receiver_t* receiver, irc_packet_t* pkt, uint64_t now) {
+    if (pkt->length < sizeof(BENCH_MAGIC) || memcmp(pkt->data, BENCH_MAGIC, sizeof(BENCH_MAGIC)-1)) return;
+
+    uint64_t seq = strtoull(pkt->data + sizeof(BENCH_MAGIC)-1, NULL, 10);
+    if (seq >= bench->seq_cap) return;
+    uint64_t sent_ns = __atomic_load_n(&bench->sent_ns[seq], __ATOMIC_ACQUIRE);
+    if (!sent_ns) return;
+
+    hist_record(&receiver->latency, now - sent_ns);
+    metric_add(receiver->delivered, 1);
+
+    uint64_t last = __atomic_load_n(&bench->last_ns[seq], __ATOMIC_RELAXED);
+    while (now > last && !__atomic_compare_exchange_n(&bench->last_ns[seq], &last, now, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void* bench_recv_run(void* args) {
+    bench_receiver_t* receiver = (bench_receiver_t*) args;
+    bench_t* bench = receiver->bench;
+
+    irc_packet_t pkt;
+    struct epoll_event events[BENCH_EVENT_QTY];
+    while (!__atomic_load_n(&bench->stop, __ATOMIC_ACQUIRE)) {
+        int ready_qty = epoll_wait(receiver->epoll, events, BENCH_EVENT_QTY, 100);
+        for (int n = 0; n < ready_qty; n++) {
+            bench_conn_t* conn = events[n].data.ptr;
+
+            // Readable means a frame has started arriving; irc_recv waits for the rest
+            int received = irc_recv(&conn->sock, &pkt, 0);
+            if (received <= 0) {
+                epoll_ctl(receiver->epoll, EPOLL_CTL_DEL, conn->sock.sock, NULL);
+                conn->open = false;
+                continue;
+            }
+            if (pkt.length < MSG_LEN) pkt.data[pkt.length] = '\0';
+            bench_record_delivery(bench, receiver, &pkt, metrics_now_ns());
+        }
+    }
+    return NULL;
+}
+
+// Paces messages at config.rate, round-robin over the connections
+static void bench_send(bench_t* bench) {
+    bench_config_t* config = &bench->config;
+    uint64_t total = (uint64_t) config->rate * config->duration;
+    if (total > bench->seq_cap) total = bench->seq_cap;
+
+    irc_packet_t pkt = {0};
+    uint64_t start = metrics_now_ns();
+    for (uint64_t seq = 0; seq < total; seq++) {
+        uint64_t due = start + seq * 1000000000ull / config->rate;
+        uint64_t now = metrics_now_ns();
+        if (due > now) usleep((due - now) / 1000);
+
+        bench_conn_t* conn = &bench->conns[seq % config->conn_qty];
+        if (!conn->open) continue;
+
+        int len = snprintf(pkt.data, MSG_LEN, BENCH_MAGIC "%llu ", (unsigned long long) seq);
+        while (len < config->msg_size-1) pkt.data[len++] = 'x';
+        pkt.data[len++] = '\n';
+        pkt.length = len;
+        snprintf(pkt.user, IRC_NAME_LEN, "bench%llu", (unsigned long long) (seq % config->conn_qty));
+
+        __atomic_store_n(&bench->sent_ns[seq], metrics_now_ns(), __ATOMIC_RELEASE);
+        if (irc_send(&conn->sock, &pkt, 0) > 0) bench->sent++;
+        else conn->open = false;
+    }
+}
+
+static void bench_print_hist(const char* name, hist_t* hist, bool last) {
+    printf("  \"%s\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}%s\n", name,
+        hist_quantile(hist, 0.5) / 1e3, hist_quantile(hist, 0.99) / 1e3,
+        hist_quantile(hist, 0.999) / 1e3, hist->max / 1e3, last ? "" : ",");
+}
+
+int main(int argc, char* const argv[]) {
+    bench_t* bench = calloc(1, sizeof(bench_t));
+    bench->config = (bench_config_t) {
+        .host = "127.0.0.1",
+        .ports = { SERVER_PORT },
+        .port_qty = 1,
+        .conn_qty = 100,
+        .channel_qty = 10,
+        .rate = 1000,
+        .msg_size = 64,
+        .duration = 10,
+        .recv_threads = 2
+    };
+    bench_config_t* config = &bench->config;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:n:c:r:s:d:t:")) != -1) {
+        switch (opt) {
+            case 'h': config->host = optarg; break;
+            case 'p':
+                config->port_qty = 0;
+                for (char* port = strtok(optarg, ","); port && config->port_qty < BENCH_MAX_PORTS; port = strtok(NULL, ",")) {
+                    config->ports[config->port_qty++] = atoi(port);
+                }
+                break;
+            case 'n': config->conn_qty = atoi(optarg); break;
+            case 'c': config->channel_qty = atoi(optarg); break;
+            case 'r': config->rate = atoi(optarg); break;
+            case 's': config->msg_size = atoi(optarg); break;
+            case 'd': config->duration = atoi(optarg); break;
+            case 't': config->recv_threads = atoi(optarg); break;
+            default: bench_usage(argv[0]);
+        }
+    }
+    if (config->conn_qty < 1 || config->channel_qty < 1 || config->rate < 1 || config->duration < 1 ||
+        config->msg_size < 32 || config->port_qty < 1 || config->msg_size >= MSG_LEN ||
+        config->recv_threads < 1 || config->recv_threads > BENCH_MAX_RECV_THREADS) {
+        bench_usage(argv[0]);
+    }
+
+    // A connection per client, plus the usual handful
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    bench->seq_cap = (uint64_t) config->rate * config->duration;
+    bench->sent_ns = calloc(bench->seq_cap, sizeof(uint64_t));
+    bench->last_ns = calloc(bench->seq_cap, sizeof(uint64_t));
+    bench->conns = calloc(config->conn_qty, sizeof(bench_conn_t));
+    bench->members = calloc(config->channel_qty, sizeof(int));
+    if (!bench->sent_ns || !bench->last_ns || !bench->conns || !bench->members) {
+        perror("main::calloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < config->recv_threads; i++) {
+        bench->receivers[i].bench = bench;
+        bench->receivers[i].epoll = epoll_create1(0);
+    }
+
+    fprintf(stderr, "connecting %d clients to %s:%d (%d servers) over %d channels\n",
+        config->conn_qty, config->host, config->ports[0], config->port_qty, config->channel_qty);
+    for (int i = 0; i < config->conn_qty; i++) {
+        bench_conn_t* conn = &bench->conns[i];
+        conn->channel = i % config->channel_qty;
+        if (!bench_connect(bench, conn, i)) exit(1);
+        bench->members[conn->channel]++;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+        epoll_ctl(bench->receivers[i % config->recv_threads].epoll, EPOLL_CTL_ADD, conn->sock.sock, &event);
+    }
+
+    for (int i = 0; i < config->recv_threads; i++) {
+        pthread_create(&bench->receivers[i].thread, NULL, bench_recv_run, &bench->receivers[i]);
+    }
+
+    // Let the joins settle so nothing is relayed to a half-built channel
+    sleep(1);
+
+    fprintf(stderr, "sending %d msgs/s of %d bytes for %ds\n", config->rate, config->msg_size, config->duration);
+    uint64_t start = metrics_now_ns();
+    bench_send(bench);
+    double send_secs = (metrics_now_ns() - start) / 1e9;
+
+    // Every message goes to the other members of its sender's channel
+    uint64_t expected = 0;
+    for (uint64_t seq = 0; seq < bench->seq_cap; seq++) {
+        if (!bench->sent_ns[seq]) continue;
+        expected += bench->members[bench->conns[seq % config->conn_qty].channel] - 1;
+    }
+
+    // Drain for up to two seconds
+    uint64_t delivered = 0;
+    for (int wait = 0; wait < 200; wait++) {
+        delivered = 0;
+        for (int i = 0; i < config->recv_threads; i++) delivered += __atomic_load_n(&bench->receivers[i].delivered, __ATOMIC_RELAXED);
+        if (delivered >= expected) break;
+        usleep(10000);
+    }
+    double total_secs = (metrics_now_ns() - start) / 1e9;
+
+    __atomic_store_n(&bench->stop, true, __ATOMIC_RELEASE);
+    hist_t* latency = calloc(1, sizeof(hist_t));
+    hist_t* fanout = calloc(1, sizeof(hist_t));
+    delivered = 0;
+    for (int i = 0; i < config->recv_threads; i++) {
+        pthread_join(bench->receivers[i].thread, NULL);
+        hist_merge(latency, &bench->receivers[i].latency);
+        delivered += bench->receivers[i].delivered;
+    }
+    for (uint64_t seq = 0; seq < bench->seq_cap; seq++) {
+        if (bench->sent_ns[seq] && bench->last_ns[seq]) hist_record(fanout, bench->last_ns[seq] - bench->sent_ns[seq]);
+    }
+
+    printf("{\n");
+    printf("  \"connections\": %d,\n  \"channels\": %d,\n  \"rate\": %d,\n  \"msg_size\": %d,\n  \"duration_s\": %d,\n",
+        config->conn_qty, config->channel_qty, config->rate, config->msg_size, config->duration);
+    printf("  \"sent\": %llu,\n  \"expected_deliveries\": %llu,\n  \"delivered\": %llu,\n",
+        (unsigned long long) bench->sent, (unsigned long long) expected, (unsigned long long) delivered);
+    printf("  \"msgs_per_sec\": %.1f,\n  \"deliveries_per_sec\": %.1f,\n",
+        bench->sent / send_secs, delivered / total_secs);
+    bench_print_hist("latency_us", latency, false);
+    bench_print_hist("fanout_latency_us", fanout, true);
+    printf("}\n");
+
+    for (int i = 0; i < config->conn_qty; i++) close(bench->conns[i].sock.sock);
+    return 0;
+}
@@ -0,0 +1,346 @@
+#include "../src/server.h"
+
+// Microbenchmarks for the protocol and dispatch hot paths. Each benchmark is a function that
+// runs its operation iters times; the harness calibrates iters during warmup so a repetition
+// takes about MICRO_REP_NS, runs MICRO_REPS repetitions and reports the median ns/op together
+// with heap allocations per op (malloc and friends are interposed below to count them).
+//
+//   ./irc_microbench [name_filter]
+#define MICRO_REP_NS 100000000ull
+#define MICRO_REPS 5
+#define MICRO_MAX_USERS 10000
+
+static uint64_t micro_allocs = 0;
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t qty, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&micro_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t qty, size_t size) {
+    __atomic_add_fetch(&micro_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(qty, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&micro_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+typedef void (*micro_fn)(void* arg, uint64_t iters);
+
+static char* micro_filter = NULL;
+static volatile uint64_t micro_sink;        // keeps results alive past the optimizer
+
+// Stops the compiler from hoisting a pure call on an unchanged input out of the loop
+#define micro_clobber(ptr) __asm__ volatile("" : : "r"(ptr) : "memory")
+
+static int micro_cmp(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void micro_run(const char* name, micro_fn fn, void* arg) {
+    if (micro_filter && !strstr(name, micro_filter)) return;
+
+    // Warmup doubles as calibration: grow iters until one run takes a tenth of a repetition
+    uint64_t iters = 1;
+    uint64_t elapsed = 0;
+    while (true) {
+        uint64_t start = metrics_now_ns();
+        fn(arg, iters);
+        elapsed = metrics_now_ns() - start;
+        if (elapsed >= MICRO_REP_NS / 10 || iters >= (1ull << 40)) break;
+        iters *= 2;
+    }
+    iters = iters * MICRO_REP_NS / (elapsed ? elapsed : 1);
+    if (!iters) iters = 1;
+
+    double ns_per_op[MICRO_REPS];
+    uint64_t allocs = 0;
+    for (int rep = 0; rep < MICRO_REPS; rep++) {
+        uint64_t allocs_before = __atomic_load_n(&micro_allocs, __ATOMIC_RELAXED);
+        uint64_t start = metrics_now_ns();
+        fn(arg, iters);
+        ns_per_op[rep] = (double) (metrics_now_ns() - start) / iters;
+        allocs += __atomic_load_n(&micro_allocs, __ATOMIC_RELAXED) - allocs_before;
+    }
+    qsort(ns_per_op, MICRO_REPS, sizeof(double), micro_cmp);
+
+    printf("%-32s %12llu %12.1f ns/op %10.2f allocs/op\n", name, (unsigned long long) iters,
+        ns_per_op[MICRO_REPS/2], (double) allocs / (iters * MICRO_REPS));
+    fflush(stdout);
+}
+
+// A server with no sockets: just the registries and one reactor to coalesce sends on
+static server_t* micro_server_new() {
+    server_t* server = calloc(1, sizeof(server_t));
+    server->config = server_config_default();
+    server->epoch = malloc(sizeof(epoch_t));
+    epoch_init(server->epoch);
+    channel_dir_init(&server->channels, server->epoch);
+    table_init(&server->users.table, sizeof(user_t));
+    name_map_init(&server->users.by_name);
+    name_map_init(&server->users.remote);
+    pthread_rwlock_init(&server->users.lock, NULL);
+    name_map_init(&server->fed.users);
+    name_map_init(&server->fed.channels);
+    pthread_rwlock_init(&server->fed.lock, NULL);
+
+    server->reactor_qty = 1;
+    server->reactors = calloc(1, sizeof(reactor_t));
+    server->reactors[0].server = server;
+    server->reactors[0].epoll = -1;
+    return server;
+}
+
+/* parse_msg and irc_parse_cmd */
+
+static void bench_parse_msg(void* arg, uint64_t iters) {
+    char* line = arg;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        micro_clobber(line);
+        sum += parse_msg(line);
+    }
+    micro_sink = sum;
+}
+
+static void bench_parse_cmd(void* arg, uint64_t iters) {
+    char* line = arg;
+    size_t len = strlen(line);
+    char buf[MSG_LEN];
+    irc_cmd_t cmd;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        memcpy(buf, line, len+1);           // the tokenizer terminates words in place
+        irc_parse_cmd(buf, len, &cmd);
+        sum += cmd.type + cmd.argc;
+    }
+    micro_sink = sum;
+}
+
+static void bench_text_parse(void* arg, uint64_t iters) {
+    char* line = arg;
+    size_t len = strlen(line);
+    char buf[MSG_LEN];
+    irc_text_msg_t msg;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        memcpy(buf, line, len+1);
+        irc_text_parse(buf, len, &msg);
+        sum += msg.param_qty;
+    }
+    micro_sink = sum;
+}
+
+/* Framing */
+
+static irc_packet_t micro_pkt(size_t size) {
+    irc_packet_t pkt = { .user = "alice", .length = size };
+    memset(pkt.data, 'x', size);
+    pkt.data[size-1] = '\n';
+    return pkt;
+}
+
+static void bench_frame_v1(void* arg, uint64_t iters) {
+    irc_packet_t* pkt = arg;
+    irc_packet_t out;
+    irc_reader_t* reader = malloc(sizeof(irc_reader_t));
+    for (uint64_t i = 0; i < iters; i++) {
+        reader->start = 0;
+        reader->end = irc_encode(pkt, reader->buf);
+        irc_reader_next(reader, &out);
+    }
+    micro_sink = out.length;
+    free(reader);
+}
+
+static void bench_frame_v2(void* arg, uint64_t iters) {
+    irc_packet_t* pkt = arg;
+    irc_v2_frame_t frame;
+    irc_reader_t* reader = malloc(sizeof(irc_reader_t));
+    for (uint64_t i = 0; i < iters; i++) {
+        reader->start = 0;
+        reader->end = irc_v2_encode(irc_v2_msg, 42, pkt->data, pkt->length, reader->buf);
+        irc_reader_next_v2(reader, &frame);
+    }
+    micro_sink = frame.length;
+    free(reader);
+}
+
+static void bench_frame_socketpair(void* arg, uint64_t iters) {
+    irc_packet_t* pkt = arg;
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    irc_sock_t tx = { .sock = pair[0] };
+    irc_sock_t rx = { .sock = pair[1] };
+
+    irc_packet_t out;
+    for (uint64_t i = 0; i < iters; i++) {
+        irc_send(&tx, pkt, 0);
+        irc_recv(&rx, &out, 0);
+    }
+    micro_sink = out.length;
+    close(pair[0]);
+    close(pair[1]);
+}
+
+/* Fan-out */
+
+typedef struct _micro_fanout {
+    server_t* server;
+    channel_t* channel;
+    user_t* sender;
+    irc_packet_t pkt;
+} micro_fanout_t;
+
+static micro_fanout_t* micro_fanout_new(int members) {
+    micro_fanout_t* fanout = calloc(1, sizeof(micro_fanout_t));
+    server_t* server = fanout->server = micro_server_new();
+
+    channel_t* channel = fanout->channel = calloc(1, sizeof(channel_t));
+    strcpy(channel->name, "#bench");
+    pthread_mutex_init(&channel->lock, NULL);
+    channel->reactor = &server->reactors[0];
+    channel->members = malloc(members * sizeof(user_t*));
+    channel->member_cap = members;
+
+    for (int i = 0; i < members; i++) {
+        char name[IRC_NAME_LEN];
+        snprintf(name, IRC_NAME_LEN, "member%d", i);
+        user_t* user = server_register_user(server, name);
+        user->channel = channel;
+        user->reactor = channel->reactor;
+        channel->members[channel->user_qty++] = user;
+    }
+    fanout->sender = channel->members[0];
+    fanout->pkt = micro_pkt(64);
+    strcpy(fanout->pkt.user, fanout->sender->name);
+    return fanout;
+}
+
+// One relay, then what the reactor's flush would do to the queues minus the syscall
+static void bench_fanout(void* arg, uint64_t iters) {
+    micro_fanout_t* fanout = arg;
+    channel_t* channel = fanout->channel;
+    reactor_t* reactor = channel->reactor;
+
+    current_reactor = reactor;
+    current_metrics = &reactor->metrics;
+    for (uint64_t i = 0; i < iters; i++) {
+        server_relay_msg(fanout->sender, &fanout->pkt);
+
+        for (int n = 0; n < channel->user_qty; n++) {
+            out_queue_t* queue = &channel->members[n]->out;
+            pthread_mutex_lock(&queue->lock);
+            while (queue->qty) out_queue_pop(queue);
+            queue->dirty = false;
+            pthread_mutex_unlock(&queue->lock);
+        }
+        reactor->dirty_qty = 0;
+        reactor->relay_qty = 0;
+    }
+    current_reactor = NULL;
+    current_metrics = NULL;
+}
+
+/* Lookups */
+
+typedef struct _micro_lookup {
+    server_t* server;
+    char (*names)[CHANNEL_NAME_LEN];        // nicknames
+    char (*ch_names)[CHANNEL_NAME_LEN];
+    int qty;
+} micro_lookup_t;
+
+static micro_lookup_t* micro_lookup_new(int qty) {
+    micro_lookup_t* lookup = calloc(1, sizeof(micro_lookup_t));
+    lookup->server = micro_server_new();
+    lookup->names = malloc(qty * sizeof(*lookup->names));
+    lookup->ch_names = malloc(qty * sizeof(*lookup->ch_names));
+    lookup->qty = qty;
+
+    for (int i = 0; i < qty; i++) {
+        snprintf(lookup->names[i], IRC_NAME_LEN, "user%d", i);
+        user_t* user = server_register_user(lookup->server, lookup->names[i]);
+        free(user->in);                     // never reads, keeps the big tables affordable
+        user->in = NULL;
+    }
+    for (int i = 0; i < qty; i++) {
+        snprintf(lookup->ch_names[i], CHANNEL_NAME_LEN, "#chan%d", i);
+        channel_dir_insert(&lookup->server->channels, lookup->ch_names[i], lookup);
+    }
+    return lookup;
+}
+
+static void bench_nick_lookup(void* arg, uint64_t iters) {
+    micro_lookup_t* lookup = arg;
+    uint64_t sum = 0;
+    uint32_t i = 1;
+    for (uint64_t n = 0; n < iters; n++) {
+        i = i * 1103515245 + 12345;
+        sum += (uintptr_t) server_search_client_by_name(lookup->server, lookup->names[i % lookup->qty]);
+    }
+    micro_sink = sum;
+}
+
+static void bench_channel_lookup(void* arg, uint64_t iters) {
+    micro_lookup_t* lookup = arg;
+    uint64_t sum = 0;
+    uint32_t i = 1;
+    epoch_enter(lookup->server->epoch);
+    for (uint64_t n = 0; n < iters; n++) {
+        i = i * 1103515245 + 12345;
+        sum += (uintptr_t) channel_dir_get(&lookup->server->channels, lookup->ch_names[i % lookup->qty]);
+    }
+    epoch_exit(lookup->server->epoch);
+    micro_sink = sum;
+}
+
+int main(int argc, char* const argv[]) {
+    if (argc > 1) micro_filter = argv[1];
+    logger.level = log_level_warn;
+
+    printf("%-32s %12s %18s %20s\n", "benchmark", "iters", "time", "allocs");
+
+    micro_run("parse_msg/message", bench_parse_msg, "hello there, how is everyone doing?\n");
+    micro_run("parse_msg/command", bench_parse_msg, "/nickname alice\n");
+    micro_run("parse_msg/prefix", bench_parse_msg, "/m not a command\n");
+    micro_run("parse_cmd/join", bench_parse_cmd, "/join #channel secret\n");
+    micro_run("text_parse/privmsg", bench_text_parse, ":alice!a@host PRIVMSG #channel :hello there, how is everyone doing?");
+
+    irc_packet_t small = micro_pkt(64);
+    irc_packet_t large = micro_pkt(MSG_LEN-1);
+    micro_run("frame/v1/64B", bench_frame_v1, &small);
+    micro_run("frame/v1/4KB", bench_frame_v1, &large);
+    micro_run("frame/v2/64B", bench_frame_v2, &small);
+    micro_run("frame/v2/4KB", bench_frame_v2, &large);
+    micro_run("frame/socketpair/64B", bench_frame_socketpair, &small);
+    micro_run("frame/socketpair/4KB", bench_frame_socketpair, &large);
+
+    int fanout_sizes[] = { 10, 1000, MICRO_MAX_USERS };
+    for (int i = 0; i < sizeof(fanout_sizes)/sizeof(fanout_sizes[0]); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "fanout/%d", fanout_sizes[i]);
+        if (micro_filter && !strstr(name, micro_filter)) continue;
+        micro_run(name, bench_fanout, micro_fanout_new(fanout_sizes[i]));
+    }
+
+    int lookup_sizes[] = { 100, 10000, 1000000 };
+    for (int i = 0; i < sizeof(lookup_sizes)/sizeof(lookup_sizes[0]); i++) {
+        char nick_name[64], channel_name[64];
+        snprintf(nick_name, sizeof(nick_name), "lookup/nick/%d", lookup_sizes[i]);
+        snprintf(channel_name, sizeof(channel_name), "lookup/channel/%d", lookup_sizes[i]);
+        if (micro_filter && !strstr(nick_name, micro_filter) && !strstr(channel_name, micro_filter)) continue;
+
+        micro_lookup_t* lookup = micro_lookup_new(lookup_sizes[i]);
+        micro_run(nick_name, bench_nick_lookup, lookup);
+        micro_run(channel_name, bench_channel_lookup, lookup);
+    }
+    return 0;
+}
@@ -0,0 +1,135 @@
+#ifndef IRC_BUF_POOL_H_
+#define IRC_BUF_POOL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Size-classed block pool: 64 B, 256 B, 1 KiB, 4 KiB and 16 KiB blocks. Every thread keeps a
+// free list per class, so taking or returning a block is a pointer pop or push without a lock,
+// and whatever a reactor frees it hands out again. A block may be returned by another thread
+// than the one that took it (the last holder of a frame), it just joins that thread's list.
+// Lists trade whole batches with a shared depot: a list grown past two batches spills one, and
+// an empty one takes one back before new blocks are carved out of a slab, so a thread that
+// mostly frees (a fan-out worker) feeds the ones that mostly allocate and the lock is taken
+// once per batch. Slabs are never given back to malloc, like table chunks the pool keeps what
+// the busiest moment needed. Bigger requests go straight to malloc.
+#define BUF_POOL_CLASSES 5
+#define BUF_POOL_MIN_SHIFT 6                // 64 B
+#define BUF_POOL_CLASS_SHIFT 2              // each class 4x the one below
+#define BUF_POOL_MAX ((size_t) 1 << (BUF_POOL_MIN_SHIFT + BUF_POOL_CLASS_SHIFT * (BUF_POOL_CLASSES-1)))
+#define BUF_POOL_BATCH_BYTES (64 << 10)     // a slab, and what lists trade with the depot
+
+typedef struct _buf_block {
+    struct _buf_block* next;
+    struct _buf_block* next_batch;          // in the depot, on the first block of each batch
+} buf_block_t;
+
+typedef struct _buf_list {
+    buf_block_t* head;
+    uint32_t qty;
+} buf_list_t;
+
+typedef struct _buf_depot {
+    pthread_mutex_t lock;
+    buf_block_t* batches;                   // full batches spilled by any thread
+} buf_depot_t;
+
+static __thread buf_list_t buf_lists[BUF_POOL_CLASSES];
+static buf_depot_t buf_depots[BUF_POOL_CLASSES] = {
+    [0 ... BUF_POOL_CLASSES-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Smallest class that fits size, BUF_POOL_CLASSES if none does
+static inline int buf_pool_class(size_t size) {
+    if (size <= (1 << BUF_POOL_MIN_SHIFT)) return 0;
+    if (size > BUF_POOL_MAX) return BUF_POOL_CLASSES;
+    int bits = 64 - __builtin_clzll(size - 1);
+    return (bits - BUF_POOL_MIN_SHIFT + BUF_POOL_CLASS_SHIFT - 1) / BUF_POOL_CLASS_SHIFT;
+}
+
+// Bytes a block for size really takes: its class's block size, or size itself past the pool
+static inline size_t buf_pool_block_size(size_t size) {
+    int class = buf_pool_class(size);
+    return class == BUF_POOL_CLASSES ? size : (size_t) 1 << (BUF_POOL_MIN_SHIFT + BUF_POOL_CLASS_SHIFT * class);
+}
+
+static inline uint32_t buf_pool_batch(int class) {
+    return BUF_POOL_BATCH_BYTES >> (BUF_POOL_MIN_SHIFT + BUF_POOL_CLASS_SHIFT * class);
+}
+
+// Fills an empty list with a batch from the depot, or else a new slab
+static bool buf_pool_refill(int class, buf_list_t* list) {
+    buf_depot_t* depot = &buf_depots[class];
+    pthread_mutex_lock(&depot->lock);
+    buf_block_t* batch = depot->batches;
+    if (batch) depot->batches = batch->next_batch;
+    pthread_mutex_unlock(&depot->lock);
+
+    if (!batch) {
+        char* slab = malloc(BUF_POOL_BATCH_BYTES);
+        if (!slab) {
+            perror("buf_pool_refill::malloc");
+            return false;
+        }
+        size_t block_size = (size_t) 1 << (BUF_POOL_MIN_SHIFT + BUF_POOL_CLASS_SHIFT * class);
+        uint32_t qty = buf_pool_batch(class);
+        for (uint32_t i = 0; i < qty; i++) {
+            ((buf_block_t*) (slab + i * block_size))->next = i+1 < qty ? (buf_block_t*) (slab + (i+1) * block_size) : NULL;
+        }
+        batch = (buf_block_t*) slab;
+    }
+
+    list->head = batch;
+    list->qty = buf_pool_batch(class);
+    return true;
+}
+
+// Moves the first batch of a list grown past two of them to the depot
+static void buf_pool_spill(int class, buf_list_t* list) {
+    uint32_t qty = buf_pool_batch(class);
+    buf_block_t* batch = list->head;
+    buf_block_t* last = batch;
+    for (uint32_t i = 1; i < qty; i++) last = last->next;
+    list->head = last->next;
+    list->qty -= qty;
+    last->next = NULL;
+
+    buf_depot_t* depot = &buf_depots[class];
+    pthread_mutex_lock(&depot->lock);
+    batch->next_batch = depot->batches;
+    depot->batches = batch;
+    pthread_mutex_unlock(&depot->lock);
+}
+
+// Uninitialized block of at least size bytes, NULL if out of memory
+void* buf_pool_alloc(size_t size) {
+    int class = buf_pool_class(size);
+    if (class == BUF_POOL_CLASSES) return malloc(size);
+
+    buf_list_t* list = &buf_lists[class];
+    if (!list->head && !buf_pool_refill(class, list)) return NULL;
+    buf_block_t* block = list->head;
+    list->head = block->next;
+    list->qty--;
+    return block;
+}
+
+// size must be what the block was allocated with
+void buf_pool_free(void* ptr, size_t size) {
+    int class = buf_pool_class(size);
+    if (class == BUF_POOL_CLASSES) {
+        free(ptr);
+        return;
+    }
+
+    buf_list_t* list = &buf_lists[class];
+    buf_block_t* block = ptr;
+    block->next = list->head;
+    list->head = block;
+    if (++list->qty >= 2 * buf_pool_batch(class)) buf_pool_spill(class, list);
+}
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef IRC_CHANNEL_DIR_H_
+#define IRC_CHANNEL_DIR_H_
+
+#include "epoch.h"
+#include "name_map.h"
+
+// Growable chained hash map from channel name to channel, built for lock-free reads.
+// Lookups only need to run inside an epoch section: buckets and links are published with
+// release stores, and unlinked nodes (or a whole bucket array replaced by a resize) are
+// handed to the epoch domain instead of being freed in place. Inserts and removals
+// serialize on write_lock, so only channel creation and destruction ever wait.
+#define CHANNEL_DIR_MIN_BUCKETS 64
+
+typedef struct _dir_node {
+    struct _dir_node* next;
+    void* value;
+    uint32_t hash;
+    char key[];
+} dir_node_t;
+
+typedef struct _dir_table {
+    uint32_t mask;
+    dir_node_t* buckets[];
+} dir_table_t;
+
+typedef struct _channel_dir {
+    dir_table_t* table;                     // current snapshot, swapped whole on resize
+    uint32_t qty;
+    pthread_mutex_t write_lock;
+    epoch_t* epoch;
+} channel_dir_t;
+
+static dir_table_t* dir_table_new(uint32_t bucket_qty) {
+    dir_table_t* table = calloc(1, sizeof(dir_table_t) + bucket_qty * sizeof(dir_node_t*));
+    if (!table) {
+        perror("dir_table_new::calloc");
+        exit(1);
+    }
+    table->mask = bucket_qty-1;
+    return table;
+}
+
+static dir_node_t* dir_node_new(const char* key, uint32_t hash, void* value) {
+    size_t key_len = strlen(key);
+    dir_node_t* node = malloc(sizeof(dir_node_t) + key_len+1);
+    if (!node) {
+        perror("dir_node_new::malloc");
+        exit(1);
+    }
+    memcpy(node->key, key, key_len+1);
+    node->hash = hash;
+    node->value = value;
+    node->next = NULL;
+    return node;
+}
+
+// Frees a table snapshot together with the node chains only it references
+static void dir_table_free(void* ptr) {
+    dir_table_t* table = ptr;
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        dir_node_t* node = table->buckets[i];
+        while (node) {
+            dir_node_t* next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    free(table);
+}
+
+void channel_dir_init(channel_dir_t* dir, epoch_t* epoch) {
+    dir->table = dir_table_new(CHANNEL_DIR_MIN_BUCKETS);
+    dir->qty = 0;
+    dir->epoch = epoch;
+    pthread_mutex_init(&dir->write_lock, NULL);
+}
+
+// Lock-free, caller must be inside an epoch section for as long as it uses the result
+void* channel_dir_get(channel_dir_t* dir, const char* key) {
+    uint32_t hash = hash_name(key);
+    dir_table_t* table = __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+
+    dir_node_t* node = __atomic_load_n(&table->buckets[hash & table->mask], __ATOMIC_ACQUIRE);
+    for (; node; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) {
+        if (node->hash == hash && !strcmp(node->key, key)) return node->value;
+    }
+    return NULL;
+}
+
+// Lock-free walk over every entry, same rules as channel_dir_get. Entries inserted or
+// removed meanwhile may or may not be visited.
+void channel_dir_foreach(channel_dir_t* dir, void (*fn)(void* value, void* arg), void* arg) {
+    dir_table_t* table = __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i <= table->mask; i++) {
+        dir_node_t* node = __atomic_load_n(&table->buckets[i], __ATOMIC_ACQUIRE);
+        for (; node; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) fn(node->value, arg);
+    }
+}
+
+// Rebuilds every chain into a table twice as large, then publishes it. Needs write_lock.
+static void channel_dir_grow(channel_dir_t* dir) {
+    dir_table_t* old = dir->table;
+    dir_table_t* table = dir_table_new((old->mask+1) * 2);
+
+    for (uint32_t i = 0; i <= old->mask; i++) {
+        for (dir_node_t* node = old->buckets[i]; node; node = node->next) {
+            dir_node_t* copy = dir_node_new(node->key, node->hash, node->value);
+            copy->next = table->buckets[node->hash & table->mask];
+            table->buckets[node->hash & table->mask] = copy;
+        }
+    }
+
+    __atomic_store_n(&dir->table, table, __ATOMIC_RELEASE);
+    epoch_retire(dir->epoch, old, dir_table_free);
+}
+
+// Fails (returning the current value) if the key is already present
+void* channel_dir_insert(channel_dir_t* dir, const char* key, void* value) {
+    pthread_mutex_lock(&dir->write_lock);
+
+    void* existing = channel_dir_get(dir, key);
+    if (existing) {
+        pthread_mutex_unlock(&dir->write_lock);
+        return existing;
+    }
+
+    if (dir->qty+1 > dir->table->mask+1) channel_dir_grow(dir);
+
+    uint32_t hash = hash_name(key);
+    dir_node_t* node = dir_node_new(key, hash, value);
+    dir_node_t** bucket = &dir->table->buckets[hash & dir->table->mask];
+    node->next = *bucket;
+    __atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+    dir->qty++;
+
+    pthread_mutex_unlock(&dir->write_lock);
+    return NULL;
+}
+
+void* channel_dir_remove(channel_dir_t* dir, const char* key) {
+    pthread_mutex_lock(&dir->write_lock);
+
+    uint32_t hash = hash_name(key);
+    dir_node_t** link = &dir->table->buckets[hash & dir->table->mask];
+    for (; *link; link = &(*link)->next) {
+        dir_node_t* node = *link;
+        if (node->hash != hash || strcmp(node->key, key)) continue;
+
+        void* value = node->value;
+        __atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+        dir->qty--;
+        epoch_retire(dir->epoch, node, free);
+
+        pthread_mutex_unlock(&dir->write_lock);
+        return value;
+    }
+
+    pthread_mutex_unlock(&dir->write_lock);
+    return NULL;
+}
+
+#endif
@@ -55,6 +55,7 @@ void* client_recv_msgs(void* args) {
             perror("client_recv_msgs");
             continue;
         }
+        if (!pkt.length) continue;          // keepalive probe, see irc_v2_ping
 
         if (client->changing_name) {
             char* res = strstr(pkt.data, "ok");
@@ -128,6 +129,9 @@ int main(int argc, char const *argv[]) {
             case cmd_mute:
             case cmd_unmute:
             case cmd_whois:
+            case cmd_stats:
+            case cmd_part:
+            case cmd_history:
             case cmd_msg:
             case cmd_ping: {
                 if (!client_is_connected(&client)) {
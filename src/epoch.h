@@ -0,0 +1,125 @@
+#ifndef IRC_EPOCH_H_
+#define IRC_EPOCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+// Epoch-based reclamation. Readers bracket their accesses with epoch_enter/epoch_exit and
+// never take a lock; writers unlink an object first and then epoch_retire it. A retired
+// object is only freed once every thread that could still be reading it has left its
+// critical section, i.e. two epochs later.
+#define EPOCH_MAX_THREADS 256
+#define EPOCH_ACTIVE 1ull
+
+typedef struct _epoch_slot {
+    _Alignas(64) uint64_t local;            // (observed epoch << 1) | EPOCH_ACTIVE, 0 when idle
+} epoch_slot_t;
+
+typedef struct _epoch_retired {
+    struct _epoch_retired* next;
+    void* ptr;
+    void (*free_fn)(void*);
+    uint64_t epoch;
+} epoch_retired_t;
+
+typedef struct _epoch {
+    _Alignas(64) uint64_t global;
+    epoch_slot_t slots[EPOCH_MAX_THREADS];
+    int slot_qty;
+    pthread_mutex_t lock;                   // guards registration and the retired list
+    epoch_retired_t* retired;
+} epoch_t;
+
+static __thread int epoch_thread_slot = -1;
+
+void epoch_init(epoch_t* epoch) {
+    memset(epoch, 0, sizeof(epoch_t));
+    pthread_mutex_init(&epoch->lock, NULL);
+}
+
+static epoch_slot_t* epoch_my_slot(epoch_t* epoch) {
+    if (epoch_thread_slot == -1) {
+        pthread_mutex_lock(&epoch->lock);
+        if (epoch->slot_qty == EPOCH_MAX_THREADS) {
+            fprintf(stderr, "epoch_my_slot::too many threads\n");
+            exit(1);
+        }
+        epoch_thread_slot = epoch->slot_qty;
+        __atomic_store_n(&epoch->slot_qty, epoch->slot_qty+1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&epoch->lock);
+    }
+    return &epoch->slots[epoch_thread_slot];
+}
+
+void epoch_enter(epoch_t* epoch) {
+    epoch_slot_t* slot = epoch_my_slot(epoch);
+    uint64_t global = __atomic_load_n(&epoch->global, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&slot->local, (global << 1) | EPOCH_ACTIVE, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(epoch_t* epoch) {
+    __atomic_store_n(&epoch_my_slot(epoch)->local, 0, __ATOMIC_RELEASE);
+}
+
+// Bumps the global epoch if every active reader has already observed it. Needs epoch->lock.
+static void epoch_try_advance(epoch_t* epoch) {
+    uint64_t global = __atomic_load_n(&epoch->global, __ATOMIC_ACQUIRE);
+    int slot_qty = __atomic_load_n(&epoch->slot_qty, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < slot_qty; i++) {
+        uint64_t local = __atomic_load_n(&epoch->slots[i].local, __ATOMIC_SEQ_CST);
+        if ((local & EPOCH_ACTIVE) && (local >> 1) != global) return;
+    }
+    __atomic_store_n(&epoch->global, global+1, __ATOMIC_RELEASE);
+}
+
+// Frees everything retired at least two epochs ago. Needs epoch->lock.
+static void epoch_collect(epoch_t* epoch) {
+    uint64_t global = __atomic_load_n(&epoch->global, __ATOMIC_ACQUIRE);
+    epoch_retired_t** link = &epoch->retired;
+    while (*link) {
+        epoch_retired_t* item = *link;
+        if (item->epoch+2 <= global) {
+            *link = item->next;
+            item->free_fn(item->ptr);
+            free(item);
+        } else {
+            link = &item->next;
+        }
+    }
+}
+
+// Defers free_fn(ptr) until no reader can still hold ptr. ptr must already be unreachable.
+void epoch_retire(epoch_t* epoch, void* ptr, void (*free_fn)(void*)) {
+    epoch_retired_t* item = malloc(sizeof(epoch_retired_t));
+    if (!item) {
+        perror("epoch_retire::malloc");
+        return;
+    }
+
+    pthread_mutex_lock(&epoch->lock);
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    item->epoch = __atomic_load_n(&epoch->global, __ATOMIC_ACQUIRE);
+    item->next = epoch->retired;
+    epoch->retired = item;
+
+    epoch_try_advance(epoch);
+    epoch_collect(epoch);
+    pthread_mutex_unlock(&epoch->lock);
+}
+
+// Cheap opportunistic reclamation for threads that read but rarely retire (e.g. reactors)
+void epoch_poll(epoch_t* epoch) {
+    if (!__atomic_load_n(&epoch->retired, __ATOMIC_RELAXED)) return;
+    if (pthread_mutex_trylock(&epoch->lock) != 0) return;
+
+    epoch_try_advance(epoch);
+    epoch_collect(epoch);
+    pthread_mutex_unlock(&epoch->lock);
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef IRC_FANOUT_H_
+#define IRC_FANOUT_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Work-stealing pool that runs one loop over [0, qty) as ranges on several threads at once.
+// fanout_run hands tickets for its job out round-robin to the workers' deques; whoever holds a
+// ticket claims the job's next unclaimed range, if any is left. The caller claims ranges of its
+// own job as well, so a pool with busy workers degrades to the caller doing the whole loop, but
+// never another job's: one relay's latency does not absorb another channel's fan-out. With
+// nothing left to claim it takes its queued tickets back and sleeps until the ranges other
+// threads still run are done. A worker pops its own deque from the back and, once that is
+// empty, steals from the front of the others', so one slow range never leaves the rest of the
+// pool idle. Deques are short and their ranges big, a plain mutex per deque is all the
+// synchronization they need.
+#define FANOUT_DEQUE_CAP 64                 // a full deque gets no ticket, the caller claims that range
+
+typedef struct _fanout_job fanout_job_t;
+
+// Embedded at the start of the caller's job struct; run gets the job back to reach the rest.
+// fanout_run sets up everything but run.
+struct _fanout_job {
+    void (*run)(fanout_job_t* job, int begin, int end);    // one range, on any thread
+    int qty;
+    int range_len;
+    int range_qty;
+    int next_range;                         // atomic, first range nobody claimed yet
+    int remaining;                          // ranges not done yet, under lock
+    int tickets;                            // tickets in the deques or being handled, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t done;                    // remaining and tickets both reached 0
+};
+
+// A ticket: whoever takes it runs one range of job, unless the job ran out of them
+typedef struct _fanout_task {
+    fanout_job_t* job;
+} fanout_task_t;
+
+typedef struct _fanout_deque {
+    pthread_mutex_t lock;
+    fanout_task_t tasks[FANOUT_DEQUE_CAP];
+    uint32_t head;                          // thieves take here
+    uint32_t tail;                          // the owner pushes and pops here
+} fanout_deque_t;
+
+// Written under the deque's lock, but peeked at without it
+#define fanout_deque_set(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define fanout_deque_empty(deque) \
+    (__atomic_load_n(&(deque)->tail, __ATOMIC_RELAXED) == __atomic_load_n(&(deque)->head, __ATOMIC_RELAXED))
+
+typedef struct _fanout_pool fanout_pool_t;
+
+typedef struct _fanout_worker {
+    pthread_t thread;
+    int id;
+    fanout_deque_t deque;
+    void* ctx;                              // the owner's per-worker state, handed to enter and after
+    fanout_pool_t* pool;
+} fanout_worker_t;
+
+struct _fanout_pool {
+    fanout_worker_t* workers;
+    int worker_qty;
+    int queued;                             // tasks sitting in any deque
+    int sleeping;                           // workers waiting on idle_cond
+    uint32_t next_worker;                   // round-robin start of the next fanout_run
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    void (*enter)(void* ctx);               // run once by each worker thread before its first task
+    void (*after)(void* ctx);               // run by a worker after each task, before it counts as done
+};
+
+static bool fanout_deque_push(fanout_deque_t* deque, fanout_task_t* task) {
+    pthread_mutex_lock(&deque->lock);
+    bool pushed = deque->tail - deque->head < FANOUT_DEQUE_CAP;
+    if (pushed) {
+        deque->tasks[deque->tail % FANOUT_DEQUE_CAP] = *task;
+        fanout_deque_set(deque->tail, deque->tail+1);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return pushed;
+}
+
+// back = true pops the owner's end
+static bool fanout_deque_take(fanout_deque_t* deque, fanout_task_t* task, bool back) {
+    pthread_mutex_lock(&deque->lock);
+    bool taken = deque->tail != deque->head;
+    if (taken && back) {
+        fanout_deque_set(deque->tail, deque->tail-1);
+        *task = deque->tasks[deque->tail % FANOUT_DEQUE_CAP];
+    } else if (taken) {
+        *task = deque->tasks[deque->head % FANOUT_DEQUE_CAP];
+        fanout_deque_set(deque->head, deque->head+1);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+// Takes a task from the front of any deque, starting after start; false if all are empty
+static bool fanout_steal(fanout_pool_t* pool, int start, fanout_task_t* task) {
+    for (int i = 1; i <= pool->worker_qty; i++) {
+        fanout_worker_t* victim = &pool->workers[(start + i) % pool->worker_qty];
+        if (fanout_deque_empty(&victim->deque)) continue;           // rechecked under the lock
+        if (fanout_deque_take(&victim->deque, task, false)) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Removes every ticket of job from the deque; returns how many
+static int fanout_deque_purge(fanout_deque_t* deque, fanout_job_t* job) {
+    pthread_mutex_lock(&deque->lock);
+    uint32_t kept = deque->head;
+    for (uint32_t i = deque->head; i != deque->tail; i++) {
+        fanout_task_t* task = &deque->tasks[i % FANOUT_DEQUE_CAP];
+        if (task->job != job) deque->tasks[kept++ % FANOUT_DEQUE_CAP] = *task;
+    }
+    int purged = deque->tail - kept;
+    fanout_deque_set(deque->tail, kept);
+    pthread_mutex_unlock(&deque->lock);
+    return purged;
+}
+
+// Claims and runs the job's next range, for a ticket or for the caller; false if every range was
+// claimed already. Once the last range and ticket are counted the job may be gone, its
+// fanout_run having returned.
+static bool fanout_job_step(fanout_job_t* job, bool ticket, void (*after)(void* ctx), void* ctx) {
+    int range = __atomic_fetch_add(&job->next_range, 1, __ATOMIC_RELAXED);
+    bool claimed = range < job->range_qty;
+    if (claimed) {
+        int begin = range * job->range_len;
+        int end = range+1 < job->range_qty ? begin + job->range_len : job->qty;
+        job->run(job, begin, end);
+        if (after) after(ctx);
+    } else if (!ticket) {
+        return false;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->remaining -= claimed;
+    job->tickets -= ticket;
+    if (!job->remaining && !job->tickets) pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+    return claimed;
+}
+
+static void* fanout_worker_run(void* arg) {
+    fanout_worker_t* worker = arg;
+    fanout_pool_t* pool = worker->pool;
+    if (pool->enter) pool->enter(worker->ctx);
+
+    while (true) {
+        fanout_task_t task;
+        bool own = fanout_deque_take(&worker->deque, &task, true);
+        if (own) __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        if (own || fanout_steal(pool, worker->id, &task)) {
+            fanout_job_step(task.job, true, pool->after, worker->ctx);
+            continue;
+        }
+
+        // queued and sleeping are both sequentially consistent: either fanout_run sees this
+        // worker asleep and wakes it, or the worker sees the new tasks and does not sleep
+        pthread_mutex_lock(&pool->idle_lock);
+        __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+    return NULL;
+}
+
+// Workers get their ctx set before fanout_pool_start
+void fanout_pool_init(fanout_pool_t* pool, int worker_qty, void (*enter)(void* ctx), void (*after)(void* ctx)) {
+    *pool = (fanout_pool_t) { .worker_qty = worker_qty, .enter = enter, .after = after };
+    pool->workers = calloc(worker_qty, sizeof(fanout_worker_t));
+    if (!pool->workers) {
+        perror("fanout_pool_init::calloc");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (int i = 0; i < worker_qty; i++) {
+        pool->workers[i].id = i;
+        pool->workers[i].pool = pool;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+    }
+}
+
+void fanout_pool_start(fanout_pool_t* pool) {
+    for (int i = 0; i < pool->worker_qty; i++) {
+        pthread_create(&pool->workers[i].thread, NULL, fanout_worker_run, &pool->workers[i]);
+    }
+}
+
+// Runs job over [0, qty) in ranges of at most range_len and returns once all of them are done.
+// The calling thread must not be one of the pool's workers.
+void fanout_run(fanout_pool_t* pool, fanout_job_t* job, int qty, int range_len) {
+    job->qty = qty;
+    job->range_len = range_len;
+    job->range_qty = (qty + range_len - 1) / range_len;
+    job->next_range = 0;
+    job->remaining = job->range_qty;
+    job->tickets = job->range_qty - 1;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    // One ticket per range but the one that stays here; a full deque just gets none, the
+    // caller claims that range itself
+    uint32_t start = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+    int pushed = 0;
+    fanout_task_t task = { .job = job };
+    for (int i = 1; i < job->range_qty && pool->worker_qty; i++) {
+        if (fanout_deque_push(&pool->workers[(start + i) % pool->worker_qty].deque, &task)) pushed++;
+    }
+    pthread_mutex_lock(&job->lock);
+    job->tickets -= job->range_qty - 1 - pushed;
+    pthread_mutex_unlock(&job->lock);
+    if (pushed) {
+        __atomic_add_fetch(&pool->queued, pushed, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+
+    // Help with this job's ranges only. Tickets still queued then have nothing left to claim,
+    // taking them back leaves only the threads already running a range (or about to find none)
+    // to wait for.
+    while (fanout_job_step(job, false, NULL, NULL));
+
+    int purged = 0;
+    for (int i = 0; pushed && i < pool->worker_qty; i++) purged += fanout_deque_purge(&pool->workers[i].deque, job);
+    if (purged) __atomic_sub_fetch(&pool->queued, purged, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&job->lock);
+    job->tickets -= purged;
+    while (job->remaining || job->tickets) pthread_cond_wait(&job->done, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->lock);
+}
+
+#endif
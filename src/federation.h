@@ -0,0 +1,539 @@
+#ifndef IRC_FEDERATION_H_
+#define IRC_FEDERATION_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
+#include "irc.h"
+#include "metrics.h"
+#include "out_queue.h"
+#include "shared_buf.h"
+
+// Server-to-server links. Servers link up into a spanning tree over TCP: every server listens
+// for peers and may dial any number of others, and a link that would close a loop is refused
+// during the handshake. Each link has a thread of its own that reads the peer's frames and hands
+// them to the owner, and writes whatever other threads queue for the peer, coalesced like a
+// user's outbound queue. Dialled links are redialled whenever they drop.
+//
+//   frame = varint(len) type origin:u32 seq:u64 server:u32 uid:u64
+//           varint(len) name  varint(len) channel  varint(len) data
+//
+// Integers are little endian and every field is always there, unused ones empty. (origin, seq)
+// is the message ID: origin is the server that put the frame onto the network, seq grows with
+// every frame it sends. A server passes each frame on at most once, so a duplicate (a loop
+// formed by links racing each other, or a frame redelivered around a netsplit) is dropped at
+// the first server that already had it.
+#define FED_LINKS_MAX 16                    // links per server, dialled ones included
+#define FED_SERVERS_MAX 64                  // servers one network may hold
+#define FED_NAME_LEN 64
+#define FED_HEADER_MAX (IRC_VARINT_MAX + 1 + 4 + 8 + 4 + 8 + 3*IRC_VARINT_MAX)
+#define FED_FRAME_MAX (FED_HEADER_MAX + IRC_NAME_LEN + CHANNEL_NAME_LEN + MSG_LEN)
+#define FED_WINDOW 4096                     // seqs per origin a duplicate is caught within
+#define FED_QUEUE_BYTES (64 << 20)          // a peer further behind than this is hung up on
+#define FED_HELLO_TIMEOUT_MS 5000
+#define FED_RETRY_MS 1000                   // between dial attempts, doubled after every refusal
+#define FED_RETRY_MAX_MS 30000
+#define FED_EVENT_QTY 8
+
+typedef enum _fed_type {
+    fed_hello = 1,                          // server, name: the sender; data: ids of every server it knows
+    fed_server = 2,                         // server, name: a server reachable through the sender
+    fed_squit = 3,                          // server: unreachable from now on, its users with it
+    fed_nick = 4,                           // server, uid, name: a user of server registered or renamed
+    fed_quit = 5,                           // server, uid
+    fed_join = 6,                           // server, uid, channel
+    fed_part = 7,                           // server, uid, channel
+    fed_msg = 8,                            // server, uid, name (the sender's), channel, data
+} fed_type_e;
+
+typedef struct _fed_event {
+    uint8_t type;
+    uint32_t origin;
+    uint64_t seq;
+    uint32_t server;
+    uint64_t uid;
+    const char* name;                       // not NUL terminated, points into the frame
+    uint32_t name_len;
+    const char* channel;
+    uint32_t channel_len;
+    const char* data;
+    uint32_t data_len;
+} fed_event_t;
+
+static size_t fed_put_str(char* out, const char* str, uint32_t len) {
+    size_t at = irc_varint_encode(len, (uint8_t*) out);
+    if (len) memcpy(out + at, str, len);
+    return at + len;
+}
+
+// One shareable frame holding event; NULL on allocation failure
+shared_buf_t* fed_encode(fed_event_t* event) {
+    size_t body = 1 + 4 + 8 + 4 + 8 + 3*IRC_VARINT_MAX + event->name_len + event->channel_len + event->data_len;
+    shared_buf_t* frame = shared_buf_new(IRC_VARINT_MAX + body);
+    if (!frame) return NULL;
+
+    char tmp[1 + 4 + 8 + 4 + 8];
+    uint32_t origin = htole32(event->origin), server = htole32(event->server);
+    uint64_t seq = htole64(event->seq), uid = htole64(event->uid);
+    tmp[0] = event->type;
+    memcpy(tmp + 1, &origin, 4);
+    memcpy(tmp + 5, &seq, 8);
+    memcpy(tmp + 13, &server, 4);
+    memcpy(tmp + 17, &uid, 8);
+
+    // The length goes first but is only known at the end: write the body behind its widest varint
+    char* at = frame->data + IRC_VARINT_MAX;
+    size_t len = sizeof(tmp);
+    memcpy(at, tmp, sizeof(tmp));
+    len += fed_put_str(at + len, event->name, event->name_len);
+    len += fed_put_str(at + len, event->channel, event->channel_len);
+    len += fed_put_str(at + len, event->data, event->data_len);
+
+    uint8_t len_buf[IRC_VARINT_MAX];
+    size_t len_size = irc_varint_encode(len, len_buf);
+    memmove(frame->data + len_size, at, len);
+    memcpy(frame->data, len_buf, len_size);
+    frame->len = len_size + len;
+    return frame;
+}
+
+static bool fed_get_str(const uint8_t** in, const uint8_t* end, const char** str, uint32_t* len) {
+    int size = irc_varint_decode(*in, end - *in, len);
+    if (size <= 0 || *len > (size_t) (end - *in - size)) return false;
+    *str = (const char*) *in + size;
+    *in += size + *len;
+    return true;
+}
+
+// Like irc_reader_next_v2: event's strings point into the reader until its next fill, and so
+// do raw and raw_len, the whole frame as it came (to pass it on unchanged)
+irc_read_status_e fed_reader_next(irc_reader_t* reader, fed_event_t* event, const char** raw, size_t* raw_len) {
+    const uint8_t* in = (const uint8_t*) reader->buf + reader->start;
+    size_t buffered = reader->end - reader->start;
+
+    uint32_t len;
+    int len_size = irc_varint_decode(in, buffered, &len);
+    if (len_size == 0) return irc_read_more;
+    if (len_size < 0 || len < 25 + 3 || len > FED_FRAME_MAX) return irc_read_invalid;
+    if (buffered < len_size + len) return irc_read_more;
+
+    const uint8_t* body = in + len_size;
+    const uint8_t* end = body + len;
+    uint32_t origin, server;
+    uint64_t seq, uid;
+    event->type = body[0];
+    memcpy(&origin, body + 1, 4);
+    memcpy(&seq, body + 5, 8);
+    memcpy(&server, body + 13, 4);
+    memcpy(&uid, body + 17, 8);
+    event->origin = le32toh(origin);
+    event->seq = le64toh(seq);
+    event->server = le32toh(server);
+    event->uid = le64toh(uid);
+
+    const uint8_t* at = body + 25;
+    if (!fed_get_str(&at, end, &event->name, &event->name_len) ||
+        !fed_get_str(&at, end, &event->channel, &event->channel_len) ||
+        !fed_get_str(&at, end, &event->data, &event->data_len)) return irc_read_invalid;
+
+    *raw = (const char*) in;
+    *raw_len = len_size + len;
+    reader->start += len_size + len;
+    return irc_read_frame;
+}
+
+// Seqs of one origin seen so far: every one up to FED_WINDOW behind the highest is tracked
+// exactly, anything older counts as seen. Links reorder frames only slightly (senders race to
+// queue them), so in practice nothing new is ever that old.
+typedef struct _fed_window {
+    uint32_t origin;                        // 0 = unused slot
+    uint64_t top;                           // highest seq seen
+    uint64_t bits[FED_WINDOW/64];           // bit seq % FED_WINDOW, for seqs within the window
+} fed_window_t;
+
+// true the first time seq shows up
+static bool fed_window_admit(fed_window_t* window, uint64_t seq) {
+    if (seq > window->top) {
+        if (seq - window->top >= FED_WINDOW) {
+            memset(window->bits, 0, sizeof(window->bits));
+        } else {
+            for (uint64_t s = window->top+1; s < seq; s++) window->bits[s/64 % (FED_WINDOW/64)] &= ~(1ull << (s%64));
+        }
+        window->top = seq;
+    } else if (window->top - seq >= FED_WINDOW) {
+        return false;
+    } else if (window->bits[seq/64 % (FED_WINDOW/64)] & (1ull << (seq%64))) {
+        return false;
+    }
+
+    window->bits[seq/64 % (FED_WINDOW/64)] |= 1ull << (seq%64);
+    return true;
+}
+
+typedef struct _fed_links fed_links_t;
+
+typedef struct _fed_link {
+    pthread_t thread;
+    int id;
+    fed_links_t* links;
+    char* dial;                             // "host:port" this link keeps dialling, NULL = takes accepted peers
+    int sock;                               // -1 while down, only the link's thread touches it
+    int epoll;
+    int wake;                               // eventfd other threads poke after queuing the first frame
+    out_queue_t out;                        // frames for the peer
+    irc_reader_t* in;
+    uint32_t peer;                          // id the peer said hello with, 0 while down
+    bool want_out;                          // EPOLLOUT armed
+    bool started;                           // thread running (accepted-peer slots start on first use)
+    int handed;                             // accepted socket waiting for the thread, -1 = none (under links->lock)
+    void* ctx;                              // the owner's per-link state
+} fed_link_t;
+
+// What the owner does with a link, all of it on the link's thread
+typedef struct _fed_hooks {
+    void (*enter)(fed_link_t* link);                        // once, before the link's first peer
+    shared_buf_t* (*hello)(fed_links_t* links);             // this server's hello, encoded
+    bool (*greet)(fed_link_t* link, fed_event_t* hello);    // peer said hello: false refuses it
+    void (*frame)(fed_link_t* link, fed_event_t* event, const char* raw, size_t raw_len);
+    void (*idle)(fed_link_t* link);                         // after every batch of frames read
+    void (*down)(fed_link_t* link);                         // the peer went away (it had been greeted)
+} fed_hooks_t;
+
+struct _fed_links {
+    fed_link_t links[FED_LINKS_MAX];
+    int dial_qty;                           // dialled links come first
+    uint32_t up;                            // bit per link greeted and not down yet
+    pthread_mutex_t lock;                   // hands accepted sockets to links
+    pthread_cond_t handed_cond;
+    int listen_sock;                        // -1 = no peer listener
+    pthread_t accept_thread;
+    fed_hooks_t hooks;
+    void* owner;
+    pthread_mutex_t window_lock;
+    fed_window_t windows[FED_SERVERS_MAX];
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t duplicates;
+};
+
+void fed_links_init(fed_links_t* links, fed_hooks_t* hooks, void* owner) {
+    memset(links, 0, sizeof(fed_links_t));
+    links->hooks = *hooks;
+    links->owner = owner;
+    links->listen_sock = -1;
+    pthread_mutex_init(&links->lock, NULL);
+    pthread_cond_init(&links->handed_cond, NULL);
+    pthread_mutex_init(&links->window_lock, NULL);
+
+    for (int i = 0; i < FED_LINKS_MAX; i++) {
+        fed_link_t* link = &links->links[i];
+        link->id = i;
+        link->links = links;
+        link->sock = -1;
+        link->handed = -1;
+        out_queue_init(&link->out);
+        link->out.dead = true;
+    }
+}
+
+// Whether (origin, seq) is new; a server only remembers the FED_SERVERS_MAX origins it heard
+// from last, which is every server of any network it can join
+bool fed_links_admit(fed_links_t* links, uint32_t origin, uint64_t seq) {
+    pthread_mutex_lock(&links->window_lock);
+    fed_window_t* window = NULL;
+    fed_window_t* oldest = &links->windows[0];
+    for (int i = 0; i < FED_SERVERS_MAX && !window; i++) {
+        if (links->windows[i].origin == origin) window = &links->windows[i];
+        else if (links->windows[i].top < oldest->top) oldest = &links->windows[i];
+    }
+    if (!window) {
+        window = oldest;
+        memset(window, 0, sizeof(fed_window_t));
+        window->origin = origin;
+    }
+    bool admitted = fed_window_admit(window, seq);
+    pthread_mutex_unlock(&links->window_lock);
+
+    if (!admitted) __atomic_add_fetch(&links->duplicates, 1, __ATOMIC_RELAXED);
+    return admitted;
+}
+
+static inline bool fed_link_up(fed_link_t* link) {
+    return __atomic_load_n(&link->links->up, __ATOMIC_ACQUIRE) & (1u << link->id);
+}
+
+// Marks the link greeted: from now on frames queued for it go out. Call it from greet, under
+// whatever lock orders the owner's sends against the state greet sends the peer.
+void fed_link_set_up(fed_link_t* link, uint32_t peer) {
+    link->peer = peer;
+    __atomic_or_fetch(&link->links->up, 1u << link->id, __ATOMIC_ACQ_REL);
+}
+
+// Queues a frame for the peer; safe from any thread. The caller keeps its reference.
+void fed_link_send(fed_link_t* link, shared_buf_t* frame) {
+    out_result_e result = out_queue_push(&link->out, frame, FED_QUEUE_BYTES, slow_disconnect);
+    if (result == out_pending || result == out_queued) __atomic_add_fetch(&link->links->frames_out, 1, __ATOMIC_RELAXED);
+
+    // An overflow marks the queue dead, which the link's thread notices once woken up
+    uint64_t one = 1;
+    if ((result == out_pending || result == out_overflow) && write(link->wake, &one, sizeof(one)) == -1) {
+        perror("fed_link_send::write");
+    }
+}
+
+// Writes what the queue holds, and arms EPOLLOUT for what the socket does not take. Returns
+// false once the link is dead.
+static bool fed_link_flush(fed_link_t* link) {
+    pthread_mutex_lock(&link->out.lock);
+    bool ok = !link->out.dead && out_queue_flush(&link->out, link->sock);
+    bool want_out = ok && !out_queue_empty(&link->out);
+    if (ok && want_out != link->want_out) {
+        struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0), .data.fd = link->sock };
+        epoll_ctl(link->epoll, EPOLL_CTL_MOD, link->sock, &event);
+        link->want_out = link->out.want_out = want_out;
+    }
+    pthread_mutex_unlock(&link->out.lock);
+    return ok;
+}
+
+// Blocking send of a whole frame, for the hello
+static bool fed_send_all(int sock, shared_buf_t* frame) {
+    for (size_t sent = 0; sent < frame->len; ) {
+        ssize_t n = send(sock, frame->data + sent, frame->len - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Both ends say hello first thing; the owner's greet decides on the peer's. Whatever the peer
+// sent past its hello stays in link->in.
+static bool fed_link_handshake(fed_link_t* link) {
+    fed_links_t* links = link->links;
+    shared_buf_t* hello = links->hooks.hello(links);
+    bool sent = hello && fed_send_all(link->sock, hello);
+    if (hello) shared_buf_unref(hello);
+    if (!sent) return false;
+
+    uint64_t deadline = metrics_now_ns() + FED_HELLO_TIMEOUT_MS * 1000000ull;
+    while (true) {
+        fed_event_t event;
+        const char* raw;
+        size_t raw_len;
+        irc_read_status_e status = fed_reader_next(link->in, &event, &raw, &raw_len);
+        if (status == irc_read_invalid) return false;
+        if (status == irc_read_frame) return event.type == fed_hello && links->hooks.greet(link, &event);
+
+        uint64_t now = metrics_now_ns();
+        struct pollfd pfd = { .fd = link->sock, .events = POLLIN };
+        if (now >= deadline || poll(&pfd, 1, (deadline - now) / 1000000) <= 0) return false;
+
+        ssize_t received = irc_reader_fill(link->in, link->sock);
+        if (received == 0 || (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) return false;
+    }
+}
+
+// Reads and writes the link until either side gives up
+static void fed_link_serve(fed_link_t* link) {
+    fed_links_t* links = link->links;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.fd = link->sock };
+    epoll_ctl(link->epoll, EPOLL_CTL_ADD, link->sock, &event);
+    link->want_out = false;
+
+    // The hello may have come with more frames behind it
+    bool alive = true;
+    ssize_t received = 1;
+    while (alive) {
+        while (true) {
+            fed_event_t frame;
+            const char* raw;
+            size_t raw_len;
+            irc_read_status_e status = fed_reader_next(link->in, &frame, &raw, &raw_len);
+            if (status == irc_read_more) break;
+            if (status == irc_read_invalid) {
+                alive = false;
+                break;
+            }
+            __atomic_add_fetch(&links->frames_in, 1, __ATOMIC_RELAXED);
+            links->hooks.frame(link, &frame, raw, raw_len);
+        }
+        if (links->hooks.idle) links->hooks.idle(link);
+        if (!alive || received <= 0 || !fed_link_flush(link)) break;
+
+        struct epoll_event events[FED_EVENT_QTY];
+        int ready_qty = epoll_wait(link->epoll, events, FED_EVENT_QTY, -1);
+        if (ready_qty == -1 && errno != EINTR) break;
+
+        for (int n = 0; n < ready_qty; n++) {
+            if (events[n].data.fd == link->wake) {
+                uint64_t value;
+                if (read(link->wake, &value, sizeof(value)) == -1) perror("fed_link_serve::read");
+            } else if (events[n].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                received = irc_reader_fill(link->in, link->sock);
+                if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) received = 1;
+            }
+        }
+    }
+    epoll_ctl(link->epoll, EPOLL_CTL_DEL, link->sock, NULL);
+}
+
+// Connects to link->dial, giving up after one attempt; -1 on failure
+static int fed_link_dial(fed_link_t* link) {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", link->dial);
+    char* port = strrchr(host, ':');
+    if (!port) return -1;
+    *port++ = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* addrs;
+    if (getaddrinfo(host, port, &hints, &addrs)) return -1;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock != -1 && connect(sock, addrs->ai_addr, addrs->ai_addrlen) == -1) {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addrs);
+    return sock;
+}
+
+// A dialled link redials forever; the others wait for fed_links_accept to hand them a socket
+static void* fed_link_run(void* arg) {
+    fed_link_t* link = arg;
+    fed_links_t* links = link->links;
+    if (links->hooks.enter) links->hooks.enter(link);
+
+    int retry_ms = FED_RETRY_MS;
+    while (true) {
+        int sock;
+        if (link->dial) {
+            while ((sock = fed_link_dial(link)) == -1) usleep(FED_RETRY_MS * 1000);
+        } else {
+            pthread_mutex_lock(&links->lock);
+            while (link->handed == -1) pthread_cond_wait(&links->handed_cond, &links->lock);
+            sock = link->handed;
+            pthread_mutex_unlock(&links->lock);
+        }
+
+        link->sock = sock;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+        *link->in = (irc_reader_t) { .start = 0, .end = 0 };
+        pthread_mutex_lock(&link->out.lock);
+        link->out.dead = link->out.dirty = link->out.want_out = false;
+        pthread_mutex_unlock(&link->out.lock);
+
+        bool greeted = fed_link_handshake(link);
+        if (greeted) {
+            retry_ms = FED_RETRY_MS;
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            fed_link_serve(link);
+
+            __atomic_and_fetch(&links->up, ~(1u << link->id), __ATOMIC_ACQ_REL);
+            links->hooks.down(link);
+        }
+        out_queue_clear(&link->out);
+        link->peer = 0;
+        link->sock = -1;
+        close(sock);
+
+        if (link->dial) {
+            usleep(retry_ms * 1000);
+            if (!greeted) retry_ms = retry_ms*2 < FED_RETRY_MAX_MS ? retry_ms*2 : FED_RETRY_MAX_MS;
+        } else {
+            pthread_mutex_lock(&links->lock);
+            link->handed = -1;
+            pthread_mutex_unlock(&links->lock);
+        }
+    }
+    return NULL;
+}
+
+// Hands an accepted peer to an idle link, starting its thread on first use; false if every
+// link is taken
+static bool fed_links_accept(fed_links_t* links, int sock) {
+    pthread_mutex_lock(&links->lock);
+    fed_link_t* link = NULL;
+    for (int i = links->dial_qty; i < FED_LINKS_MAX && !link; i++) {
+        if (links->links[i].handed == -1) link = &links->links[i];
+    }
+    if (link) {
+        link->handed = sock;
+        if (!link->started) {
+            link->started = true;
+            pthread_create(&link->thread, NULL, fed_link_run, link);
+        } else {
+            pthread_cond_broadcast(&links->handed_cond);
+        }
+    }
+    pthread_mutex_unlock(&links->lock);
+    return link != NULL;
+}
+
+static void* fed_accept_run(void* arg) {
+    fed_links_t* links = arg;
+    while (true) {
+        int sock = accept4(links->listen_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) usleep(FED_RETRY_MS * 1000);
+            continue;
+        }
+        if (!fed_links_accept(links, sock)) {
+            fprintf(stderr, "fed_accept_run::every link is taken, refusing a peer\n");
+            close(sock);
+        }
+    }
+    return NULL;
+}
+
+static bool fed_link_open(fed_link_t* link) {
+    link->epoll = epoll_create1(EPOLL_CLOEXEC);
+    link->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    link->in = malloc(sizeof(irc_reader_t));
+    if (link->epoll == -1 || link->wake == -1 || !link->in) {
+        perror("fed_link_open");
+        return false;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = link->wake };
+    epoll_ctl(link->epoll, EPOLL_CTL_ADD, link->wake, &event);
+    return true;
+}
+
+// Listens for peers on port (0 = none) and keeps dialling every one of dial. Link contexts must
+// be set before this.
+void fed_links_start(fed_links_t* links, in_port_t port, char** dial, int dial_qty) {
+    for (int i = 0; i < FED_LINKS_MAX; i++) {
+        if (!fed_link_open(&links->links[i])) exit(1);
+    }
+
+    links->dial_qty = dial_qty < FED_LINKS_MAX ? dial_qty : FED_LINKS_MAX;
+    for (int i = 0; i < links->dial_qty; i++) {
+        fed_link_t* link = &links->links[i];
+        link->dial = dial[i];
+        link->started = true;
+        pthread_create(&link->thread, NULL, fed_link_run, link);
+    }
+
+    if (!port) return;
+    irc_sock_t listening = irc_sock_new(AF_INET, "0.0.0.0", port);
+    if (bind(listening.sock, (const struct sockaddr*) &listening.addr, listening.addr_len) == -1 ||
+        listen(listening.sock, FED_LINKS_MAX) == -1) {
+        perror("fed_links_start::bind");
+        exit(1);
+    }
+    links->listen_sock = listening.sock;
+    pthread_create(&links->accept_thread, NULL, fed_accept_run, links);
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef IRC_FLOOD_H_
+#define IRC_FLOOD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-connection flood control: a token bucket of messages and one of bytes, refilled from the
+// clock once per read and charged once per frame, before the frame is parsed. Tokens are kept
+// in thousandths, so a rate per second is also the refill per millisecond and refilling takes
+// a multiply, never a division. A bucket with a zero rate is off: every refill fills it to the
+// brim. Under flood_delay frames always pass and may leave the buckets in debt, which the
+// caller repays by not reading the connection for flood_wait_ms.
+#define FLOOD_UNIT 1000                     // thousandths per token
+#define FLOOD_OFF (INT64_MAX / 4)           // tokens of a bucket without a rate, no frame drains it
+
+typedef enum _flood_policy {
+    flood_delay,                            // stop reading until the debt is repaid, TCP pushes back
+    flood_drop,                             // refuse the frames that do not fit
+} flood_policy_e;
+
+typedef struct _flood_limits {
+    uint32_t msgs_per_s;                    // 0 = no message limit
+    uint32_t msg_burst;
+    uint32_t bytes_per_s;                   // 0 = no byte limit
+    uint32_t byte_burst;                    // should fit the biggest frame, or flood_drop refuses it forever
+} flood_limits_t;
+
+typedef struct _flood {
+    int64_t msgs;                           // thousandths of a message, negative in debt
+    int64_t bytes;                          // thousandths of a byte
+    uint64_t at_ms;                         // last refill, 0 fills both buckets on the first one
+} flood_t;
+
+static inline int64_t flood_bucket_refill(int64_t tokens, uint64_t elapsed_ms, uint32_t rate, uint32_t burst) {
+    if (!rate) return FLOOD_OFF;
+    int64_t cap = (int64_t) burst * FLOOD_UNIT;
+    // elapsed_ms * rate stays far from overflowing for any uptime this side of a century
+    tokens += (int64_t) elapsed_ms * rate;
+    return tokens < cap ? tokens : cap;
+}
+
+static inline void flood_refill(flood_t* flood, const flood_limits_t* limits, uint64_t now_ms) {
+    uint64_t elapsed_ms = now_ms - flood->at_ms;
+    flood->at_ms = now_ms;
+    flood->msgs = flood_bucket_refill(flood->msgs, elapsed_ms, limits->msgs_per_s, limits->msg_burst);
+    flood->bytes = flood_bucket_refill(flood->bytes, elapsed_ms, limits->bytes_per_s, limits->byte_burst);
+}
+
+// Charges a frame of len bytes. With drop set a frame that does not fit is refused and costs
+// nothing; otherwise it passes, possibly into debt.
+static inline bool flood_charge(flood_t* flood, size_t len, bool drop) {
+    int64_t msgs = flood->msgs - FLOOD_UNIT;
+    int64_t bytes = flood->bytes - (int64_t) len * FLOOD_UNIT;
+    if (drop && (msgs | bytes) < 0) return false;
+    flood->msgs = msgs;
+    flood->bytes = bytes;
+    return true;
+}
+
+static inline bool flood_in_debt(flood_t* flood) {
+    return (flood->msgs | flood->bytes) < 0;
+}
+
+// Milliseconds of refill it takes to get both buckets out of debt
+static inline uint64_t flood_wait_ms(flood_t* flood, const flood_limits_t* limits) {
+    uint64_t wait_ms = 0;
+    if (flood->msgs < 0) wait_ms = (-flood->msgs + limits->msgs_per_s - 1) / limits->msgs_per_s;
+    if (flood->bytes < 0) {
+        uint64_t bytes_ms = (-flood->bytes + limits->bytes_per_s - 1) / limits->bytes_per_s;
+        if (bytes_ms > wait_ms) wait_ms = bytes_ms;
+    }
+    return wait_ms;
+}
+
+#endif
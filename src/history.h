@@ -0,0 +1,179 @@
+#ifndef IRC_HISTORY_H_
+#define IRC_HISTORY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "irc.h"
+#include "shared_buf.h"
+#include "epoch.h"
+
+// The last messages of a channel, kept as the frames they were relayed in (one per framing),
+// so a joining user gets its backlog as a batch of queue references that leave in a single
+// vectored send. Bounded both in messages (cap) and in bytes: appending evicts the oldest
+// entries until the new one fits, and slots are only allocated on the first append.
+//
+// There is a single writer at a time (the relay, under its channel's lock) and readers take no
+// lock at all: an entry is published by storing its slot and then head, a reader checks each
+// entry's seq against the one it expects, and evicted entries are reclaimed through the epoch,
+// a batch at a time, so a reader inside an epoch section can still take references to them.
+#define HISTORY_MESSAGES 100                // default cap
+#define HISTORY_BYTES (64*1024)             // default byte bound
+#define HISTORY_RETIRE_BATCH 32             // evicted entries per epoch_retire
+
+typedef struct _history_entry {
+    struct _history_entry* next_retired;
+    uint64_t seq;
+    size_t bytes;                           // counted against the byte bound, entry included
+    shared_buf_t* frames[irc_proto_qty];    // owned references, NULL if encoding failed
+} history_entry_t;
+
+typedef struct _history {
+    history_entry_t** slots;                // cap of them, entry seq lives in slots[seq % cap]
+    uint32_t cap;                           // 0 = no history
+    size_t max_bytes;
+    size_t bytes;                           // writer only
+    uint64_t head;                          // seq of the next entry
+    uint64_t tail;                          // seq of the oldest kept entry
+    history_entry_t* retired;               // evicted, waiting for a whole batch
+    int retired_qty;
+    epoch_t* epoch;
+} history_t;
+
+// One user's replay: references to its framing of the kept entries, oldest first
+typedef struct _history_replay {
+    shared_buf_t** frames;                  // up to cap of them
+    uint64_t* seqs;                         // entry of each frame, shares frames' allocation
+    int qty;
+    uint64_t next;                          // first seq not looked at yet
+} history_replay_t;
+
+void history_init(history_t* history, uint32_t cap, size_t max_bytes, epoch_t* epoch) {
+    *history = (history_t) { .cap = cap, .max_bytes = max_bytes, .epoch = epoch };
+}
+
+static void history_entry_free(history_entry_t* entry) {
+    for (int proto = 0; proto < irc_proto_qty; proto++) {
+        if (entry->frames[proto]) shared_buf_unref(entry->frames[proto]);
+    }
+    free(entry);
+}
+
+static void history_free_retired(void* ptr) {
+    for (history_entry_t* entry = ptr, *next; entry; entry = next) {
+        next = entry->next_retired;
+        history_entry_free(entry);
+    }
+}
+
+// Only once no reader can be left, e.g. from the epoch-retired owner's free
+void history_free(history_t* history) {
+    for (uint64_t seq = history->tail; seq < history->head; seq++) {
+        history_entry_free(history->slots[seq % history->cap]);
+    }
+    history_free_retired(history->retired);
+    free(history->slots);
+}
+
+// Writer only
+static void history_evict(history_t* history) {
+    history_entry_t** slot = &history->slots[history->tail % history->cap];
+    history_entry_t* entry = *slot;
+    __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&history->tail, history->tail+1, __ATOMIC_RELEASE);
+    history->bytes -= entry->bytes;
+
+    entry->next_retired = history->retired;
+    history->retired = entry;
+    if (++history->retired_qty == HISTORY_RETIRE_BATCH) {
+        epoch_retire(history->epoch, history->retired, history_free_retired);
+        history->retired = NULL;
+        history->retired_qty = 0;
+    }
+}
+
+// Keeps a reference to every frame, the caller keeps its own. Writers must be serialized.
+void history_append(history_t* history, shared_buf_t** frames) {
+    if (!history->cap) return;
+
+    size_t bytes = sizeof(history_entry_t);
+    for (int proto = 0; proto < irc_proto_qty; proto++) {
+        if (frames[proto]) bytes += frames[proto]->size;
+    }
+    if (bytes > history->max_bytes) return;
+
+    if (!history->slots) {
+        history_entry_t** slots = calloc(history->cap, sizeof(history_entry_t*));
+        if (!slots) {
+            perror("history_append::calloc");
+            return;
+        }
+        __atomic_store_n(&history->slots, slots, __ATOMIC_RELEASE);
+    }
+    history_entry_t* entry = malloc(sizeof(history_entry_t));
+    if (!entry) {
+        perror("history_append::malloc");
+        return;
+    }
+    entry->seq = history->head;
+    entry->bytes = bytes;
+    for (int proto = 0; proto < irc_proto_qty; proto++) {
+        entry->frames[proto] = frames[proto] ? shared_buf_ref(frames[proto]) : NULL;
+    }
+
+    while (history->head - history->tail == history->cap || history->bytes + bytes > history->max_bytes) {
+        history_evict(history);
+    }
+    history->bytes += bytes;
+    __atomic_store_n(&history->slots[entry->seq % history->cap], entry, __ATOMIC_RELEASE);
+    __atomic_store_n(&history->head, entry->seq+1, __ATOMIC_RELEASE);
+}
+
+// Adds the proto frames of every entry from replay->next on, dropping whatever got evicted
+// meanwhile. Lock-free, but must run inside an epoch section; run it once without the writers'
+// lock for the bulk and once more under it, to catch up, when the replay must not miss a message.
+void history_collect(history_t* history, irc_proto_e proto, history_replay_t* replay) {
+    uint64_t head = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&history->tail, __ATOMIC_ACQUIRE);
+    history_entry_t** slots = __atomic_load_n(&history->slots, __ATOMIC_ACQUIRE);
+    if (!slots || head == replay->next) return;
+
+    if (!replay->frames) {
+        replay->frames = malloc(history->cap * (sizeof(shared_buf_t*) + sizeof(uint64_t)));
+        if (!replay->frames) {
+            perror("history_collect::malloc");
+            return;
+        }
+        replay->seqs = (uint64_t*) (replay->frames + history->cap);
+    }
+
+    // Keep it to what the ring holds now, so it never outgrows cap
+    int kept = 0;
+    for (int i = 0; i < replay->qty; i++) {
+        if (replay->seqs[i] < tail) {
+            shared_buf_unref(replay->frames[i]);
+            continue;
+        }
+        replay->frames[kept] = replay->frames[i];
+        replay->seqs[kept++] = replay->seqs[i];
+    }
+    replay->qty = kept;
+
+    for (uint64_t seq = replay->next > tail ? replay->next : tail; seq < head; seq++) {
+        history_entry_t* entry = __atomic_load_n(&slots[seq % history->cap], __ATOMIC_ACQUIRE);
+        if (!entry || entry->seq != seq || !entry->frames[proto]) continue;  // evicted under us
+        replay->frames[replay->qty] = shared_buf_ref(entry->frames[proto]);
+        replay->seqs[replay->qty++] = seq;
+    }
+    replay->next = head;
+}
+
+void history_replay_release(history_replay_t* replay) {
+    for (int i = 0; i < replay->qty; i++) shared_buf_unref(replay->frames[i]);
+    free(replay->frames);
+    *replay = (history_replay_t) {0};
+}
+
+#endif
@@ -1,7 +1,12 @@
+#ifndef IRC_H_
+#define IRC_H_
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -9,6 +14,8 @@
 #include <arpa/inet.h>
 
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <signal.h>
 
@@ -16,9 +23,9 @@
 #define SERVER_PORT 9090
 #define SERVER_CLIENT_QTY 4
 #define CHANNEL_CLIENT_QTY 4
-#define CHANNEL_QTY 4
 #define CHANNEL_NAME_LEN 200
 #define CHANNEL_PASS_LEN 20
+#define USER_CHANNEL_MAX 64                 // channels one user may sit in at once
 
 // This enum and the cmd_types array must follow the same order
 typedef enum _irc_commands {
@@ -31,6 +38,9 @@ typedef enum _irc_commands {
     cmd_mute,
     cmd_unmute,
     cmd_whois,
+    cmd_stats,
+    cmd_part,
+    cmd_history,
     cmd_msg,
     _len
 } irc_cmds_e;
@@ -45,22 +55,112 @@ const char* all_irc_cmd_types[] = {
     "/mute",
     "/unmute",
     "/whois",
+    "/stats",
+    "/part",
+    "/history",
     "message"
 };
 
-irc_cmds_e parse_msg(char* msg) {
-    msg += strspn(msg, " ");
-    if (msg[0] != '/') return cmd_msg;
+// Commands are looked up in a perfect hash built at compile time: the slot is a function of
+// the first letter after '/', the last letter and the length, and a hit must still match the
+// whole word. Lookup is O(1) in the number of commands, and a mere prefix such as "/m" is a
+// message rather than whichever command happens to start with it. Adding a command means
+// picking a free slot (a collision shows up under -Woverride-init).
+#define IRC_CMD_BUCKETS 32
+#define IRC_CMD_HASH(first, last, len) (((first)*4 + (last) + (len)) & (IRC_CMD_BUCKETS-1))
+#define IRC_CMD_MAX_ARGS 8
 
-    int cmd_len = strcspn(msg, " \n\0")-1;
-    for (int i = 0; i < _len-1; i++) {
-        const char* cmd = all_irc_cmd_types[i];
-        if(!strncmp(msg, cmd, cmd_len)) {
-            return i;
-        }
+typedef struct _irc_cmd_entry {
+    const char* name;                       // NULL for an empty slot
+    size_t len;
+    irc_cmds_e type;
+} irc_cmd_entry_t;
+
+static const irc_cmd_entry_t irc_cmd_table[IRC_CMD_BUCKETS] = {
+    [IRC_CMD_HASH('c', 't', 8)] = { "/connect", 8, cmd_connect },
+    [IRC_CMD_HASH('q', 't', 5)] = { "/quit", 5, cmd_quit },
+    [IRC_CMD_HASH('p', 'g', 5)] = { "/ping", 5, cmd_ping },
+    [IRC_CMD_HASH('j', 'n', 5)] = { "/join", 5, cmd_join },
+    [IRC_CMD_HASH('n', 'e', 9)] = { "/nickname", 9, cmd_nickname },
+    [IRC_CMD_HASH('k', 'k', 5)] = { "/kick", 5, cmd_kick },
+    [IRC_CMD_HASH('m', 'e', 5)] = { "/mute", 5, cmd_mute },
+    [IRC_CMD_HASH('u', 'e', 7)] = { "/unmute", 7, cmd_unmute },
+    [IRC_CMD_HASH('w', 's', 6)] = { "/whois", 6, cmd_whois },
+    [IRC_CMD_HASH('s', 's', 6)] = { "/stats", 6, cmd_stats },
+    [IRC_CMD_HASH('p', 't', 5)] = { "/part", 5, cmd_part },
+    [IRC_CMD_HASH('h', 'y', 8)] = { "/history", 8, cmd_history },
+};
+
+// Read-only view into a packet buffer
+typedef struct _irc_slice {
+    char* ptr;
+    size_t len;
+} irc_slice_t;
+
+static inline irc_slice_t irc_slice_of(char* str) {
+    return (irc_slice_t) { .ptr = str, .len = strlen(str) };
+}
+
+typedef struct _irc_cmd {
+    irc_cmds_e type;
+    int argc;
+    irc_slice_t argv[IRC_CMD_MAX_ARGS];     // words after the command, NUL terminated in place
+} irc_cmd_t;
+
+// cmd_msg unless word is exactly one of the commands
+irc_cmds_e irc_cmd_lookup(const char* word, size_t len) {
+    if (len < 2 || word[0] != '/') return cmd_msg;
+
+    const irc_cmd_entry_t* entry = &irc_cmd_table[
+        IRC_CMD_HASH((unsigned char) word[1], (unsigned char) word[len-1], len)];
+    if (entry->name && entry->len == len && !memcmp(entry->name, word, len)) return entry->type;
+    return cmd_msg;
+}
+
+static inline bool irc_is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// Re-entrant word splitter: all state lives in *cursor, nothing is copied. Each word is
+// NUL terminated in place by overwriting the separator after it, so end must point at a
+// writable terminator (or separator) of the buffer.
+bool irc_next_token(char** cursor, char* end, irc_slice_t* token) {
+    char* p = *cursor;
+    while (p < end && irc_is_space(*p)) p++;
+    if (p == end) return false;
+
+    token->ptr = p;
+    while (p < end && !irc_is_space(*p)) p++;
+    token->len = p - token->ptr;
+
+    *cursor = p < end ? p+1 : end;
+    *p = '\0';
+    return true;
+}
+
+// Classifies data and, for commands, splits out their arguments. Messages are left untouched.
+// data must be NUL terminated at len.
+void irc_parse_cmd(char* data, size_t len, irc_cmd_t* cmd) {
+    char* end = data + strnlen(data, len);
+    char* word = data;
+    while (word < end && *word == ' ') word++;
+
+    size_t word_len = 0;
+    while (word + word_len < end && !irc_is_space(word[word_len])) word_len++;
+
+    cmd->type = irc_cmd_lookup(word, word_len);
+    cmd->argc = 0;
+    if (cmd->type == cmd_msg) return;
+
+    char* cursor = word + word_len;
+    while (cmd->argc < IRC_CMD_MAX_ARGS && irc_next_token(&cursor, end, &cmd->argv[cmd->argc])) {
+        cmd->argc++;
     }
+}
 
-    return cmd_msg; // default case: could not recognize command, so it must be a message
+irc_cmds_e parse_msg(char* msg) {
+    msg += strspn(msg, " ");
+    return irc_cmd_lookup(msg, strcspn(msg, " \n\r\t"));
 }
 
 #define IRC_NAME_LEN 50
@@ -100,33 +200,271 @@ typedef struct _irc_packet {
     char data[MSG_LEN];
 } irc_packet_t;
 
+// Wire size of the length + user header that precedes a packet's data
+#define IRC_HEADER_LEN (sizeof(short) + IRC_NAME_LEN)
+
+// Serializes pkt exactly as irc_send puts it on the wire; out needs IRC_HEADER_LEN + pkt->length
+size_t irc_encode(irc_packet_t* pkt, char* out) {
+    memcpy(out, &pkt->length, sizeof(pkt->length));
+    memcpy(out + sizeof(pkt->length), pkt->user, IRC_NAME_LEN);
+    memcpy(out + IRC_HEADER_LEN, pkt->data, pkt->length);
+    return IRC_HEADER_LEN + pkt->length;
+}
+
+// Sends length, user and data as one vectored write (looping only on a short write)
 int irc_send(irc_sock_t* user, irc_packet_t* pkt, int flags) {
     if(user->sock == -1){
         return 0;
     }
-    if(send(user->sock, &pkt->length, sizeof(pkt->length), flags) == -1) { return -1; }; // send message length
-    if(send(user->sock, pkt->user, IRC_NAME_LEN, flags) == -1) { return -1; }; // send message's user
-
-    int sent = 0, len_left = pkt->length;
-    while(sent < len_left) { // how many we have left to send
-        int sent_now = send(user->sock, &pkt->data[sent], len_left, flags);
-        if (sent_now == -1) { return -1; } // return -1 on failure
-        sent += sent_now;
+
+    struct iovec iov[3] = {
+        { .iov_base = &pkt->length, .iov_len = sizeof(pkt->length) },   // message length
+        { .iov_base = pkt->user, .iov_len = IRC_NAME_LEN },             // message's user
+        { .iov_base = pkt->data, .iov_len = pkt->length },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+
+    size_t len_left = IRC_HEADER_LEN + pkt->length;
+    while (len_left) {
+        ssize_t sent_now = sendmsg(user->sock, &msg, flags | MSG_NOSIGNAL);
+        if (sent_now == -1) {
+            if (errno == EINTR) continue;
+            return -1; // return -1 on failure
+        }
         len_left -= sent_now;
+
+        // Skip whatever the kernel already took
+        while (msg.msg_iovlen && (size_t) sent_now >= msg.msg_iov->iov_len) {
+            sent_now -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + sent_now;
+            msg.msg_iov->iov_len -= sent_now;
+        }
     }
 
-    return sent; // return quantity of bytes sent on success
+    return pkt->length; // return quantity of data bytes sent on success
+}
+
+// Blocking receive of exactly len bytes; returns len, 0 on EOF or -1 on error
+static ssize_t irc_recv_all(int sock, void* buf, size_t len, int flags) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t received_now = recv(sock, (char*) buf + received, len - received, flags | MSG_WAITALL);
+        if (received_now == 0) return 0;
+        if (received_now == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        received += received_now;
+    }
+    return received;
 }
 
+// Blocking receive of one whole packet, for clients. Returns the total bytes read, 0 when
+// the peer disconnected and -2 on error.
 int irc_recv(irc_sock_t* user, irc_packet_t* pkt, int flags) {
-    ssize_t bytes_received = recv(user->sock, &pkt->length, sizeof(pkt->length), flags);
-    if (bytes_received == -1) {
+    ssize_t header = irc_recv_all(user->sock, &pkt->length, sizeof(pkt->length), flags);
+    if (header == -1) {
         perror("irc_recv");
         return -2;
     }
+    if (header == 0) return 0;
+
+    if (irc_recv_all(user->sock, pkt->user, IRC_NAME_LEN, flags) <= 0) return 0;
+    if (pkt->length < 0 || pkt->length > MSG_LEN) return -2;
+    if (pkt->length && irc_recv_all(user->sock, pkt->data, pkt->length, flags) <= 0) return 0;
+
+    return IRC_HEADER_LEN + pkt->length;
+}
+
+// Streaming receiver for non-blocking sockets. Each fill is a single recv that takes as much
+// as the buffer has room for, and irc_reader_next then hands out every complete frame it
+// holds; a partial frame stays buffered until the next fill completes it. A pipelining
+// client can thus deliver many packets per syscall, and short reads never desync the stream.
+#define IRC_READER_LEN (2 * (IRC_HEADER_LEN + MSG_LEN))
+
+typedef enum _irc_read_status {
+    irc_read_frame,                         // pkt holds the next packet
+    irc_read_more,                          // need another fill
+    irc_read_invalid,                       // malformed header, drop the connection
+} irc_read_status_e;
+
+typedef struct _irc_reader {
+    size_t start;                           // first unparsed byte
+    size_t end;                             // one past the last received byte
+    char buf[IRC_READER_LEN];
+} irc_reader_t;
+
+// Slides the leftover partial frame to the front so a full frame always fits
+static inline void irc_reader_compact(irc_reader_t* reader) {
+    if (reader->start) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+}
+
+// Returns the bytes read, 0 on EOF, or -1 with errno set (EAGAIN: nothing to read)
+ssize_t irc_reader_fill(irc_reader_t* reader, int sock) {
+    irc_reader_compact(reader);
+
+    ssize_t received;
+    do {
+        received = recv(sock, reader->buf + reader->end, IRC_READER_LEN - reader->end, MSG_DONTWAIT);
+    } while (received == -1 && errno == EINTR);
+
+    if (received > 0) reader->end += received;
+    return received;
+}
+
+// Appends bytes somebody else received (io_uring); false if they do not fit
+bool irc_reader_feed(irc_reader_t* reader, const char* data, size_t len) {
+    irc_reader_compact(reader);
+    if (len > IRC_READER_LEN - reader->end) return false;
+
+    memcpy(reader->buf + reader->end, data, len);
+    reader->end += len;
+    return true;
+}
+
+// Copies the IRC_NAME_LEN bytes of the handshake nickname into name
+irc_read_status_e irc_reader_next_hello(irc_reader_t* reader, char* name) {
+    if (reader->end - reader->start < IRC_NAME_LEN) return irc_read_more;
+
+    memcpy(name, reader->buf + reader->start, IRC_NAME_LEN);
+    reader->start += IRC_NAME_LEN;
+    if (reader->start == reader->end) reader->start = reader->end = 0;
+    return irc_read_frame;
+}
+
+// Copies the next complete frame into pkt (data is NUL terminated)
+irc_read_status_e irc_reader_next(irc_reader_t* reader, irc_packet_t* pkt) {
+    size_t buffered = reader->end - reader->start;
+    if (buffered < IRC_HEADER_LEN) return irc_read_more;
+
+    char* frame = reader->buf + reader->start;
+    short length;
+    memcpy(&length, frame, sizeof(length));
+    if (length < 0 || length >= MSG_LEN) return irc_read_invalid;
+    if (buffered < IRC_HEADER_LEN + length) return irc_read_more;
+
+    pkt->length = length;
+    memcpy(pkt->user, frame + sizeof(length), IRC_NAME_LEN);
+    pkt->user[IRC_NAME_LEN-1] = '\0';
+    memcpy(pkt->data, frame + IRC_HEADER_LEN, length);
+    pkt->data[length] = '\0';
+
+    reader->start += IRC_HEADER_LEN + length;
+    if (reader->start == reader->end) reader->start = reader->end = 0;
+    return irc_read_frame;
+}
+
+// Compact v2 framing, negotiated per connection during the handshake: a v2 client prefixes
+// the nickname it sends with IRC_V2_HELLO, old clients keep the v1 irc_packet_t framing.
+//
+//   frame = varint(len) type varint(sender) data      len = bytes after the length varint
+//
+// Instead of a 50-byte name in every packet, a frame carries a small sender ID. The server
+// announces which nickname an ID stands for (an irc_v2_name frame whose data is the nick)
+// once, when a user joins the receiver's channel or changes nick. ID 0 is the server itself.
+// A typical chat line thus costs 3-4 bytes of framing instead of 52.
+#define IRC_V2_HELLO "\xffIRC2"
+#define IRC_V2_HELLO_LEN (sizeof(IRC_V2_HELLO)-1)
+#define IRC_V2_SERVER_ID 0
+#define IRC_V2_REPLAY_ID 0x0fffffff       // never handed out, see irc_v2_type_e
+#define IRC_VARINT_MAX 5
+#define IRC_V2_HEADER_MAX (IRC_VARINT_MAX + 1 + IRC_VARINT_MAX)
+
+typedef enum _irc_proto {
+    irc_proto_v1,
+    irc_proto_v2,
+    irc_proto_text,                         // RFC 1459 lines on the text listener, see irc_text.h
+    irc_proto_qty
+} irc_proto_e;
+
+typedef enum _irc_v2_type {
+    irc_v2_msg = 1,                         // data is a message (or command) from sender
+    irc_v2_name = 2,                        // data is the nickname sender stands for from now on
+    irc_v2_ping = 3,                        // keepalive probe from the server, empty; see below
+} irc_v2_type_e;
+
+// Channel history replayed on join comes from IRC_V2_REPLAY_ID, whose irc_v2_name frame right
+// before each message names that message's original sender: the senders' own IDs may have been
+// handed to someone else since.
+//
+// A connection idle for a while gets an irc_v2_ping (v1: an empty packet from "server"). Nothing
+// has to answer it: any frame sent back counts as a sign of life, and failing that it is enough
+// for TCP to acknowledge the probe in time.
+
+typedef struct _irc_v2_frame {
+    uint8_t type;
+    uint32_t sender;
+    uint32_t length;
+    const char* data;                       // points into the reader, valid until the next fill
+} irc_v2_frame_t;
+
+// LEB128: 7 bits per byte, high bit set on every byte but the last
+size_t irc_varint_encode(uint32_t value, uint8_t* out) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    out[len++] = (uint8_t) value;
+    return len;
+}
 
-    bytes_received |= recv(user->sock, pkt->user, IRC_NAME_LEN, 0);
-    bytes_received |= recv(user->sock, pkt->data, pkt->length, 0);
+// Returns the bytes consumed, 0 if in is too short to tell, or -1 if it is not a varint
+int irc_varint_decode(const uint8_t* in, size_t len, uint32_t* value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < len && i < IRC_VARINT_MAX; i++) {
+        result |= (uint32_t) (in[i] & 0x7f) << (7*i);
+        if (!(in[i] & 0x80)) {
+            *value = result;
+            return i+1;
+        }
+    }
+    return len < IRC_VARINT_MAX ? 0 : -1;
+}
+
+// out needs IRC_V2_HEADER_MAX + len bytes; returns the frame size
+size_t irc_v2_encode(uint8_t type, uint32_t sender, const char* data, size_t len, char* out) {
+    uint8_t sender_buf[IRC_VARINT_MAX];
+    size_t sender_len = irc_varint_encode(sender, sender_buf);
+
+    size_t at = irc_varint_encode(1 + sender_len + len, (uint8_t*) out);
+    out[at++] = type;
+    memcpy(out + at, sender_buf, sender_len);
+    at += sender_len;
+    memcpy(out + at, data, len);
+    return at + len;
+}
 
-    return bytes_received;
+irc_read_status_e irc_reader_next_v2(irc_reader_t* reader, irc_v2_frame_t* frame) {
+    const uint8_t* in = (const uint8_t*) reader->buf + reader->start;
+    size_t buffered = reader->end - reader->start;
+
+    uint32_t len;
+    int len_size = irc_varint_decode(in, buffered, &len);
+    if (len_size == 0) return irc_read_more;
+    if (len_size < 0 || len < 2 || len > 1 + IRC_VARINT_MAX + MSG_LEN-1) return irc_read_invalid;
+    if (buffered < len_size + len) return irc_read_more;
+
+    in += len_size;
+    int sender_size = irc_varint_decode(in+1, len-1, &frame->sender);
+    if (sender_size <= 0) return irc_read_invalid;
+
+    frame->type = in[0];
+    frame->data = (const char*) in + 1 + sender_size;
+    frame->length = len - 1 - sender_size;
+    if (frame->length >= MSG_LEN) return irc_read_invalid;
+
+    // The frame stays readable until the next fill slides the buffer
+    reader->start += len_size + len;
+    return irc_read_frame;
 }
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef IRC_TEXT_H_
+#define IRC_TEXT_H_
+
+#include <stdarg.h>
+#include <strings.h>
+
+#include "irc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IRC_TEXT_X86 1
+#endif
+
+// RFC 1459 text protocol front end: CRLF-delimited lines of the form
+//   [':' prefix SPACE] command {SPACE param} [SPACE ':' trailing]
+// Lines are split and tokenized in place inside the connection's irc_reader_t, the
+// resulting strings point into that buffer (zero-copy). The byte scanner behind both steps
+// compares 32 (AVX2) or 16 (SSE2) bytes per instruction, picked once at startup.
+#define IRC_TEXT_PORT 6667
+#define IRC_TEXT_MAX_PARAMS 15
+#define IRC_TEXT_SERVER_NAME "minirc"
+#define IRC_TEXT_LINE_MAX (MSG_LEN + 2*IRC_NAME_LEN + CHANNEL_NAME_LEN + 64)
+
+typedef struct _irc_text_msg {
+    char* prefix;                           // NULL when absent
+    char* command;
+    char* params[IRC_TEXT_MAX_PARAMS];      // the trailing parameter, if any, is the last one
+    int param_qty;
+} irc_text_msg_t;
+
+static const char* irc_scan_scalar(const char* p, const char* end, char c) {
+    const char* found = memchr(p, c, end - p);
+    return found ? found : end;
+}
+
+#ifdef IRC_TEXT_X86
+static const char* irc_scan_sse2(const char* p, const char* end, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return irc_scan_scalar(p, end, c);
+}
+
+__attribute__((target("avx2")))
+static const char* irc_scan_avx2(const char* p, const char* end, char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    for (; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return irc_scan_sse2(p, end, c);
+}
+#endif
+
+typedef const char* (*irc_scan_fn)(const char* p, const char* end, char c);
+
+// First occurrence of c in [p, end), or end
+const char* irc_scan(const char* p, const char* end, char c) {
+    static irc_scan_fn scan = NULL;
+    irc_scan_fn fn = __atomic_load_n(&scan, __ATOMIC_RELAXED);
+    if (!fn) {
+#ifdef IRC_TEXT_X86
+        __builtin_cpu_init();
+        fn = __builtin_cpu_supports("avx2") ? irc_scan_avx2 : irc_scan_sse2;
+#else
+        fn = irc_scan_scalar;
+#endif
+        __atomic_store_n(&scan, fn, __ATOMIC_RELAXED);
+    }
+    return fn(p, end, c);
+}
+
+// Hands out the next complete line (without its CR LF, NUL terminated in place)
+irc_read_status_e irc_reader_next_line(irc_reader_t* reader, char** line, size_t* len) {
+    char* start = reader->buf + reader->start;
+    char* end = reader->buf + reader->end;
+
+    char* eol = (char*) irc_scan(start, end, '\n');
+    if (eol == end) {
+        // A full buffer without a line feed can never complete
+        return reader->end - reader->start >= MSG_LEN ? irc_read_invalid : irc_read_more;
+    }
+
+    reader->start = eol+1 - reader->buf;
+    if (reader->start == reader->end) reader->start = reader->end = 0;
+    if (eol > start && eol[-1] == '\r') eol--;
+    *eol = '\0';
+
+    *line = start;
+    *len = eol - start;
+    return irc_read_frame;
+}
+
+// Tokenizes line in place; returns false for an empty or command-less line
+bool irc_text_parse(char* line, size_t len, irc_text_msg_t* msg) {
+    char* p = line;
+    char* end = line + len;
+    msg->prefix = NULL;
+    msg->command = NULL;
+    msg->param_qty = 0;
+
+    while (p < end && *p == ' ') p++;
+    if (p < end && *p == ':') {
+        char* space = (char*) irc_scan(p, end, ' ');
+        msg->prefix = p+1;
+        p = space;
+        if (p < end) *p++ = '\0';
+    }
+
+    while (p < end) {
+        while (p < end && *p == ' ') p++;
+        if (p == end) break;
+
+        if (msg->command && (*p == ':' || msg->param_qty == IRC_TEXT_MAX_PARAMS-1)) {
+            msg->params[msg->param_qty++] = *p == ':' ? p+1 : p;
+            break;
+        }
+
+        char* space = (char*) irc_scan(p, end, ' ');
+        if (space < end) *space = '\0';
+        if (!msg->command) msg->command = p;
+        else msg->params[msg->param_qty++] = p;
+        p = space < end ? space+1 : end;
+    }
+
+    return msg->command != NULL;
+}
+
+// Formats one protocol line (CR LF appended, truncated to fit); returns its length
+size_t irc_text_vformat(char* out, size_t cap, const char* fmt, va_list args) {
+    int len = vsnprintf(out, cap-2, fmt, args);
+
+    if (len < 0) len = 0;
+    if ((size_t) len > cap-3) len = cap-3;
+    out[len++] = '\r';
+    out[len++] = '\n';
+    return len;
+}
+
+// ":source command target :data" CR LF. data may come from a binary client, so trailing line
+// feeds are dropped and embedded CR/LF become spaces instead of smuggling in extra lines.
+size_t irc_text_encode(char* out, size_t cap, const char* source, const char* command,
+                       const char* target, const char* data, size_t data_len) {
+    data_len = strnlen(data, data_len);
+    while (data_len && (data[data_len-1] == '\n' || data[data_len-1] == '\r')) data_len--;
+
+    int head = snprintf(out, cap, ":%s %s %s :", source, command, target);
+    if (head < 0) head = 0;
+    if ((size_t) head > cap-2) head = cap-2;
+    if (data_len > cap-2 - head) data_len = cap-2 - head;
+
+    char* p = out + head;
+    memcpy(p, data, data_len);
+    for (char* eol = (char*) irc_scan(p, p + data_len, '\n'); eol < p + data_len;
+         eol = (char*) irc_scan(eol+1, p + data_len, '\n')) {
+        *eol = ' ';
+    }
+    for (char* cr = (char*) irc_scan(p, p + data_len, '\r'); cr < p + data_len;
+         cr = (char*) irc_scan(cr+1, p + data_len, '\r')) {
+        *cr = ' ';
+    }
+
+    p += data_len;
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - out;
+}
+
+#endif
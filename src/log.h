@@ -0,0 +1,201 @@
+#ifndef IRC_LOG_H_
+#define IRC_LOG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Asynchronous logging. A log call formats its message straight into a slot of the calling
+// thread's own ring and returns: no lock, no stdio, no syscall. One background thread drains
+// every ring, prefixes each record with its timestamp, level and thread, and writes whole
+// batches to stdout. A full ring drops records (they are counted and reported) instead of
+// stalling a reactor. log_debug compiles to nothing when NDEBUG is defined.
+#define LOG_RING_SLOTS 1024                 // per thread, power of two
+#define LOG_MSG_LEN 240
+#define LOG_MAX_THREADS 256
+#define LOG_IDLE_US 10000                   // flusher nap when every ring is empty
+#define LOG_OUT_LEN (64*1024)
+
+typedef enum _log_level {
+    log_level_debug,
+    log_level_info,
+    log_level_warn,
+    log_level_error,
+} log_level_e;
+
+static const char* log_level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+typedef struct _log_record {
+    uint64_t time_ns;
+    log_level_e level;
+    char msg[LOG_MSG_LEN];
+} log_record_t;
+
+// Single producer (the owning thread), single consumer (the flusher)
+typedef struct _log_ring {
+    _Alignas(64) uint64_t head;             // next slot the owner writes
+    _Alignas(64) uint64_t tail;             // next slot the flusher reads
+    uint64_t dropped;
+    uint64_t dropped_reported;              // flusher only
+    int thread_id;
+    log_record_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+typedef struct _logger {
+    log_ring_t* rings[LOG_MAX_THREADS];     // published once, never removed
+    int ring_qty;
+    log_level_e level;                      // records below it are discarded at the call site
+    bool started;                           // until log_start, records go to stdout directly
+    pthread_t flusher;
+} logger_t;
+
+static logger_t logger = { .level = log_level_info };
+static __thread log_ring_t* log_thread_ring = NULL;
+
+static log_ring_t* log_my_ring() {
+    if (log_thread_ring) return log_thread_ring;
+
+    int id = __atomic_fetch_add(&logger.ring_qty, 1, __ATOMIC_ACQ_REL);
+    if (id >= LOG_MAX_THREADS) return NULL;
+
+    log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) return NULL;
+    ring->thread_id = id;
+
+    __atomic_store_n(&logger.rings[id], ring, __ATOMIC_RELEASE);
+    log_thread_ring = ring;
+    return ring;
+}
+
+void log_write(log_level_e level, const char* fmt, ...) {
+    if (level < logger.level) return;
+
+    va_list args;
+    va_start(args, fmt);
+
+    log_ring_t* ring = __atomic_load_n(&logger.started, __ATOMIC_ACQUIRE) ? log_my_ring() : NULL;
+    if (!ring) {
+        vprintf(fmt, args);
+        putchar('\n');
+        va_end(args);
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    log_record_t* record = &ring->slots[head & (LOG_RING_SLOTS-1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+    record->level = level;
+    vsnprintf(record->msg, LOG_MSG_LEN, fmt, args);
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+#ifdef NDEBUG
+#define log_debug(...) ((void) 0)
+#else
+#define log_debug(...) log_write(log_level_debug, __VA_ARGS__)
+#endif
+#define log_info(...) log_write(log_level_info, __VA_ARGS__)
+#define log_warn(...) log_write(log_level_warn, __VA_ARGS__)
+#define log_error(...) log_write(log_level_error, __VA_ARGS__)
+
+// Like perror, but queued; call right after the failing call
+#define log_perror(what) log_error("%s: %s", what, strerror(errno))
+
+static size_t log_format(char* out, log_ring_t* ring, log_record_t* record) {
+    time_t secs = record->time_ns / 1000000000ull;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+
+    size_t msg_len = strnlen(record->msg, LOG_MSG_LEN);
+    while (msg_len && record->msg[msg_len-1] == '\n') msg_len--;
+
+    int len = snprintf(out, LOG_MSG_LEN + 64, "%02d:%02d:%02d.%06llu %-5s [t%d] %.*s\n",
+        tm.tm_hour, tm.tm_min, tm.tm_sec,
+        (unsigned long long) (record->time_ns % 1000000000ull) / 1000,
+        log_level_names[record->level], ring->thread_id, (int) msg_len, record->msg);
+    return len > 0 ? len : 0;
+}
+
+// Moves everything the rings hold into stdout; returns how many records it wrote
+static size_t log_drain(char* out) {
+    size_t out_len = 0;
+    size_t written = 0;
+
+    int ring_qty = __atomic_load_n(&logger.ring_qty, __ATOMIC_ACQUIRE);
+    if (ring_qty > LOG_MAX_THREADS) ring_qty = LOG_MAX_THREADS;
+
+    for (int i = 0; i < ring_qty; i++) {
+        log_ring_t* ring = __atomic_load_n(&logger.rings[i], __ATOMIC_ACQUIRE);
+        if (!ring) continue;
+
+        uint64_t tail = ring->tail;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++) {
+            if (out_len + LOG_MSG_LEN + 64 > LOG_OUT_LEN) {
+                fwrite(out, 1, out_len, stdout);
+                out_len = 0;
+            }
+            out_len += log_format(out + out_len, ring, &ring->slots[tail & (LOG_RING_SLOTS-1)]);
+            written++;
+
+            // Hand the slot back as soon as it is formatted
+            __atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+        }
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            out_len += snprintf(out + out_len, LOG_OUT_LEN - out_len, "log: thread %d dropped %llu records\n",
+                ring->thread_id, (unsigned long long) (dropped - ring->dropped_reported));
+            ring->dropped_reported = dropped;
+        }
+    }
+
+    if (out_len) {
+        fwrite(out, 1, out_len, stdout);
+        fflush(stdout);
+    }
+    return written;
+}
+
+static void* log_flusher_run(void* args) {
+    char* out = malloc(LOG_OUT_LEN);
+    if (!out) {
+        perror("log_flusher_run::malloc");
+        exit(1);
+    }
+
+    while (true) {
+        if (!log_drain(out)) usleep(LOG_IDLE_US);
+    }
+    return NULL;
+}
+
+// Starts the flusher; records below level are dropped at the call site from now on
+void log_start(log_level_e level) {
+    logger.level = level;
+    fflush(stdout);
+    if (pthread_create(&logger.flusher, NULL, log_flusher_run, NULL) != 0) {
+        perror("log_start::pthread_create");
+        exit(1);
+    }
+    __atomic_store_n(&logger.started, true, __ATOMIC_RELEASE);
+}
+
+#endif
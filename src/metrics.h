@@ -0,0 +1,132 @@
+#ifndef IRC_METRICS_H_
+#define IRC_METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Counters and latency histograms. Every reactor owns its reactor_metrics_t and is the only
+// thread writing it, so an update is a relaxed load plus store (a plain add on x86): no lock,
+// no atomic read-modify-write, no shared cache line on the relay path. Readers (/stats and the
+// metrics socket) load the same fields relaxed and may see a slightly stale, never torn, value.
+// Channel counters are only written under their channel's lock.
+//
+// Histograms are HDR-style log-linear: each power of two is split into HIST_SUB buckets, so any
+// recorded value is known to within 1/HIST_SUB (~6%) from nanoseconds up to centuries.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+#define metric_add(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define metric_get(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+typedef struct _hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} hist_t;
+
+typedef struct _reactor_metrics {
+    uint64_t msgs_in;                       // frames read from clients
+    uint64_t bytes_in;
+    uint64_t msgs_out;                      // frames queued to clients
+    uint64_t bytes_out;
+    uint64_t relays;                        // channel messages relayed
+    uint64_t fanout;                        // recipients over all relays
+    uint64_t drops;                         // frames refused by the slow-consumer policy
+    uint64_t disconnects;
+    uint64_t slow_disconnects;              // of which the slow-consumer policy forced
+    uint64_t timeouts;                      // of which an unanswered keepalive probe forced
+    uint64_t throttles;                     // frames refused or reads paused by flood control
+    uint64_t queue_bytes_hwm;               // deepest outbound queue left behind by a flush
+    hist_t relay_latency;                   // ns from reading a message to flushing it to the last recipient
+    hist_t fanout_size;                     // recipients per relay
+} reactor_metrics_t;
+
+typedef struct _channel_metrics {
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+    uint64_t drops;
+    uint64_t disconnects;
+} channel_metrics_t;
+
+static inline uint64_t metrics_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static inline int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB) return value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift+1) * HIST_SUB + ((value >> shift) & (HIST_SUB-1));
+}
+
+// Smallest value that lands in bucket
+static inline uint64_t hist_bucket_low(int bucket) {
+    if (bucket < HIST_SUB) return bucket;
+    int shift = bucket / HIST_SUB - 1;
+    return (uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+// Single writer only
+static inline void hist_record(hist_t* hist, uint64_t value) {
+    metric_add(hist->counts[hist_bucket(value)], 1);
+    metric_add(hist->count, 1);
+    metric_add(hist->sum, value);
+    if (value > metric_get(hist->max)) __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+void hist_merge(hist_t* into, hist_t* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) into->counts[i] += metric_get(from->counts[i]);
+    into->count += metric_get(from->count);
+    into->sum += metric_get(from->sum);
+    uint64_t max = metric_get(from->max);
+    if (max > into->max) into->max = max;
+}
+
+// Highest value equivalent to the q-quantile (0 < q <= 1), as HdrHistogram reports it
+uint64_t hist_quantile(hist_t* hist, double q) {
+    uint64_t count = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) count += hist->counts[i];
+    if (!count) return 0;
+
+    uint64_t rank = (uint64_t) (q * count + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen < rank) continue;
+
+        uint64_t high = i+1 < HIST_BUCKETS ? hist_bucket_low(i+1) - 1 : UINT64_MAX;
+        return high < hist->max ? high : hist->max;
+    }
+    return hist->max;
+}
+
+// Sums every counter of from into into (readers only)
+void reactor_metrics_merge(reactor_metrics_t* into, reactor_metrics_t* from) {
+    into->msgs_in += metric_get(from->msgs_in);
+    into->bytes_in += metric_get(from->bytes_in);
+    into->msgs_out += metric_get(from->msgs_out);
+    into->bytes_out += metric_get(from->bytes_out);
+    into->relays += metric_get(from->relays);
+    into->fanout += metric_get(from->fanout);
+    into->drops += metric_get(from->drops);
+    into->disconnects += metric_get(from->disconnects);
+    into->slow_disconnects += metric_get(from->slow_disconnects);
+    into->timeouts += metric_get(from->timeouts);
+    into->throttles += metric_get(from->throttles);
+    uint64_t hwm = metric_get(from->queue_bytes_hwm);
+    if (hwm > into->queue_bytes_hwm) into->queue_bytes_hwm = hwm;
+    hist_merge(&into->relay_latency, &from->relay_latency);
+    hist_merge(&into->fanout_size, &from->fanout_size);
+}
+
+#endif
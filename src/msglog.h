@@ -0,0 +1,577 @@
+#ifndef IRC_MSGLOG_H_
+#define IRC_MSGLOG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "irc.h"
+#include "log.h"
+#include "name_map.h"
+
+// Durable per-channel message log: an append-only sequence of fixed-size segment files under
+// <dir>/<channel>/, each mapped shared and named after the sequence number of its first record.
+// Relays only copy the record into the log's pending buffer; a single writer thread moves every
+// log's pending records into the mapped segments and msyncs them once per commit interval
+// (group commit), so no reactor ever waits on the disk. Readers see a record once it is synced
+// and read it straight from the mapping. A sparse in-memory index (one entry per
+// MSGLOG_INDEX_EVERY bytes of segment, rebuilt by scanning on open) finds where to start for a
+// sequence number or a point in time. Old segments are dropped by size and by age.
+#define MSGLOG_SEGMENT_BYTES (8u << 20)
+#define MSGLOG_INDEX_EVERY 4096
+#define MSGLOG_COMMIT_MS 10
+#define MSGLOG_RETAIN_BYTES (256ull << 20)  // per channel
+#define MSGLOG_RETAIN_SECONDS (7*24*3600)
+#define MSGLOG_ALIGN 8
+#define MSGLOG_REPLAY_BYTES (256*1024)     // most one replay queues at once
+
+typedef struct _msglog_record {
+    uint32_t len;                           // whole record, padded to MSGLOG_ALIGN; 0 past the last one
+    uint32_t sum;                           // FNV-1a of the rest of the record
+    uint64_t seq;
+    uint64_t time_ms;                       // wall clock when relayed
+    char frame[];                           // the message as a v1 frame: length, sender, data
+} msglog_record_t;
+
+#define MSGLOG_RECORD_MAX ((sizeof(msglog_record_t) + IRC_HEADER_LEN + MSG_LEN + MSGLOG_ALIGN-1) & ~(size_t) (MSGLOG_ALIGN-1))
+
+typedef struct _msglog_index {
+    uint64_t seq;
+    uint64_t time_ms;
+    uint32_t offset;
+} msglog_index_t;
+
+typedef struct _msglog_segment {
+    char* map;
+    size_t size;
+    int fd;
+    uint64_t first_seq;                     // from the file name
+    size_t end;                             // synced bytes, readers stop here
+    size_t write_end;                       // writer only: bytes written, synced or not
+    uint64_t last_ms;                       // writer only: time of the last record
+    msglog_index_t* index;                  // readers only look below index_qty
+    uint32_t index_qty;
+    uint32_t index_cap;
+    size_t next_index_at;
+    char path[PATH_MAX];
+} msglog_segment_t;
+
+typedef struct _msglog {
+    char name[CHANNEL_NAME_LEN];            // channel, the store's key
+    char dir[PATH_MAX];
+    int refs;                               // channels using it, under the store's lock
+    pthread_mutex_t lock;                   // guards pending and next_seq
+    char* pending;                          // records appended since the last commit
+    size_t pending_len;
+    size_t pending_cap;
+    char* committing;                       // writer only: the pending buffer being committed
+    size_t committing_cap;
+    uint64_t next_seq;
+    uint64_t synced_seq;                    // records below it can be read
+    pthread_rwlock_t segments_lock;         // readers against the writer adding and dropping segments
+    msglog_segment_t** segments;
+    int segment_qty;
+    int segment_cap;
+    size_t bytes;                           // writer only: written bytes over every segment
+    struct _msglog* next;
+} msglog_t;
+
+typedef struct _msglog_store {
+    char* dir;                              // NULL = no logs
+    size_t segment_bytes;
+    size_t retain_bytes;
+    uint64_t retain_ms;
+    int commit_ms;
+    pthread_mutex_t lock;                   // guards names, list and every log's refs
+    name_map_t names;
+    msglog_t* list;
+    pthread_t thread;
+    uint64_t commits;                       // group commits that synced anything
+    uint64_t synced_bytes;
+} msglog_store_t;
+
+static uint32_t msglog_sum(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (uint8_t) data[i]) * 16777619u;
+    return hash;
+}
+
+static inline uint64_t msglog_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Valid record at offset (with the expected seq) or NULL
+static msglog_record_t* msglog_record_at(char* map, size_t size, size_t offset, uint64_t seq) {
+    if (offset + sizeof(msglog_record_t) > size) return NULL;
+    msglog_record_t* record = (msglog_record_t*) (map + offset);
+    if (record->len < sizeof(msglog_record_t) + IRC_HEADER_LEN || record->len > MSGLOG_RECORD_MAX) return NULL;
+    if (offset + record->len > size || record->seq != seq) return NULL;
+    if (record->sum != msglog_sum(map + offset + 2*sizeof(uint32_t), record->len - 2*sizeof(uint32_t))) return NULL;
+    return record;
+}
+
+// A logged message's v1 frame, picked apart in place
+static inline bool msglog_record_parts(msglog_record_t* record, short* length, const char** name, size_t* name_len, const char** data) {
+    memcpy(length, record->frame, sizeof(short));
+    if (*length < 0 || *length >= MSG_LEN || IRC_HEADER_LEN + *length > record->len - sizeof(msglog_record_t)) return false;
+    *name = record->frame + sizeof(short);
+    *name_len = strnlen(*name, IRC_NAME_LEN);
+    *data = record->frame + IRC_HEADER_LEN;
+    return true;
+}
+
+// Writer only, or before the log is shared
+static void msglog_index_record(msglog_segment_t* segment, msglog_record_t* record, size_t offset) {
+    if (offset < segment->next_index_at || segment->index_qty == segment->index_cap) return;
+    segment->index[segment->index_qty] = (msglog_index_t) { .seq = record->seq, .time_ms = record->time_ms, .offset = offset };
+    __atomic_store_n(&segment->index_qty, segment->index_qty+1, __ATOMIC_RELEASE);
+    segment->next_index_at = offset + MSGLOG_INDEX_EVERY;
+}
+
+static void msglog_segment_close(msglog_segment_t* segment, bool unlink_file) {
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    if (unlink_file && unlink(segment->path) == -1) log_perror("msglog_segment_close::unlink");
+    free(segment->index);
+    free(segment);
+}
+
+// Maps the segment file at path, creating it size bytes long if first_seq's file is new. An
+// existing one is scanned to rebuild its index and find where it ends; a torn tail is zeroed.
+static msglog_segment_t* msglog_segment_open(const char* path, uint64_t first_seq, size_t size, bool create) {
+    msglog_segment_t* segment = calloc(1, sizeof(msglog_segment_t));
+    if (!segment) {
+        log_perror("msglog_segment_open::calloc");
+        return NULL;
+    }
+    snprintf(segment->path, PATH_MAX, "%s", path);
+    segment->first_seq = first_seq;
+
+    segment->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+    struct stat st;
+    if (segment->fd == -1 || (create && ftruncate(segment->fd, size) == -1) || fstat(segment->fd, &st) == -1) {
+        log_error("msglog_segment_open::%s: %s", path, strerror(errno));
+        if (segment->fd != -1) close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    segment->size = st.st_size;
+    segment->map = mmap(NULL, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    segment->index_cap = segment->size / MSGLOG_INDEX_EVERY + 1;
+    segment->index = malloc(segment->index_cap * sizeof(msglog_index_t));
+    if (segment->map == MAP_FAILED || !segment->index) {
+        log_error("msglog_segment_open::%s: %s", path, strerror(errno));
+        if (segment->map != MAP_FAILED) munmap(segment->map, segment->size);
+        close(segment->fd);
+        free(segment->index);
+        free(segment);
+        return NULL;
+    }
+
+    size_t offset = 0;
+    msglog_record_t* record;
+    uint64_t seq = first_seq;
+    while ((record = msglog_record_at(segment->map, segment->size, offset, seq))) {
+        msglog_index_record(segment, record, offset);
+        segment->last_ms = record->time_ms;
+        offset += record->len;
+        seq++;
+    }
+    if (offset + sizeof(uint32_t) <= segment->size && *(uint32_t*) (segment->map + offset)) {
+        log_warn("msglog_segment_open::%s: torn record at %zu, dropping the rest", path, offset);
+        memset(segment->map + offset, 0, segment->size - offset);
+        msync(segment->map, segment->size, MS_SYNC);
+    }
+    segment->end = segment->write_end = offset;
+    return segment;
+}
+
+static inline uint64_t msglog_segment_next_seq(msglog_segment_t* segment) {
+    if (!segment->write_end) return segment->first_seq;
+    msglog_index_t* last = &segment->index[segment->index_qty-1];
+    uint64_t seq = last->seq;
+    for (size_t offset = last->offset; offset < segment->write_end; seq++) {
+        offset += ((msglog_record_t*) (segment->map + offset))->len;
+    }
+    return seq;
+}
+
+// Writer only (or before the log is shared); takes segments_lock to publish
+static bool msglog_add_segment(msglog_t* log, msglog_segment_t* segment) {
+    if (log->segment_qty == log->segment_cap) {
+        int new_cap = log->segment_cap ? log->segment_cap*2 : 4;
+        msglog_segment_t** segments = malloc(new_cap * sizeof(msglog_segment_t*));
+        if (!segments) {
+            log_perror("msglog_add_segment::malloc");
+            return false;
+        }
+        if (log->segment_qty) memcpy(segments, log->segments, log->segment_qty * sizeof(msglog_segment_t*));
+
+        pthread_rwlock_wrlock(&log->segments_lock);
+        msglog_segment_t** old = log->segments;
+        log->segments = segments;
+        log->segment_cap = new_cap;
+        pthread_rwlock_unlock(&log->segments_lock);
+        free(old);
+    }
+
+    pthread_rwlock_wrlock(&log->segments_lock);
+    log->segments[log->segment_qty++] = segment;
+    pthread_rwlock_unlock(&log->segments_lock);
+    log->bytes += segment->write_end;
+    return true;
+}
+
+static bool msglog_roll(msglog_store_t* store, msglog_t* log, uint64_t first_seq) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%020llu.seg", log->dir, (unsigned long long) first_seq);
+    msglog_segment_t* segment = msglog_segment_open(path, first_seq, store->segment_bytes, true);
+    if (!segment) return false;
+    if (!msglog_add_segment(log, segment)) {
+        msglog_segment_close(segment, true);
+        return false;
+    }
+
+    // The new file's name must be durable before its records are
+    int dir_fd = open(log->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return true;
+}
+
+static int msglog_segment_filter(const struct dirent* entry) {
+    size_t len = strlen(entry->d_name);
+    return len == 24 && !strcmp(entry->d_name + 20, ".seg");
+}
+
+// The channel's name, with anything but [A-Za-z0-9_-] as %XX, is its directory
+static void msglog_dir_name(const char* channel, char* out, size_t cap) {
+    size_t len = 0;
+    for (; *channel && len + 4 < cap; channel++) {
+        unsigned char c = *channel;
+        bool plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+        if (plain) out[len++] = c;
+        else len += snprintf(out + len, cap - len, "%%%02X", c);
+    }
+    out[len] = '\0';
+}
+
+static void msglog_free(msglog_t* log) {
+    for (int i = 0; i < log->segment_qty; i++) msglog_segment_close(log->segments[i], false);
+    free(log->segments);
+    free(log->pending);
+    free(log->committing);
+    pthread_mutex_destroy(&log->lock);
+    pthread_rwlock_destroy(&log->segments_lock);
+    free(log);
+}
+
+// Opens every segment of the channel's log (or starts one), scanning them back in
+static msglog_t* msglog_load(msglog_store_t* store, const char* channel) {
+    msglog_t* log = calloc(1, sizeof(msglog_t));
+    if (!log) {
+        log_perror("msglog_load::calloc");
+        return NULL;
+    }
+    strncpy(log->name, channel, CHANNEL_NAME_LEN-1);
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_rwlock_init(&log->segments_lock, NULL);
+
+    char dir_name[3*CHANNEL_NAME_LEN];
+    msglog_dir_name(channel, dir_name, sizeof(dir_name));
+    snprintf(log->dir, PATH_MAX, "%s/%s", store->dir, dir_name);
+    if (mkdir(log->dir, 0755) == -1 && errno != EEXIST) {
+        log_error("msglog_load::mkdir %s: %s", log->dir, strerror(errno));
+        msglog_free(log);
+        return NULL;
+    }
+
+    struct dirent** entries;
+    int entry_qty = scandir(log->dir, &entries, msglog_segment_filter, alphasort);
+    for (int i = 0; i < entry_qty; i++) {
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", log->dir, entries[i]->d_name);
+        uint64_t first_seq = strtoull(entries[i]->d_name, NULL, 10);
+        free(entries[i]);
+
+        // A gap means the segments in between are gone: only what follows the gap still chains
+        if (log->segment_qty && first_seq != log->next_seq) {
+            log_warn("msglog_load::%s: expected a segment from %llu, dropping what came before",
+                path, (unsigned long long) log->next_seq);
+            while (log->segment_qty) msglog_segment_close(log->segments[--log->segment_qty], true);
+            log->bytes = 0;
+        }
+
+        msglog_segment_t* segment = msglog_segment_open(path, first_seq, 0, false);
+        if (!segment) continue;
+        if (!msglog_add_segment(log, segment)) {
+            msglog_segment_close(segment, false);
+            continue;
+        }
+        log->next_seq = msglog_segment_next_seq(segment);
+    }
+    if (entry_qty > 0) free(entries);
+
+    log->synced_seq = log->next_seq;
+    if (!log->segment_qty && !msglog_roll(store, log, log->next_seq)) {
+        msglog_free(log);
+        return NULL;
+    }
+    log_info("msglog_load::%s: %d segments, next message %llu", log->dir, log->segment_qty, (unsigned long long) log->next_seq);
+    return log;
+}
+
+// The channel's log, loaded on first use. Every msglog_open needs its msglog_close.
+msglog_t* msglog_open(msglog_store_t* store, const char* channel) {
+    if (!store->dir) return NULL;
+
+    pthread_mutex_lock(&store->lock);
+    msglog_t* log = name_map_get(&store->names, channel);
+    if (!log && (log = msglog_load(store, channel))) {
+        name_map_insert(&store->names, log->name, log);
+        log->next = store->list;
+        store->list = log;
+    }
+    if (log) log->refs++;
+    pthread_mutex_unlock(&store->lock);
+    return log;
+}
+
+// Another reference to a log that is known to be open
+void msglog_ref(msglog_store_t* store, msglog_t* log) {
+    pthread_mutex_lock(&store->lock);
+    log->refs++;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// The writer unloads the log once whatever it still holds is committed
+void msglog_close(msglog_store_t* store, msglog_t* log) {
+    if (!log) return;
+    pthread_mutex_lock(&store->lock);
+    log->refs--;
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Queues pkt for the next group commit; returns its sequence number. Appends to one log must be
+// serialized by the caller, which sets the order of the records.
+uint64_t msglog_append(msglog_t* log, irc_packet_t* pkt) {
+    pthread_mutex_lock(&log->lock);
+    size_t len = (sizeof(msglog_record_t) + IRC_HEADER_LEN + pkt->length + MSGLOG_ALIGN-1) & ~(size_t) (MSGLOG_ALIGN-1);
+    if (log->pending_len + len > log->pending_cap) {
+        size_t new_cap = log->pending_cap ? log->pending_cap*2 : 16*MSGLOG_RECORD_MAX;
+        while (new_cap < log->pending_len + len) new_cap *= 2;
+        char* pending = realloc(log->pending, new_cap);
+        if (!pending) {
+            log_perror("msglog_append::realloc");
+            pthread_mutex_unlock(&log->lock);
+            return UINT64_MAX;
+        }
+        log->pending = pending;
+        log->pending_cap = new_cap;
+    }
+
+    msglog_record_t* record = (msglog_record_t*) (log->pending + log->pending_len);
+    memset(record, 0, len);
+    record->len = len;
+    record->seq = log->next_seq++;
+    record->time_ms = msglog_now_ms();
+    irc_encode(pkt, record->frame);
+    record->sum = msglog_sum((char*) record + 2*sizeof(uint32_t), len - 2*sizeof(uint32_t));
+    log->pending_len += len;
+
+    uint64_t seq = record->seq;
+    pthread_mutex_unlock(&log->lock);
+    return seq;
+}
+
+// Writer only: drops the oldest segments past the store's size or age bound, never the last
+static void msglog_retain(msglog_store_t* store, msglog_t* log, uint64_t now_ms) {
+    while (log->segment_qty > 1) {
+        msglog_segment_t* oldest = log->segments[0];
+        bool too_big = log->bytes > store->retain_bytes;
+        bool too_old = oldest->last_ms + store->retain_ms < now_ms;
+        if (!too_big && !too_old) break;
+
+        pthread_rwlock_wrlock(&log->segments_lock);
+        memmove(log->segments, log->segments+1, (log->segment_qty-1) * sizeof(msglog_segment_t*));
+        log->segment_qty--;
+        pthread_rwlock_unlock(&log->segments_lock);
+
+        log->bytes -= oldest->write_end;
+        log_info("msglog_retain::dropping %s (%s)", oldest->path, too_big ? "size" : "age");
+        msglog_segment_close(oldest, true);
+    }
+}
+
+// Writer only: moves the pending records into the segments and syncs them
+static void msglog_commit(msglog_store_t* store, msglog_t* log) {
+    // Appends go on into the other buffer meanwhile
+    pthread_mutex_lock(&log->lock);
+    char* records = log->pending;
+    size_t records_cap = log->pending_cap;
+    size_t len = log->pending_len;
+    log->pending = log->committing;
+    log->pending_cap = log->committing_cap;
+    log->pending_len = 0;
+    log->committing = records;
+    log->committing_cap = records_cap;
+    pthread_mutex_unlock(&log->lock);
+    if (!len) return;
+
+    // Segments written this round, from the first one that got anything
+    int first_touched = log->segment_qty-1;
+    size_t synced_from = log->segments[first_touched]->write_end;
+    uint64_t next_seq = 0;
+    for (size_t at = 0; at < len;) {
+        msglog_record_t* record = (msglog_record_t*) (records + at);
+        msglog_segment_t* segment = log->segments[log->segment_qty-1];
+        if (segment->write_end + record->len > segment->size) {
+            if (!msglog_roll(store, log, record->seq)) break;
+            continue;
+        }
+
+        memcpy(segment->map + segment->write_end, record, record->len);
+        msglog_index_record(segment, (msglog_record_t*) (segment->map + segment->write_end), segment->write_end);
+        segment->write_end += record->len;
+        segment->last_ms = record->time_ms;
+        log->bytes += record->len;
+        next_seq = record->seq+1;
+        at += record->len;
+    }
+
+    // Durable first, then visible
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (int i = first_touched; i < log->segment_qty; i++) {
+        msglog_segment_t* segment = log->segments[i];
+        size_t from = i == first_touched ? synced_from & ~(page-1) : 0;
+        if (segment->write_end > from && msync(segment->map + from, segment->write_end - from, MS_SYNC) == -1) {
+            log_perror("msglog_commit::msync");
+        }
+        __atomic_store_n(&segment->end, segment->write_end, __ATOMIC_RELEASE);
+    }
+    if (next_seq) __atomic_store_n(&log->synced_seq, next_seq, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&store->commits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&store->synced_bytes, len, __ATOMIC_RELAXED);
+
+    msglog_retain(store, log, msglog_now_ms());
+}
+
+static void* msglog_run(void* arg) {
+    msglog_store_t* store = arg;
+    struct timespec interval = { .tv_sec = store->commit_ms / 1000, .tv_nsec = (store->commit_ms % 1000) * 1000000L };
+
+    while (true) {
+        nanosleep(&interval, NULL);
+
+        // Only this thread frees logs, so they outlive the unlocked commits
+        pthread_mutex_lock(&store->lock);
+        msglog_t* list = store->list;
+        pthread_mutex_unlock(&store->lock);
+        for (msglog_t* log = list; log; log = log->next) msglog_commit(store, log);
+
+        // Unload logs no channel uses anymore, once committed
+        pthread_mutex_lock(&store->lock);
+        for (msglog_t** link = &store->list; *link;) {
+            msglog_t* log = *link;
+            pthread_mutex_lock(&log->lock);
+            bool idle = !log->refs && !log->pending_len;
+            pthread_mutex_unlock(&log->lock);
+            if (!idle) {
+                link = &log->next;
+                continue;
+            }
+            *link = log->next;
+            name_map_remove(&store->names, log->name);
+            msglog_free(log);
+        }
+        pthread_mutex_unlock(&store->lock);
+    }
+    return NULL;
+}
+
+void msglog_store_init(msglog_store_t* store, char* dir, size_t segment_bytes, size_t retain_bytes, uint64_t retain_s, int commit_ms) {
+    *store = (msglog_store_t) {
+        .dir = dir && dir[0] ? dir : NULL,
+        .segment_bytes = segment_bytes,
+        .retain_bytes = retain_bytes,
+        .retain_ms = retain_s * 1000,
+        .commit_ms = commit_ms > 0 ? commit_ms : MSGLOG_COMMIT_MS
+    };
+    pthread_mutex_init(&store->lock, NULL);
+    name_map_init(&store->names);
+    if (store->dir && mkdir(store->dir, 0755) == -1 && errno != EEXIST) {
+        perror("msglog_store_init::mkdir");
+        exit(1);
+    }
+}
+
+void msglog_store_start(msglog_store_t* store) {
+    if (store->dir) pthread_create(&store->thread, NULL, msglog_run, store);
+}
+
+// Hands fn every synced record from since_seq on (or, with since_ms, from that time on), oldest
+// first, straight from the mapping, until fn returns false. Lock-free against appends and
+// commits; only adding and dropping segments waits for it.
+void msglog_scan(msglog_t* log, uint64_t since_seq, uint64_t since_ms, bool (*fn)(msglog_record_t* record, void* ctx), void* ctx) {
+    pthread_rwlock_rdlock(&log->segments_lock);
+
+    // Last segment (and last index entry in it) starting at or before the target
+    bool by_time = since_ms != 0;
+    int first = 0;
+    for (int i = log->segment_qty-1; i > 0; i--) {
+        msglog_segment_t* segment = log->segments[i];
+        if (!__atomic_load_n(&segment->index_qty, __ATOMIC_ACQUIRE)) continue;
+        if (by_time ? segment->index[0].time_ms <= since_ms : segment->index[0].seq <= since_seq) {
+            first = i;
+            break;
+        }
+    }
+
+    bool more = true;
+    for (int i = first; i < log->segment_qty && more; i++) {
+        msglog_segment_t* segment = log->segments[i];
+        size_t end = __atomic_load_n(&segment->end, __ATOMIC_ACQUIRE);
+        uint32_t index_qty = __atomic_load_n(&segment->index_qty, __ATOMIC_ACQUIRE);
+
+        size_t offset = 0;
+        if (i == first) {
+            uint32_t low = 0, high = index_qty;
+            while (high - low > 1) {
+                uint32_t mid = (low + high) / 2;
+                msglog_index_t* entry = &segment->index[mid];
+                if (by_time ? entry->time_ms <= since_ms : entry->seq <= since_seq) low = mid;
+                else high = mid;
+            }
+            if (index_qty && segment->index[low].offset < end) offset = segment->index[low].offset;
+        }
+
+        while (more && offset < end) {
+            msglog_record_t* record = (msglog_record_t*) (segment->map + offset);
+            offset += record->len;
+            if (by_time ? record->time_ms < since_ms : record->seq < since_seq) continue;
+            more = fn(record, ctx);
+        }
+    }
+    pthread_rwlock_unlock(&log->segments_lock);
+}
+
+static inline uint64_t msglog_synced_seq(msglog_t* log) {
+    return __atomic_load_n(&log->synced_seq, __ATOMIC_ACQUIRE);
+}
+
+#endif
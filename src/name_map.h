@@ -0,0 +1,113 @@
+#ifndef IRC_NAME_MAP_H_
+#define IRC_NAME_MAP_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Open-addressing hash map from a name to a value. Keys are borrowed: they must point into
+// the value itself (e.g. user->name) and stay unchanged while indexed, so renaming means
+// remove, edit, insert. Not thread-safe, callers bring their own lock.
+#define NAME_MAP_MIN_CAP 64
+
+typedef struct _name_map_entry {
+    const char* key;                        // NULL = empty, NAME_MAP_TOMBSTONE = deleted
+    uint32_t hash;
+    void* value;
+} name_map_entry_t;
+
+typedef struct _name_map {
+    name_map_entry_t* entries;
+    uint32_t cap;                           // always a power of two
+    uint32_t qty;
+    uint32_t used;                          // live + tombstones, drives rehashing
+} name_map_t;
+
+static const char NAME_MAP_TOMBSTONE[] = "";
+
+// FNV-1a
+uint32_t hash_name(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void name_map_init(name_map_t* map) {
+    map->cap = NAME_MAP_MIN_CAP;
+    map->entries = calloc(map->cap, sizeof(name_map_entry_t));
+    map->qty = 0;
+    map->used = 0;
+}
+
+static name_map_entry_t* name_map_probe(name_map_t* map, const char* key, uint32_t hash) {
+    uint32_t mask = map->cap-1;
+    for (uint32_t i = hash & mask;; i = (i+1) & mask) {
+        name_map_entry_t* entry = &map->entries[i];
+        if (!entry->key) return entry;
+        if (entry->key != NAME_MAP_TOMBSTONE && entry->hash == hash && !strcmp(entry->key, key)) {
+            return entry;
+        }
+    }
+}
+
+void* name_map_get(name_map_t* map, const char* key) {
+    name_map_entry_t* entry = name_map_probe(map, key, hash_name(key));
+    return entry->key ? entry->value : NULL;
+}
+
+static void name_map_rehash(name_map_t* map, uint32_t new_cap) {
+    name_map_entry_t* old = map->entries;
+    uint32_t old_cap = map->cap;
+
+    map->entries = calloc(new_cap, sizeof(name_map_entry_t));
+    map->cap = new_cap;
+    map->used = map->qty;
+
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (!old[i].key || old[i].key == NAME_MAP_TOMBSTONE) continue;
+        *name_map_probe(map, old[i].key, old[i].hash) = old[i];
+    }
+    free(old);
+}
+
+// Fails if the key is already present
+bool name_map_insert(name_map_t* map, const char* key, void* value) {
+    if ((map->used+1) * 4 > map->cap * 3) {
+        name_map_rehash(map, map->qty*2 >= map->cap ? map->cap*2 : map->cap);
+    }
+
+    uint32_t hash = hash_name(key);
+    name_map_entry_t* entry = name_map_probe(map, key, hash);
+    if (entry->key) return false;
+
+    *entry = (name_map_entry_t) { .key = key, .hash = hash, .value = value };
+    map->qty++;
+    map->used++;
+    return true;
+}
+
+void* name_map_remove(name_map_t* map, const char* key) {
+    name_map_entry_t* entry = name_map_probe(map, key, hash_name(key));
+    if (!entry->key) return NULL;
+
+    void* value = entry->value;
+    entry->key = NAME_MAP_TOMBSTONE;
+    entry->value = NULL;
+    map->qty--;
+    return value;
+}
+
+// Calls fn on every value; fn may remove the entry it is handed, but nothing else
+void name_map_foreach(name_map_t* map, void (*fn)(void* value, void* arg), void* arg) {
+    for (uint32_t i = 0; i < map->cap; i++) {
+        name_map_entry_t* entry = &map->entries[i];
+        if (entry->key && entry->key != NAME_MAP_TOMBSTONE) fn(entry->value, arg);
+    }
+}
+
+#endif
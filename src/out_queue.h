@@ -0,0 +1,259 @@
+#ifndef IRC_OUT_QUEUE_H_
+#define IRC_OUT_QUEUE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "shared_buf.h"
+
+// Per-connection outbound queue. Writers never touch the socket: frames are queued and the
+// queue is flushed later with one vectored sendmsg, so every message queued for the same
+// connection between two flushes leaves in a single syscall. Whatever the kernel does not
+// take is drained by the owning reactor on EPOLLOUT. Entries are references to shared,
+// already-encoded frames kept in a ring that only grows, so queuing a message allocates
+// nothing in steady state. The queue is bounded by the pool memory its frames hold; what
+// happens past the bound is the slow-consumer policy.
+#define OUT_QUEUE_MIN_CAP 8
+#define OUT_QUEUE_IOV 64                    // frames per sendmsg
+
+typedef enum _slow_policy {
+    slow_drop_oldest,                       // evict queued frames (never a half-written one)
+    slow_drop_newest,                       // refuse the incoming frame
+    slow_disconnect,                        // hang up on the consumer
+} slow_policy_e;
+
+typedef enum _out_result {
+    out_pending,                            // queue went idle -> pending, schedule a flush
+    out_queued,                             // queued behind frames that already have a flush coming
+    out_dropped,                            // refused by the policy
+    out_overflow,                           // policy says disconnect
+    out_error,                              // socket error, connection is dead
+} out_result_e;
+
+typedef struct _out_ref {
+    shared_buf_t* buf;
+    uint32_t sent;                          // bytes of buf already written
+} out_ref_t;
+
+typedef struct _out_queue {
+    pthread_mutex_t lock;
+    out_ref_t* ring;
+    uint32_t cap;                           // power of two
+    uint32_t head;
+    uint32_t qty;
+    size_t bytes;                           // unsent bytes over all entries
+    size_t held;                            // pool bytes the queued frames take, what max_bytes bounds
+    size_t dropped;                         // frames lost to the policy
+    uint32_t pinned;                        // head entries an asynchronous send still owns
+    bool want_out;                          // EPOLLOUT armed, or an io_uring send scheduled
+    bool dirty;                             // a flush is already scheduled
+    bool dead;                              // overflowed or errored, refuse everything
+} out_queue_t;
+
+void out_queue_init(out_queue_t* queue) {
+    memset(queue, 0, sizeof(out_queue_t));
+    pthread_mutex_init(&queue->lock, NULL);
+}
+
+static inline out_ref_t* out_queue_at(out_queue_t* queue, uint32_t i) {
+    return &queue->ring[(queue->head + i) & (queue->cap-1)];
+}
+
+static inline bool out_queue_empty(out_queue_t* queue) {
+    return queue->qty == 0;
+}
+
+// Needs queue->lock
+static void out_queue_pop(out_queue_t* queue) {
+    out_ref_t* ref = out_queue_at(queue, 0);
+    queue->bytes -= ref->buf->len - ref->sent;
+    queue->held -= ref->buf->size;
+    shared_buf_unref(ref->buf);
+    queue->head = (queue->head+1) & (queue->cap-1);
+    queue->qty--;
+}
+
+// Needs queue->lock
+static bool out_queue_append(out_queue_t* queue, shared_buf_t* buf, uint32_t sent) {
+    if (queue->qty == queue->cap) {
+        uint32_t new_cap = queue->cap ? queue->cap*2 : OUT_QUEUE_MIN_CAP;
+        out_ref_t* ring = malloc(new_cap * sizeof(out_ref_t));
+        if (!ring) {
+            perror("out_queue_append::malloc");
+            return false;
+        }
+        for (uint32_t i = 0; i < queue->qty; i++) ring[i] = *out_queue_at(queue, i);
+        free(queue->ring);
+        queue->ring = ring;
+        queue->cap = new_cap;
+        queue->head = 0;
+    }
+
+    *out_queue_at(queue, queue->qty++) = (out_ref_t) { .buf = shared_buf_ref(buf), .sent = sent };
+    queue->bytes += buf->len - sent;
+    queue->held += buf->size;
+    return true;
+}
+
+void out_queue_clear(out_queue_t* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->qty) out_queue_pop(queue);
+    free(queue->ring);
+    queue->ring = NULL;
+    queue->cap = 0;
+    queue->head = 0;
+    queue->dead = true;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Points iov at up to max of the first queued entries (what is left of each); returns how many
+static int out_queue_fill_iov(out_queue_t* queue, struct iovec* iov, int max) {
+    int iov_qty = 0;
+    for (; iov_qty < max && iov_qty < queue->qty; iov_qty++) {
+        out_ref_t* ref = out_queue_at(queue, iov_qty);
+        iov[iov_qty].iov_base = ref->buf->data + ref->sent;
+        iov[iov_qty].iov_len = ref->buf->len - ref->sent;
+    }
+    return iov_qty;
+}
+
+// Retires every frame the kernel fully took, and advances into a partial one. Needs queue->lock.
+static void out_queue_consume(out_queue_t* queue, size_t sent) {
+    while (sent > 0 && queue->qty) {
+        out_ref_t* ref = out_queue_at(queue, 0);
+        size_t left = ref->buf->len - ref->sent;
+        if (sent < left) {
+            ref->sent += sent;
+            queue->bytes -= sent;
+            break;
+        }
+
+        sent -= left;
+        queue->bytes -= left;
+        ref->sent = ref->buf->len;
+        out_queue_pop(queue);
+    }
+}
+
+// Writes queued entries, up to OUT_QUEUE_IOV per sendmsg, until the queue is empty or the
+// socket would block. Needs queue->lock. Returns false on a socket error. Does nothing while
+// an asynchronous send owns the head, whoever completes it writes the rest.
+static bool out_queue_flush(out_queue_t* queue, int sock) {
+    queue->dirty = false;
+    if (queue->pinned) return true;
+
+    while (queue->qty) {
+        struct iovec iov[OUT_QUEUE_IOV];
+        int iov_qty = out_queue_fill_iov(queue, iov, OUT_QUEUE_IOV);
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov_qty };
+        ssize_t sent = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            return false;
+        }
+        out_queue_consume(queue, sent);
+    }
+    return true;
+}
+
+// Makes room for a frame holding size more pool bytes according to policy. Needs queue->lock.
+static out_result_e out_queue_admit(out_queue_t* queue, size_t size, size_t max_bytes, slow_policy_e policy) {
+    if (queue->held + size <= max_bytes) return out_queued;
+
+    switch (policy) {
+        case slow_drop_newest:
+            queue->dropped++;
+            return out_dropped;
+        case slow_drop_oldest: {
+            // A half-written head, or entries an asynchronous send still owns, must stay:
+            // evicting them would corrupt the stream. Evict right behind them instead.
+            uint32_t keep = queue->pinned;
+            if (!keep && queue->qty && out_queue_at(queue, 0)->sent) keep = 1;
+
+            uint32_t evicted = 0;
+            while (keep + evicted < queue->qty && queue->held + size > max_bytes) {
+                out_ref_t* ref = out_queue_at(queue, keep + evicted);
+                queue->bytes -= ref->buf->len - ref->sent;
+                queue->held -= ref->buf->size;
+                shared_buf_unref(ref->buf);
+                queue->dropped++;
+                evicted++;
+            }
+
+            // Slide the kept entries up to close the gap
+            for (uint32_t i = keep; i-- > 0;) *out_queue_at(queue, i + evicted) = *out_queue_at(queue, i);
+            queue->head = (queue->head + evicted) & (queue->cap-1);
+            queue->qty -= evicted;
+
+            if (queue->held + size > max_bytes) {
+                queue->dropped++;
+                return out_dropped;
+            }
+            return out_queued;
+        }
+        case slow_disconnect:
+        default:
+            queue->dead = true;
+            return out_overflow;
+    }
+}
+
+// Queues a reference to buf (the caller keeps its own). out_pending means nothing was queued
+// nor scheduled before, so the caller must arrange an out_queue_flush.
+out_result_e out_queue_push(out_queue_t* queue, shared_buf_t* buf, size_t max_bytes, slow_policy_e policy) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->dead) {
+        pthread_mutex_unlock(&queue->lock);
+        return out_dropped;
+    }
+
+    out_result_e result = out_queue_admit(queue, buf->size, max_bytes, policy);
+    if (result == out_queued && !out_queue_append(queue, buf, 0)) result = out_dropped;
+
+    // Frames behind an armed EPOLLOUT or an earlier push are flushed along with those
+    if (result == out_queued && !queue->dirty && !queue->want_out) {
+        queue->dirty = true;
+        result = out_pending;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+// out_queue_push for several frames at once, under one lock: they all leave in the same flush.
+// out_dropped only if none was queued; an overflow stops at the frame that caused it.
+out_result_e out_queue_push_batch(out_queue_t* queue, shared_buf_t** bufs, int qty, size_t max_bytes, slow_policy_e policy) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->dead) {
+        pthread_mutex_unlock(&queue->lock);
+        return out_dropped;
+    }
+
+    out_result_e result = out_dropped;
+    for (int i = 0; i < qty; i++) {
+        out_result_e admitted = out_queue_admit(queue, bufs[i]->size, max_bytes, policy);
+        if (admitted == out_overflow) {
+            result = out_overflow;
+            break;
+        }
+        if (admitted == out_queued && out_queue_append(queue, bufs[i], 0)) result = out_queued;
+    }
+
+    if (result == out_queued && !queue->dirty && !queue->want_out) {
+        queue->dirty = true;
+        result = out_pending;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+#endif
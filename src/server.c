@@ -1,39 +1,144 @@
 #include "server.h"
 
-int main(int argc, char const *argv[]) {
-    server_t server = server_new(AF_INET, "0.0.0.0", SERVER_PORT);
-    printf("Server up and running!\n");
+int main(int argc, char* const argv[]) {
+    server_config_t config = server_config_default();
+    log_level_e log_level = log_level_info;
+    int port = SERVER_PORT;
+    char metrics_path[sizeof(((struct sockaddr_un*) NULL)->sun_path)];
 
-    user_t new_user = {.can_speak = true};
-    irc_sock_t* new_conn = &new_user.connection;
-    new_conn->addr_len = sizeof(struct sockaddr_in);
-    while (true) {
-        int client_sock = accept(server.listening.sock, (struct sockaddr*) &new_conn->addr, &new_conn->addr_len);
-
-        if (client_sock == -1) {
-            perror("Connection refused");
-        } else {
-            recv(client_sock, new_user.name, IRC_NAME_LEN, 0);
-            user_t* existing_user = server_search_client_by_name(&server, new_user.name);
-            if(existing_user) {
-                send(client_sock, "rejected", sizeof("accepted"), 0);
-                continue;
-            }
-
-            send(client_sock, "accepted", sizeof("accepted"), 0);
-            new_user.connection.sock = client_sock;
-
-            user_t* server_user = &server.clients[server.client_qty++];
-            *server_user = new_user;
-
-            channel_t* main_channel = server_search_channel_by_name(&server, "#main");
-            if (!main_channel) {
-                server_add_channel(&server, "#main", server_user, NULL);
-            } else {
-                channel_add_user(main_channel, server_user, NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "r:a:b:q:p:t:l:m:e:f:H:B:L:G:R:A:P:N:S:C:i:w:W:F:Y:D:")) != -1) {
+        switch (opt) {
+            case 'r':
+                config.reactor_qty = atoi(optarg);
+                break;
+            case 'a':
+                config.acceptor_qty = atoi(optarg);
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                break;
+            case 'q':
+                config.out_queue_max_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                if (!strcmp(optarg, "oldest")) config.slow_policy = slow_drop_oldest;
+                else if (!strcmp(optarg, "newest")) config.slow_policy = slow_drop_newest;
+                else if (!strcmp(optarg, "disconnect")) config.slow_policy = slow_disconnect;
+                else {
+                    fprintf(stderr, "unknown slow-consumer policy %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                config.text_port = atoi(optarg);
+                break;
+            case 'm':
+                config.metrics_path = optarg;
+                break;
+            case 'f':
+                config.fanout_worker_qty = atoi(optarg);
+                break;
+            case 'H':
+                config.history_qty = strtoul(optarg, NULL, 10);
+                break;
+            case 'B':
+                config.history_bytes = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                config.log_dir = optarg;
+                break;
+            case 'G':
+                config.log_commit_ms = atoi(optarg);
+                break;
+            case 'R':
+                config.log_retain_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'A':
+                config.log_retain_s = strtoull(optarg, NULL, 10);
+                break;
+            case 'P':
+                port = atoi(optarg);
+                break;
+            case 'N':
+                config.fed_name = optarg;
+                break;
+            case 'S':
+                config.fed_port = atoi(optarg);
+                break;
+            case 'C':
+                if (config.fed_dial_qty == FED_LINKS_MAX) {
+                    fprintf(stderr, "at most %d server links\n", FED_LINKS_MAX);
+                    exit(1);
+                }
+                config.fed_dial = realloc(config.fed_dial, (config.fed_dial_qty+1) * sizeof(char*));
+                config.fed_dial[config.fed_dial_qty++] = optarg;
+                break;
+            case 'i':
+                config.ping_interval_s = atoi(optarg);
+                break;
+            case 'w':
+                config.ping_timeout_s = atoi(optarg);
+                break;
+            case 'W':
+                config.handshake_timeout_s = atoi(optarg);
+                break;
+            case 'F':
+            case 'Y': {
+                // rate[,burst], the burst defaults to two seconds' worth
+                char* end;
+                uint32_t rate = strtoul(optarg, &end, 10);
+                uint32_t burst = *end == ',' ? strtoul(end+1, NULL, 10) : rate*2;
+                if (opt == 'F') {
+                    config.flood.msgs_per_s = rate;
+                    config.flood.msg_burst = burst;
+                } else {
+                    config.flood.bytes_per_s = rate;
+                    config.flood.byte_burst = burst;
+                }
+                break;
             }
+            case 'D':
+                if (!strcmp(optarg, "delay")) config.flood_policy = flood_delay;
+                else if (!strcmp(optarg, "drop")) config.flood_policy = flood_drop;
+                else {
+                    fprintf(stderr, "unknown flood policy %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'e':
+                if (!strcmp(optarg, "epoll")) config.engine = engine_epoll;
+                else if (!strcmp(optarg, "uring")) config.engine = engine_uring;
+                else {
+                    fprintf(stderr, "unknown reactor engine %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                for (log_level = log_level_debug; log_level <= log_level_error; log_level++) {
+                    if (!strcasecmp(optarg, log_level_names[log_level])) break;
+                }
+                if (log_level > log_level_error) {
+                    fprintf(stderr, "unknown log level %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r reactor_threads] [-a acceptor_threads] [-b backlog] [-q out_queue_bytes] [-p oldest|newest|disconnect] [-t text_port] [-l debug|info|warn|error] [-m metrics_socket] [-e epoll|uring] [-f fanout_threads] [-H history_messages] [-B history_bytes] [-L log_dir] [-G commit_ms] [-R log_retain_bytes] [-A log_retain_seconds] [-P port] [-N server_name] [-S link_port] [-C host:link_port]... [-i ping_interval_seconds] [-w ping_timeout_seconds] [-W handshake_timeout_seconds] [-F msgs_per_s[,burst]] [-Y bytes_per_s[,burst]] [-D delay|drop]\n", argv[0]);
+                exit(1);
         }
     }
 
+    if (!config.metrics_path) {
+        snprintf(metrics_path, sizeof(metrics_path), SERVER_METRICS_PATH, port);
+        config.metrics_path = metrics_path;
+    }
+
+    log_start(log_level);
+    server_t server = server_new(AF_INET, "0.0.0.0", port, &config);
+    server_start(&server);
+    log_info("Server up and running!");
+
+    for (int i = 0; i < server.acceptor_qty; i++) pthread_join(server.acceptors[i].thread, NULL);
     return 0;
 }
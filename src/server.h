@@ -1,509 +1,3466 @@
 #ifndef IRC_SERVER_H_
 #define IRC_SERVER_H_
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                         // accept4
+#endif
+
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+
 #include "irc.h"
+#include "irc_text.h"
+#include "log.h"
+#include "metrics.h"
+#include "table.h"
+#include "name_map.h"
+#include "epoch.h"
+#include "channel_dir.h"
+#include "out_queue.h"
+#include "history.h"
+#include "msglog.h"
+#include "uring.h"
+#include "fanout.h"
+#include "federation.h"
+#include "timer_wheel.h"
+#include "flood.h"
 
 typedef struct _channel channel_t;
 typedef struct _user user_t;
+typedef struct _reactor reactor_t;
+typedef struct _server server_t;
+
+// What an io_uring completion is about: its user_data points at one of these tagged ops
+typedef enum _uring_op_kind {
+    uring_op_recv,
+    uring_op_send,
+    uring_op_wake,
+} uring_op_kind_e;
+
+// Multishot recv of one connection; lives until its last completion (the one without F_MORE)
+typedef struct _uring_recv {
+    uring_op_kind_e kind;
+    handle_t handle;
+    reactor_t* reactor;                     // ring it was submitted to, the one reading the user
+    bool fixed;                             // submitted through reactor's registered file table
+    bool cancelling;
+    bool once;                              // a buffer at a time, while a throttled user's backlog lasts
+} uring_recv_t;
+
+// Vectored send of a user's queue head; reused, the kernel owns it while inflight
+typedef struct _uring_send {
+    uring_op_kind_e kind;
+    handle_t handle;
+    bool inflight;
+    int close_sock;                         // user left meanwhile: close this once completed
+    struct msghdr msg;
+    struct iovec iov[OUT_QUEUE_IOV];
+    shared_buf_t* bufs[OUT_QUEUE_IOV];      // references held for the kernel
+    int buf_qty;
+} uring_send_t;
+
+typedef struct _uring_wake {
+    uring_op_kind_e kind;
+    int fd;                                 // eventfd other threads poke after posting mail
+    uint64_t value;
+} uring_wake_t;
+
+typedef enum _reactor_mail_kind {
+    reactor_mail_attach,                    // start reading the user on this reactor
+    reactor_mail_cancel,                    // stop reading it here, it moved away
+    reactor_mail_flush,                     // send what its queue holds
+} reactor_mail_kind_e;
+
+typedef struct _reactor_mail {
+    uint64_t handle;
+    reactor_mail_kind_e kind;
+} reactor_mail_t;
 
 struct _channel {
     char name[CHANNEL_NAME_LEN];
+    pthread_mutex_t lock;                   // guards members, admin and closing
     user_t* admin;
     char password[CHANNEL_PASS_LEN];
-    pthread_t thread;
-    int in_epoll;
-    int out_epoll;
-    int user_qty;
+    reactor_t* reactor;                     // reactor thread this channel is sharded onto
+    user_t** members;                       // fan-out list, grows on demand
+    int member_cap;
+    int user_qty;                           // written under lock, read lock-free by the metrics
+    bool closing;                           // set once emptied, the directory no longer lists it
+    channel_metrics_t metrics;              // written under lock
+    history_t history;                      // last messages, replayed to whoever joins; appended under lock
+    msglog_t* log;                          // durable log, NULL if off; appended under lock
+    uint32_t links;                         // bit per federation link with members of it beyond, see fed_channel_update
 };
 
+// One of a user's channels
+typedef struct _membership {
+    channel_t* channel;
+    uint32_t slot;                          // index in channel->members, under channel->lock
+} membership_t;
+
 struct _user {
     char name[IRC_NAME_LEN];
+    handle_t handle;                        // slot in server->users, stale once the user leaves
     irc_sock_t connection;
-    channel_t* channel;
+    irc_proto_e proto;                      // framing negotiated in the handshake
+    channel_t* channel;                     // current channel, where plain messages go (NULL if none)
+    membership_t* channels;                 // every channel joined, only the user's reactor adds or removes
+    int channel_qty;
+    int channel_cap;
+    pthread_mutex_t channels_lock;          // held to change channels, and by threads fixing a slot up
+    channel_t* lobby;                       // #main while the user sits there waiting for a first /join
+    reactor_t* reactor;                     // reactor whose epoll set holds this connection
+    out_queue_t out;                        // frames the socket has not taken yet
+    irc_reader_t* in;                       // partial frames the socket has delivered so far, NULL while none
     bool can_speak;
+    bool registered;                        // atomic, text users only count once NICK and USER arrived
+    bool sent_user;                         // text handshake: USER seen
+    uring_recv_t* recv_op;                  // io_uring: the recv reading this connection (under out.lock)
+    uring_send_t* send_op;                  // io_uring: reused for every send (under out.lock)
+    uint64_t active_ms;                     // atomic, when the connection last delivered anything
+    uint64_t pinged_ms;                     // keepalive probe unanswered since, 0 if none (see reactor_keepalive)
+    flood_t flood;                          // only whoever reads the connection (or holds its reads paused)
+    bool throttled;                         // flood_delay: reads paused until the debt is repaid (under out.lock)
+    bool closed;                            // socket closed, or left to a send to close (under out.lock)
 };
 
-typedef struct _server {
-    irc_sock_t listening;                   // socket that will accept new connections
-    user_t clients[SERVER_CLIENT_QTY];      // users map
-    int client_qty;
-    channel_t channels[CHANNEL_QTY];        // channels map
+#define USER_CHANNELS_MIN_CAP 4
+#define REACTOR_DIRTY_MIN_CAP 64
+#define REACTOR_FLUSH_FRAMES 256
+#define REACTOR_URING_ENTRIES 1024          // submission ring, a bigger batch is submitted early
+#define REACTOR_URING_CQ_ENTRIES 16384
+#define REACTOR_URING_BUFS 1024             // provided receive buffers per reactor, power of two
+#define REACTOR_URING_BUF_LEN MSG_LEN       // a leftover partial frame plus one always fit irc_reader_t
+#define REACTOR_URING_FILES 4096            // registered file slots, indexed by user handle
+
+// A reactor multiplexes the sockets of every channel sharded onto it in a single epoll set (or
+// io_uring ring)
+struct _reactor {
+    pthread_t thread;
+    int epoll;
+    int id;
+    server_t* server;
+    uint64_t* dirty;                        // handles of users with frames waiting for this reactor's flush
+    int dirty_qty;
+    int dirty_cap;
+    int frames_since_flush;
+    reactor_metrics_t metrics;              // written by this reactor's thread only
+    uint64_t recv_ns;                       // when the frames being handled were read
+    uint64_t relay_ns[REACTOR_FLUSH_FRAMES];    // read times of relays waiting for the next flush
+    int relay_qty;
+    uring_t* uring;                         // NULL on the epoll engine
+    uring_buf_ring_t bufs;                  // provided receive buffers
+    uring_recv_t** files;                   // registered file slot (user handle index) -> recv using it
+    uring_wake_t wake;
+    pthread_mutex_t mail_lock;              // other threads hand users over through the mailbox
+    reactor_mail_t* mail;
+    int mail_qty;
+    int mail_cap;
+    bool mail_signalled;                    // wake.fd already poked for the pending mail
+    timer_wheel_t timers;                   // keepalive of the users that registered here, keyed by handle
+    timer_wheel_t throttles;                // users whose reads it paused, keyed by handle
+};
+
+// Set on reactor threads, frames they queue are coalesced until the end of the iteration
+static __thread reactor_t* current_reactor = NULL;
+// Counters of the calling reactor thread
+static __thread reactor_metrics_t* current_metrics = NULL;
+
+// Users are never moved once registered, so user_t* stays valid until unregistered
+typedef struct _user_registry {
+    table_t table;
+    name_map_t by_name;                     // nickname -> user_t*
+    name_map_t remote;                      // nickname -> fed_user_t*, users of other servers
+    pthread_rwlock_t lock;
+} user_registry_t;
+
+typedef enum _reactor_engine {
+    engine_epoll,
+    engine_uring,                           // falls back to epoll when the kernel lacks support
+} reactor_engine_e;
+
+static const char* reactor_engine_names[] = { "epoll", "uring" };
+
+typedef struct _server_config {
+    int reactor_qty;                        // 0 = one reactor per online core
+    reactor_engine_e engine;
+    int acceptor_qty;                       // SO_REUSEPORT listeners, one thread each; 0 = one per reactor
+    int backlog;                            // listen() backlog of every listener
+    int fanout_worker_qty;                  // threads sharing big channels' fan-out; 0 = one per reactor
+    int fanout_min_members;                 // channels at least this big fan out in parallel
+    uint32_t history_qty;                   // messages each channel keeps for newcomers, 0 = none
+    size_t history_bytes;                   // and at most this many bytes of them
+    char* log_dir;                          // root of the durable channel logs, NULL = none
+    int log_commit_ms;                      // group commit interval
+    size_t log_retain_bytes;                // per channel, oldest segments go first
+    uint64_t log_retain_s;
+    size_t out_queue_max_bytes;             // per-user outbound high-water mark
+    slow_policy_e slow_policy;              // what to do with a user past the high-water mark
+    in_port_t text_port;                    // RFC 1459 text listener, 0 = disabled
+    char* metrics_path;                     // Unix socket serving the metrics dump, NULL or "" = disabled
+    char* fed_name;                         // this server's name in its network, NULL = host:port
+    in_port_t fed_port;                     // listener for other servers, 0 = none
+    char** fed_dial;                        // "host:port" of the servers to link to
+    int fed_dial_qty;
+    int ping_interval_s;                    // idle time before a keepalive probe, 0 = no keepalive
+    int ping_timeout_s;                     // silence after the probe before disconnecting
+    int handshake_timeout_s;                // to finish registering, 0 = forever
+    flood_limits_t flood;                   // per connection, both rates 0 = no flood control
+    flood_policy_e flood_policy;
+} server_config_t;
+
+#define SERVER_BACKLOG 4096                 // the kernel caps it at net.core.somaxconn
+#define SERVER_METRICS_PATH "/tmp/minirc-metrics-%d.sock"   // by client port, servers can share a host
+#define ACCEPTOR_BATCH 64                   // connections taken off one listener per wake-up
+#define ACCEPTOR_BACKOFF_US 10000           // out of descriptors: let some close first
+#define FANOUT_MIN_MEMBERS 4096
+#define FANOUT_SHARD_MEMBERS 1024           // members one fan-out task queues frames to
+#define PING_INTERVAL_S 120
+#define PING_TIMEOUT_S 60
+#define HANDSHAKE_TIMEOUT_S 30
+#define TIMER_TICK_MS 100                   // timeouts are seconds long, a coarse tick wakes up less
+#define FLOOD_MSGS_PER_S 100
+#define FLOOD_MSG_BURST 200
+#define FLOOD_BYTES_PER_S (512 << 10)
+#define FLOOD_BYTE_BURST (1 << 20)
+#define FLOOD_TICK_MS 10                    // pauses are a few ms long, resume on time
+
+// Acceptors only accept: each owns one SO_REUSEPORT listener per port, among which the kernel
+// spreads incoming connections, and hands every connection to a reactor right away. The
+// handshake (nickname, or NICK/USER) runs there, so a slow connector stalls nobody.
+typedef struct _acceptor {
+    pthread_t thread;
+    int id;
+    int epoll;
+    irc_sock_t listening;                   // binary protocols
+    irc_sock_t text_listening;              // text protocol (sock -1 if disabled)
+    int next_reactor;                       // round-robin home of new users until they join
+    timer_wheel_t timers;                   // handshake deadlines of the connections it accepted
+    server_t* server;
+} acceptor_t;
+
+// A server of the network, this one excluded
+typedef struct _fed_server {
+    uint32_t id;
+    char name[FED_NAME_LEN];                // empty until its fed_server frame comes
+    int link;                               // link it lies behind
+} fed_server_t;
+
+typedef struct _fed_channel fed_channel_t;
+
+// A user of another server
+typedef struct _fed_user {
+    char key[2*sizeof(uint32_t) + 2*sizeof(uint64_t) + 1];   // server and uid in hex, its key in fed.users
+    uint32_t server;
+    uint64_t uid;                           // the handle it has on its server
+    char name[IRC_NAME_LEN];
+    bool named;                             // listed in users.remote (it may have lost its nickname)
+    fed_channel_t** channels;
     int channel_qty;
-    pthread_mutex_t ch_mutex;               // channels map' mutex
-} server_t;
+    int channel_cap;
+} fed_user_t;
+
+// The members a channel has on other servers
+struct _fed_channel {
+    char name[CHANNEL_NAME_LEN];
+    fed_user_t** members;
+    int member_qty;
+    int member_cap;
+    int behind[FED_LINKS_MAX];              // members reachable through each link
+};
 
-void server_add_channel(server_t* server, char* name, user_t* user, char* password);
+// This server's view of the rest of the network: every other server, and every user and channel
+// membership they have, replicated from what the links say. A message for a channel goes out on
+// the links with members of it behind them, and nowhere else.
+typedef struct _federation {
+    uint32_t id;                            // hash of name, the origin of every frame this server sends
+    char name[FED_NAME_LEN];
+    bool enabled;                           // listening for, or dialling, other servers
+    fed_links_t links;
+    reactor_t* reactors;                    // each link's flush list and counters: a reactor without sockets
+    pthread_rwlock_t lock;                  // servers, users and channels; held to announce anything
+    fed_server_t servers[FED_SERVERS_MAX];
+    int server_qty;
+    name_map_t users;                       // key -> fed_user_t*
+    name_map_t channels;                    // name -> fed_channel_t*
+    uint64_t next_seq;                      // atomic, starts at the boot time so a restart never goes back
+} federation_t;
+
+// Every channel has its own lock, so joins, parts and quits in different channels never wait on
+// each other; directory lookups take no lock at all. Lock order, outermost first:
+//   channel->lock -> user->out.lock -> reactor->mail_lock
+//   channel->lock -> channels.write_lock -> epoch->lock
+//   channel->lock -> user->channels_lock
+//   channel->lock -> logs.lock -> log->lock
+//   channel->lock -> fed.lock -> link->out.lock
+//   fed.lock -> user->channels_lock
+//   fed.lock -> users.lock
+//   epoch->lock -> users.lock
+// A thread holds at most one channel lock: moving between channels joins the new one, then
+// leaves the old one. Nothing else is taken while holding users.lock: a user found under it is
+// only shut down after it is released (see server_kick_user).
+struct _server {
+    acceptor_t* acceptors;
+    int acceptor_qty;
+    user_registry_t users;                  // users map
+    epoch_t* epoch;                         // reclaims channels, directory nodes and user slots
+    channel_dir_t channels;                 // channels map, lock-free lookups
+    int channel_qty;                        // atomic, channels are created and destroyed concurrently
+    int user_qty;                           // atomic, connections (handshakes included)
+    reactor_t* reactors;                    // fixed pool, channels are sharded onto it by name
+    int reactor_qty;
+    server_config_t config;
+    pthread_t metrics_thread;
+    fanout_pool_t fanout;                   // shards relays to big channels, idle until server_start
+    reactor_t* fanout_reactors;             // each worker's flush list and counters: a reactor without sockets
+    int fanout_worker_qty;
+    msglog_store_t logs;                    // every open channel log and their writer thread
+    federation_t fed;                       // links to the other servers of the network
+};
 
-void channel_remove_user(channel_t* channel, user_t* user) {
-    if(!user || !channel) return;
+bool server_add_channel(server_t* server, char* name, user_t* user, char* password);
+void server_destroy_channel(server_t* server, channel_t* channel);
+
+// Queues work for reactor's thread and wakes it up; safe from any thread
+static void reactor_uring_post(reactor_t* reactor, reactor_mail_kind_e kind, user_t* user) {
+    pthread_mutex_lock(&reactor->mail_lock);
+    if (reactor->mail_qty == reactor->mail_cap) {
+        int new_cap = reactor->mail_cap ? reactor->mail_cap*2 : REACTOR_DIRTY_MIN_CAP;
+        reactor_mail_t* mail = realloc(reactor->mail, new_cap * sizeof(reactor_mail_t));
+        if (!mail) {
+            log_perror("reactor_uring_post::realloc");
+            pthread_mutex_unlock(&reactor->mail_lock);
+            return;
+        }
+        reactor->mail = mail;
+        reactor->mail_cap = new_cap;
+    }
+    reactor->mail[reactor->mail_qty++] = (reactor_mail_t) { .handle = handle_pack(user->handle), .kind = kind };
 
-    epoll_ctl(channel->in_epoll, EPOLL_CTL_DEL, user->connection.sock, NULL);
-    epoll_ctl(channel->out_epoll, EPOLL_CTL_DEL, user->connection.sock, NULL);
-    channel->user_qty--;
+    bool wake = !reactor->mail_signalled;
+    reactor->mail_signalled = true;
+    pthread_mutex_unlock(&reactor->mail_lock);
 
-    printf("%s left %s (now has %d members)\n", user->name, channel->name, channel->user_qty);
+    uint64_t one = 1;
+    if (wake && write(reactor->wake.fd, &one, sizeof(one)) == -1) log_perror("reactor_uring_post::write");
 }
 
-bool channel_add_user(channel_t* channel, user_t* user, char* password) {
-    if(!user || !channel) return false;
-    // printf("chanel_add_user::channel->password: %s\n", channel->password);
-    if(channel->password && channel->password[0] != '\0') {
-        if (!password) {
-            printf("%s tried to join %s but submitted no password\n", user->name);
-            return false;
-        } else if (strcmp(password, channel->password)) {
-            printf("%s tried to join %s but submitted wrong password\n", user->name, channel->name);
-            return false;
-        }
+// Gives op's registered file slot back. Only on op->reactor's thread.
+static void reactor_uring_release_file(uring_recv_t* op) {
+    if (!op->fixed) return;
+
+    reactor_t* reactor = op->reactor;
+    if (reactor->files[op->handle.index] == op) {
+        uring_update_file(reactor->uring, op->handle.index, -1);
+        reactor->files[op->handle.index] = NULL;
     }
+    op->fixed = false;
+}
 
-    user->channel = channel;
-    struct epoll_event in_event = {
-        .events = EPOLLIN | EPOLLRDHUP,
-        .data.ptr = user
-    };
-    epoll_ctl(channel->in_epoll, EPOLL_CTL_ADD, user->connection.sock, &in_event);
+// Only on op->reactor's thread; the recv's last completion arrives later
+static void reactor_uring_cancel_recv(uring_recv_t* op) {
+    if (op->cancelling) return;
 
-    struct epoll_event out_event = {
-        .events = EPOLLOUT,
-        .data.ptr = user
-    };
-    epoll_ctl(channel->out_epoll, EPOLL_CTL_ADD, user->connection.sock, &out_event);
+    struct io_uring_sqe* sqe = uring_get_sqe(op->reactor->uring);
+    if (!sqe) {
+        log_error("reactor_uring_cancel_recv::submission ring full");
+        return;
+    }
+    uring_prep_cancel(sqe, (uintptr_t) op, 0);
+    op->cancelling = true;
+}
 
-    channel->user_qty++;
-    printf("%s joined %s (now has %d members)\n", user->name, user->channel->name, user->channel->user_qty);
-    return true;
+// Needs user->out.lock, which also guards user->reactor
+static int reactor_ctl_user(reactor_t* reactor, int op, user_t* user) {
+    struct epoll_event event = {
+        // A throttled connection's hangup waits too, what it sent before is still read
+        .events = (user->throttled ? 0 : EPOLLIN | EPOLLRDHUP) | (user->out.want_out ? EPOLLOUT : 0),
+        .data.u64 = handle_pack(user->handle)
+    };
+    return epoll_ctl(reactor->epoll, op, user->connection.sock, &event);
 }
 
-server_t server_new(int addr_family, char* addr, in_port_t port) {
-    irc_sock_t listening = irc_sock_new(addr_family, addr, port);
-    // Assign name+address to socket
-    if (bind(listening.sock, (const struct sockaddr*) &listening.addr, listening.addr_len) == -1) {
-        perror("server_new::bind");
-        exit(1);
+// Moves the user's connection into the reactor's epoll set (leaving the previous one, if any).
+// On a reactor thread, only for a user that reactor reads.
+void reactor_attach_user(reactor_t* reactor, user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    if (user->reactor == reactor) {
+        pthread_mutex_unlock(&user->out.lock);
+        return;
     }
 
-    // Put it on listening mode
-    if (listen(listening.sock, SERVER_CLIENT_QTY) == -1) {
-        perror("server_new::listen");
-        exit(1);
+    // io_uring: whoever reads the connection now stops first, its last completion hands the
+    // connection over (see reactor_uring_received), so frames are never read out of order
+    if (reactor->uring) {
+        user->reactor = reactor;
+        uring_recv_t* op = user->recv_op;
+        if (!op) reactor_uring_post(reactor, reactor_mail_attach, user);
+        else if (op->reactor == current_reactor) reactor_uring_cancel_recv(op);
+        else reactor_uring_post(op->reactor, reactor_mail_cancel, user);
+        pthread_mutex_unlock(&user->out.lock);
+        return;
     }
 
-    server_t server = {
-        .listening = listening,
-        .clients = {0},
-        .client_qty = 0,
-        .channels = {0},
-    };
+    // epoll: the reading reactor may still hold frames it read together with the join, so the
+    // connection only changes sets once it handled them (see reactor_settle_user)
+    if (current_reactor) {
+        user->reactor = reactor;
+        pthread_mutex_unlock(&user->out.lock);
+        return;
+    }
 
-    // Initialize all clients to NULL
-    for (int i = 0; i < SERVER_CLIENT_QTY; i++) {
-        server.clients[i].connection.sock = -1;
-        server.clients[i].can_speak = true;
+    if (user->reactor) {
+        epoll_ctl(user->reactor->epoll, EPOLL_CTL_DEL, user->connection.sock, NULL);
     }
 
-    return server;
+    if (reactor_ctl_user(reactor, EPOLL_CTL_ADD, user) == -1) {
+        log_perror("reactor_attach_user::epoll_ctl");
+    }
+    user->reactor = reactor;
+    pthread_mutex_unlock(&user->out.lock);
 }
 
-void server_move_user(server_t* server, user_t* user, char* ch_name, char* password) {
-    channel_t* channel = NULL;
-    for (int i = 0; i < CHANNEL_QTY; i++) {
-        printf("\t[%d] channel name: %s\n", i, server->channels[i].name);
-        if (!strcmp(server->channels[i].name, ch_name)) {
-            channel = &server->channels[i];
-            break;
+// Hands the connection over to the reactor a join picked while reactor (its epoll set holds
+// the connection) was handling the user's frames. Only on reactor's thread; returns false if
+// the user is now read elsewhere, and no longer reactor's to touch.
+static bool reactor_settle_user(reactor_t* reactor, user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    bool moved = user->reactor && user->reactor != reactor;
+    if (moved) {
+        epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, user->connection.sock, NULL);
+        if (reactor_ctl_user(user->reactor, EPOLL_CTL_ADD, user) == -1) {
+            log_perror("reactor_settle_user::epoll_ctl");
         }
     }
+    pthread_mutex_unlock(&user->out.lock);
+    return !moved;
+}
 
-    if(!channel) {
-        printf("server_move_user: channel %s not found\n", ch_name);
-        return;
+// Only the reactor reading the connection may call this (it is about to close it)
+void reactor_detach_user(user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    uring_recv_t* op = user->recv_op;
+    if (op) {
+        reactor_uring_release_file(op);
+        reactor_uring_cancel_recv(op);
+        user->recv_op = NULL;
+    } else if (user->reactor && !user->reactor->uring) {
+        // A pending handoff leaves the connection in the set of the reactor closing it
+        reactor_t* polling = current_reactor ? current_reactor : user->reactor;
+        epoll_ctl(polling->epoll, EPOLL_CTL_DEL, user->connection.sock, NULL);
     }
+    user->reactor = NULL;
+    pthread_mutex_unlock(&user->out.lock);
+}
 
-    pthread_mutex_lock(&server->ch_mutex);
+// Toggles EPOLLOUT so the owning reactor drains the queue only while it holds something.
+// io_uring has no readiness to arm: the reactor is asked to send the rest instead.
+static void user_arm_out(user_t* user, bool want_out) {
+    pthread_mutex_lock(&user->out.lock);
+    if (user->reactor && user->reactor->uring) {
+        if (want_out && !user->out.want_out) {
+            user->out.want_out = true;
+            reactor_uring_post(user->reactor, reactor_mail_flush, user);
+        }
+    } else if (user->out.want_out != want_out && user->reactor) {
+        user->out.want_out = want_out;
+        reactor_ctl_user(user->reactor, EPOLL_CTL_MOD, user);
+    }
+    pthread_mutex_unlock(&user->out.lock);
+}
 
-    // Remove user from channel
-    channel_t* old_channel = user->channel;
-    if(channel_add_user(channel, user, password)) {
-        channel_remove_user(old_channel, user);
+void server_flush_user(server_t* server, user_t* user);
+user_t* server_get_user(server_t* server, handle_t handle);
+
+// Remembers a user whose queue must be flushed before this reactor waits again
+static void reactor_mark_dirty(reactor_t* reactor, user_t* user) {
+    if (reactor->dirty_qty == reactor->dirty_cap) {
+        int new_cap = reactor->dirty_cap ? reactor->dirty_cap*2 : REACTOR_DIRTY_MIN_CAP;
+        uint64_t* dirty = realloc(reactor->dirty, new_cap * sizeof(uint64_t));
+        if (!dirty) {
+            log_perror("reactor_mark_dirty::realloc");
+            server_flush_user(reactor->server, user);
+            return;
+        }
+        reactor->dirty = dirty;
+        reactor->dirty_cap = new_cap;
     }
+    reactor->dirty[reactor->dirty_qty++] = handle_pack(user->handle);
+}
 
-    pthread_mutex_unlock(&server->ch_mutex);
+// Shuts the connection down for the reactor reading it to see the hangup and close it; safe from
+// any thread. Once closed the descriptor number may already belong to a new connection, so the
+// check and the shutdown happen under out.lock, which user_close_socket holds to close.
+static void user_shutdown(user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    if (!user->closed) shutdown(user->connection.sock, SHUT_RDWR);
+    pthread_mutex_unlock(&user->out.lock);
 }
 
-bool is_admin(user_t* user) {
-    printf("%s tried an admin only cmd\n", user->name);
-    if (user->channel == NULL) return false;
-    if(user != user->channel->admin) return false;
-    printf("verification sucessfull\n");
+// Counts qty frames (bytes in all) just pushed to user, and acts on out_queue's verdict
+static void server_sent(server_t* server, user_t* user, out_result_e result, int qty, size_t bytes) {
+    reactor_metrics_t* metrics = current_metrics;
+    if (metrics && (result == out_pending || result == out_queued)) {
+        metric_add(metrics->msgs_out, qty);
+        metric_add(metrics->bytes_out, bytes);
+    }
 
-    return true;
+    switch (result) {
+        case out_pending:
+            if (current_reactor) reactor_mark_dirty(current_reactor, user);
+            else server_flush_user(server, user);
+            break;
+        case out_dropped:
+            if (metrics) metric_add(metrics->drops, 1);
+            break;
+        case out_overflow:
+            if (metrics) metric_add(metrics->slow_disconnects, 1);
+            // The owning reactor sees the hangup and closes the connection
+            log_warn("%s is too slow (queue past %zu bytes), disconnecting", user->name, server->config.out_queue_max_bytes);
+            user_shutdown(user);
+            break;
+        case out_error:
+            user_shutdown(user);
+            break;
+        default:
+            break;
+    }
 }
 
-bool server_close_connection(server_t* server, channel_t* channel, user_t* user) {
-    for (int i = 0; i < SERVER_CLIENT_QTY; i++) {
-        if (&server->clients[i] != user) continue;
-        printf("%s has left the server\n", user->name);
+// Never blocks: the frame is queued and later written together with whatever else the user
+// gets in the same reactor iteration, or handled by the slow-consumer policy. A queued frame
+// keeps its own reference, the caller keeps the one it passed in.
+out_result_e server_send_frame(server_t* server, user_t* user, shared_buf_t* frame) {
+    out_result_e result = out_queue_push(&user->out, frame,
+        server->config.out_queue_max_bytes, server->config.slow_policy);
+    server_sent(server, user, result, 1, frame->len);
+    return result;
+}
 
-        pthread_mutex_lock(&server->ch_mutex);
+// Several frames in one go, e.g. a history replay
+out_result_e server_send_frames(server_t* server, user_t* user, shared_buf_t** frames, int qty) {
+    if (!qty) return out_queued;
 
-        // Remove user from channel
-        channel_remove_user(user->channel, user);
+    out_result_e result = out_queue_push_batch(&user->out, frames, qty,
+        server->config.out_queue_max_bytes, server->config.slow_policy);
+    size_t bytes = 0;
+    for (int i = 0; i < qty; i++) bytes += frames[i]->len;
+    server_sent(server, user, result, qty, bytes);
+    return result;
+}
 
-        close(user->connection.sock);
+// v2 sender ID of a user; IRC_V2_SERVER_ID (0) is never handed out
+static inline uint32_t user_sender_id(user_t* user) {
+    return user->handle.index + 1;
+}
 
-        // Swap removed user with last user added, then blank the last user slot
-        user_t* swap_user = &server->clients[i];
-        *swap_user = server->clients[server->client_qty-1];
+// Encodes pkt once into a shareable frame in the given framing; NULL on allocation failure.
+// v1 frames carry pkt->user, v2 frames the sender ID instead, text lines are a PRIVMSG from
+// pkt->user to target (or a server NOTICE).
+shared_buf_t* server_encode_pkt(irc_proto_e proto, uint32_t sender, irc_packet_t* pkt, const char* target) {
+    if (proto == irc_proto_text) {
+        char line[IRC_TEXT_LINE_MAX];
+        size_t len;
+        char source[3*IRC_NAME_LEN];
+        if (sender == IRC_V2_SERVER_ID) {
+            len = irc_text_encode(line, sizeof(line), IRC_TEXT_SERVER_NAME,
+                "NOTICE", target, pkt->data, pkt->length);
+        } else {
+            snprintf(source, sizeof(source), "%s!%s@%s", pkt->user, pkt->user, IRC_TEXT_SERVER_NAME);
+            len = irc_text_encode(line, sizeof(line), source,
+                "PRIVMSG", target, pkt->data, pkt->length);
+        }
+        return shared_buf_copy(line, len);
+    }
 
-        memset(&server->clients[server->client_qty-1], 0, sizeof(user_t));
+    if (proto == irc_proto_v2) {
+        shared_buf_t* frame = shared_buf_new(IRC_V2_HEADER_MAX + pkt->length);
+        if (frame) frame->len = irc_v2_encode(irc_v2_msg, sender, pkt->data, pkt->length, frame->data);
+        return frame;
+    }
 
-        // Update the socket to return the correct user pointer
-        struct epoll_event in_event = {
-            .events = EPOLLIN | EPOLLRDHUP,
-            .data.ptr = swap_user
-        };
-        epoll_ctl(channel->in_epoll, EPOLL_CTL_MOD, swap_user->connection.sock, &in_event);
+    shared_buf_t* frame = shared_buf_new(IRC_HEADER_LEN + pkt->length);
+    if (frame) irc_encode(pkt, frame->data);
+    return frame;
+}
 
-        struct epoll_event out_event = {
-            .events = EPOLLOUT,
-            .data.ptr = swap_user
-        };
-        epoll_ctl(channel->out_epoll, EPOLL_CTL_MOD, swap_user->connection.sock, &out_event);
+// v2 frames of the channel history: the message from IRC_V2_REPLAY_ID, right after naming it
+// pkt->user, since by replay time pkt->user's own ID may belong to someone else
+shared_buf_t* server_encode_replay_v2(irc_packet_t* pkt) {
+    size_t name_len = strnlen(pkt->user, IRC_NAME_LEN);
+    shared_buf_t* frame = shared_buf_new(2*IRC_V2_HEADER_MAX + name_len + pkt->length);
+    if (!frame) return NULL;
 
-        pthread_mutex_unlock(&server->ch_mutex);
+    frame->len = irc_v2_encode(irc_v2_name, IRC_V2_REPLAY_ID, pkt->user, name_len, frame->data);
+    frame->len += irc_v2_encode(irc_v2_msg, IRC_V2_REPLAY_ID, pkt->data, pkt->length, frame->data + frame->len);
+    return frame;
+}
 
-        server->client_qty--;
-        return true;
-    }
+// Server replies: "server" in v1, sender 0 in v2
+out_result_e server_send_pkt(server_t* server, user_t* user, irc_packet_t* pkt) {
+    shared_buf_t* frame = server_encode_pkt(user->proto, IRC_V2_SERVER_ID, pkt, user->name[0] ? user->name : "*");
+    if (!frame) return out_dropped;
 
-    return false;
+    out_result_e result = server_send_frame(server, user, frame);
+    shared_buf_unref(frame);
+    return result;
 }
 
-void server_destroy_channel(server_t* server, channel_t* channel) {
-    // Swap removed user with last user added, then blank the last user slot
-    printf("channel qty = %d\n", server->channel_qty);
-    printf("deleting channel %s with %d users\n", channel->name, channel->user_qty);
+// Queues one raw line to a text user (numerics, JOIN/PART echoes, PONG)
+out_result_e text_send_line(server_t* server, user_t* user, const char* fmt, ...) {
+    char line[IRC_TEXT_LINE_MAX];
+    va_list args;
+    va_start(args, fmt);
+    size_t len = irc_text_vformat(line, sizeof(line), fmt, args);
+    va_end(args);
 
-    memset(channel, 0, sizeof(channel_t));
+    shared_buf_t* frame = shared_buf_copy(line, len);
+    if (!frame) return out_dropped;
 
-    server->channel_qty--;
+    out_result_e result = server_send_frame(server, user, frame);
+    shared_buf_unref(frame);
+    return result;
 }
 
-void ping_client(user_t* user) {
-    irc_packet_t pkt = {
-        .user = "server",
-        .length = sizeof("pong\n"),
-        .data = "pong\n"
-    };
-
-    ssize_t sent_bytes = irc_send(&user->connection, &pkt, 0);
-    printf("[send %d bytes] pinging user (%s)\n", sent_bytes, user->name);
+// Tells the channel's text members that user joined (or left), as a real server would.
+// Caller must hold channel->lock.
+void channel_text_echo(channel_t* channel, user_t* user, const char* command) {
+    server_t* server = channel->reactor->server;
+    for (int i = 0; i < channel->user_qty; i++) {
+        user_t* member = channel->members[i];
+        if (member->proto != irc_proto_text) continue;
+        text_send_line(server, member, ":%s!%s@%s %s %s",
+            user->name, user->name, IRC_TEXT_SERVER_NAME, command, channel->name);
+    }
 }
 
-channel_t* server_search_channel_by_name(server_t* server, char* name) {
-    pthread_mutex_lock(&server->ch_mutex);
-
-    for (int i = 0; i < CHANNEL_QTY; i++) {
-        if (!server->channels[i].name) continue;
-
-        if (!strcmp(server->channels[i].name, name)) {
-            printf("found channel %s\n", &server->channels[i]);
-            pthread_mutex_unlock(&server->ch_mutex);
-            return &server->channels[i];
-        }
+// Writes everything queued for the user in one vectored send; leftovers wait for EPOLLOUT
+void server_flush_user(server_t* server, user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    bool ok = out_queue_flush(&user->out, user->connection.sock);
+    bool empty = out_queue_empty(&user->out);
+    size_t left = user->out.bytes;
+    pthread_mutex_unlock(&user->out.lock);
+
+    reactor_metrics_t* metrics = current_metrics;
+    if (metrics && left > metric_get(metrics->queue_bytes_hwm)) {
+        __atomic_store_n(&metrics->queue_bytes_hwm, left, __ATOMIC_RELAXED);
     }
 
-    pthread_mutex_unlock(&server->ch_mutex);
-    return NULL;
+    if (!ok) {
+        user_shutdown(user);
+        return;
+    }
+    user_arm_out(user, !empty);
 }
 
-user_t* server_search_client_by_name(server_t* server, char* name) {
-    for (int i = 0; i < server->client_qty; i++) {
-        if (!strcmp(server->clients[i].name, name)) {
-            return &server->clients[i];
+// io_uring counterpart of server_flush_user: queues one vectored send of the user's queue head
+// on reactor's ring. It is submitted with everything else the reactor queued in this iteration,
+// and the kernel waits for room in the socket itself. Any reactor may send to any user, but only
+// one send per user is ever in flight: its completion writes whatever is left.
+void reactor_uring_send_user(reactor_t* reactor, user_t* user) {
+    out_queue_t* queue = &user->out;
+    pthread_mutex_lock(&queue->lock);
+    queue->dirty = false;
+    if (queue->pinned) {
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+    if (queue->dead || out_queue_empty(queue)) {
+        queue->want_out = false;
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+
+    uring_send_t* op = user->send_op;
+    if (!op) {
+        op = calloc(1, sizeof(uring_send_t));
+        if (!op) {
+            log_perror("reactor_uring_send_user::calloc");
+            pthread_mutex_unlock(&queue->lock);
+            return;
         }
+        op->kind = uring_op_send;
+        op->handle = user->handle;
+        op->close_sock = -1;
+        user->send_op = op;
     }
 
-    return NULL;
-}
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->uring);
+    if (!sqe) {
+        pthread_mutex_unlock(&queue->lock);
+        server_flush_user(reactor->server, user);
+        return;
+    }
 
-// Channel só é usado aqui
-void server_relay_msg(user_t* user, irc_packet_t* pkt) {
-    channel_t* channel = user->channel;
+    op->buf_qty = out_queue_fill_iov(queue, op->iov, OUT_QUEUE_IOV);
+    for (int i = 0; i < op->buf_qty; i++) op->bufs[i] = shared_buf_ref(out_queue_at(queue, i)->buf);
+    op->msg = (struct msghdr) { .msg_iov = op->iov, .msg_iovlen = op->buf_qty };
+    op->inflight = true;
+    queue->pinned = op->buf_qty;
+    queue->want_out = true;
+
+    // Plain descriptor: the registered table belongs to whichever reactor reads the user
+    uring_prep_sendmsg(sqe, user->connection.sock, false, &op->msg, MSG_NOSIGNAL, (uintptr_t) op);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    struct epoll_event events[channel->user_qty];
-    printf("\tserver_relay_msg::channel->user_qty = %d\n", channel->user_qty);
-    int ready_qty = epoll_wait(user->channel->out_epoll, events, channel->user_qty, -1);
-    if (ready_qty == -1) {
-        perror("server_relay_msg::epoll_wait");
+static void reactor_uring_sent(reactor_t* reactor, uring_send_t* op, int res) {
+    for (int i = 0; i < op->buf_qty; i++) shared_buf_unref(op->bufs[i]);
+    op->buf_qty = 0;
+
+    user_t* user = server_get_user(reactor->server, op->handle);
+    if (user) pthread_mutex_lock(&user->out.lock);
+    op->inflight = false;
+    if (!user || user->send_op != op) {
+        // The user left while the kernel still had the socket
+        if (user) pthread_mutex_unlock(&user->out.lock);
+        if (op->close_sock != -1) close(op->close_sock);
+        free(op);
         return;
     }
 
-    printf("\tserver_relay_msg::ready_qty = %d\n", ready_qty);
-    for (int n = 0; n < channel->user_qty; n++) {
-        user_t* user_to = events[n].data.ptr;
-        printf("\tserver_relay_msg::user_to = %s\n", user_to->name);
-        if (user == user_to) continue;
+    out_queue_t* queue = &user->out;
+    queue->pinned = 0;
+    if (res > 0 && !queue->dead) out_queue_consume(queue, res);
 
-        printf("\tUser %s is ready to recv (on %s)!\n", user_to->name, user_to->channel->name);
+    bool failed = res < 0 && res != -EAGAIN && res != -EINTR;
+    bool more = !failed && !queue->dead && !out_queue_empty(queue);
+    if (!more) queue->want_out = false;
+    size_t left = queue->bytes;
+    pthread_mutex_unlock(&queue->lock);
 
-        ssize_t sent_bytes = irc_send(&user_to->connection, pkt, 0);
-        printf("\tsend %d bytes to user %s\n", sent_bytes, user_to->name);
+    reactor_metrics_t* metrics = current_metrics;
+    if (metrics && left > metric_get(metrics->queue_bytes_hwm)) {
+        __atomic_store_n(&metrics->queue_bytes_hwm, left, __ATOMIC_RELAXED);
     }
-}
 
-void handle_cmds(irc_cmds_e cmd_type, user_t* user, irc_packet_t* pkt, server_t* server) {
-    switch (cmd_type) {
-        case cmd_msg:
-            if (!user->can_speak || !user->channel ) break;
+    if (failed) user_shutdown(user);
+    else if (more) reactor_uring_send_user(reactor, user);
+}
 
-            server_relay_msg(user, pkt);
-            break;
+// Closes the user's socket, or leaves that to the completion of a send still using it: closing
+// first would let accept hand the descriptor number to someone else before the kernel sees it.
+// Either way user_shutdown leaves the descriptor alone from here on.
+static void user_close_socket(user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    uring_send_t* op = user->send_op;
+    user->send_op = NULL;
+    user->closed = true;
+    bool deferred = op && op->inflight;
+    if (deferred) op->close_sock = user->connection.sock;
+    else close(user->connection.sock);
+    pthread_mutex_unlock(&user->out.lock);
+
+    if (!deferred) free(op);
+}
 
-        case cmd_connect:
-            printf("server cannot connect\n");
-            break;
-        case cmd_join: {
-            // /join <channel_name> password
-            strtok(pkt->data, " \n");
-
-            char* ch_name = strtok(NULL, " \n");
-            size_t ch_name_len = strlen(ch_name);
-            printf("ch_name: %s\n", ch_name);
-
-            char* password = strtok(NULL, " \n");
-            if (password) {
-                size_t password_len = strlen(password);
-                password[password_len] = '\0';
-                printf("password: %s\n", password);
-            }
+// Flushes every user that got frames since the last flush. Runs at the end of each reactor
+// iteration (and every REACTOR_FLUSH_FRAMES handled frames), which bounds the added latency.
+void reactor_flush_dirty(reactor_t* reactor) {
+    for (int i = 0; i < reactor->dirty_qty; i++) {
+        user_t* user = server_get_user(reactor->server, handle_unpack(reactor->dirty[i]));
+        if (!user) continue;
+        if (reactor->uring) reactor_uring_send_user(reactor, user);
+        else server_flush_user(reactor->server, user);
+    }
+    reactor->dirty_qty = 0;
+    reactor->frames_since_flush = 0;
+
+    // Every relay since the last flush has now reached its last recipient's socket (or queue)
+    if (reactor->relay_qty) {
+        uint64_t now = metrics_now_ns();
+        for (int i = 0; i < reactor->relay_qty; i++) {
+            hist_record(&reactor->metrics.relay_latency, now - reactor->relay_ns[i]);
+        }
+        reactor->relay_qty = 0;
+    }
+}
 
-            printf("user %s is joining channel %s\n", user->name, ch_name);
+// Queues frame for every link of mask that is up, but except (-1 = none)
+static void fed_send(federation_t* fed, shared_buf_t* frame, uint32_t mask, int except) {
+    uint32_t up = __atomic_load_n(&fed->links.up, __ATOMIC_ACQUIRE) & mask;
+    if (except >= 0) up &= ~(1u << except);
+    for (int i = 0; up; i++, up >>= 1) {
+        if (up & 1) fed_link_send(&fed->links.links[i], frame);
+    }
+}
 
-            // Verificação se o canal existe
-            channel_t* channel = server_search_channel_by_name(server, ch_name);
-            if (channel) {
-                server_move_user(server, user, ch_name, password);
-            } else {
-                // Validate channel name
-                bool valid_name = ch_name[0] == '#';
-                valid_name &= strchr(ch_name, ',') == NULL;
-
-                if (!valid_name) {
-                    printf("Attempted to create channel with invalid name (%s)\n", ch_name);
-                    irc_packet_t out_pkt = {
-                        .user = "server",
-                        .data = "Attempted to create channel with invalid name\n",
-                        .length = sizeof("Attempted to create channel with invalid name\n")
-                    };
-                    ssize_t sent_bytes = irc_send(&user->connection, &out_pkt, 0);
-                    break;
-                }
+// Puts a new frame of this server's onto the links of mask. Caller holds fed->lock.
+static void fed_emit(federation_t* fed, fed_event_t* event, uint32_t mask) {
+    event->origin = fed->id;
+    event->seq = __atomic_add_fetch(&fed->next_seq, 1, __ATOMIC_RELAXED);
+    shared_buf_t* frame = fed_encode(event);
+    if (!frame) return;
 
-                channel_remove_user(user->channel, user);
-                server_add_channel(server, ch_name, user, password);
-            }
-            user->can_speak = true;
-            break;
-        }
-        case cmd_quit:
-            server_close_connection(server, user->channel, user);
-            break;
-        case cmd_ping:
-            ping_client(user);
-            break;
-        case cmd_kick:
-            if(!is_admin(user)) break;
+    fed_send(fed, frame, mask, -1);
+    shared_buf_unref(frame);
+}
 
-            char* kicked_name = strchr(pkt->data, ' ')+1;
-            size_t kicked_name_len = strlen(kicked_name)-1;
-            kicked_name[kicked_name_len] = '\0';
+// fed_announce by uid, for a user whose slot may already be someone else's (fed_quit)
+static void fed_announce_uid(server_t* server, fed_type_e type, uint64_t uid, const char* name, channel_t* channel) {
+    federation_t* fed = &server->fed;
+    if (!__atomic_load_n(&fed->links.up, __ATOMIC_ACQUIRE)) return;
 
-            user_t* kicked_user = server_search_client_by_name(server, kicked_name);
-            if(!kicked_user) break;
-            server_close_connection(server, kicked_user->channel, kicked_user);
-            break;
-        case cmd_mute:
-            if(!is_admin(user)) break;
+    fed_event_t event = { .type = type, .server = fed->id, .uid = uid };
+    if (name) {
+        event.name = name;
+        event.name_len = strlen(name);
+    }
+    if (channel) {
+        event.channel = channel->name;
+        event.channel_len = strlen(channel->name);
+    }
 
-            char* muted_name = strchr(pkt->data, ' ')+1;
-            size_t muted_name_len = strlen(muted_name)-1;
-            muted_name[muted_name_len] = '\0';
+    pthread_rwlock_rdlock(&fed->lock);
+    fed_emit(fed, &event, ~0u);
+    pthread_rwlock_unlock(&fed->lock);
+}
 
-            user_t* muted_user = server_search_client_by_name(server, muted_name);
-            if(!muted_user) break;
-            muted_user->can_speak = false;
-            break;
-        case cmd_unmute:
-            if(!is_admin(user)) break;
+// Tells the network what changed about one of this server's users: fed_nick or fed_quit, or
+// fed_join or fed_part of channel. Call it once the change is visible here: a link coming up
+// meanwhile gets it either in its burst or from this, and both are idempotent.
+void fed_announce(server_t* server, fed_type_e type, user_t* user, channel_t* channel) {
+    fed_announce_uid(server, type, handle_pack(user->handle), type == fed_nick ? user->name : NULL, channel);
+}
 
-            char* unmuted_name = strchr(pkt->data, ' ')+1;
-            size_t unmuted_name_len = strlen(unmuted_name)-1;
-            unmuted_name[unmuted_name_len] = '\0';
+// Index of channel in user->channels, -1 if the user is not in it. Only on the user's reactor,
+// or under user->channels_lock.
+static int user_channel_index(user_t* user, channel_t* channel) {
+    for (int i = 0; i < user->channel_qty; i++) {
+        if (user->channels[i].channel == channel) return i;
+    }
+    return -1;
+}
 
-            user_t* unmuted_user = server_search_client_by_name(server, unmuted_name);
-            if(!unmuted_user) break;
-            unmuted_user->can_speak = true;
-            break;
-        case cmd_whois:
-            if(!is_admin(user)) break;
+// Safe from any thread
+bool user_in_channel(user_t* user, channel_t* channel) {
+    pthread_mutex_lock(&user->channels_lock);
+    bool joined = user_channel_index(user, channel) != -1;
+    pthread_mutex_unlock(&user->channels_lock);
+    return joined;
+}
 
-            char* username = strchr(pkt->data, ' ')+1;
-            size_t username_len = strlen(username)-1;
-            username[username_len] = '\0';
+// The joined channel with that name, NULL if none. Only on the user's reactor.
+channel_t* user_find_channel(user_t* user, const char* name) {
+    for (int i = 0; i < user->channel_qty; i++) {
+        if (!strcmp(user->channels[i].channel->name, name)) return user->channels[i].channel;
+    }
+    return NULL;
+}
 
-            user_t* srch_user = server_search_client_by_name(server, username);
-            if(!srch_user || srch_user->channel != user->channel) break;
+// Caller must hold channel->lock; an emptied channel is destroyed right away, but stays valid
+// (and locked) until the caller's epoch section ends. O(1) besides the PART echo: both the
+// channel's and the user's arrays fill the hole with their last entry.
+void channel_remove_user(channel_t* channel, user_t* user) {
+    if(!user || !channel) return;
+    int index = user_channel_index(user, channel);
+    if (index == -1) return;
+
+    channel_text_echo(channel, user, "PART");
+
+    // The member moved into the hole has to learn its new slot
+    uint32_t slot = user->channels[index].slot;
+    user_t* moved = channel->members[channel->user_qty-1];
+    channel->members[slot] = moved;
+    if (moved != user) {
+        pthread_mutex_lock(&moved->channels_lock);
+        moved->channels[user_channel_index(moved, channel)].slot = slot;
+        pthread_mutex_unlock(&moved->channels_lock);
+    }
+    metric_add(channel->user_qty, -1);         // read lock-free by the metrics dump
 
-            char* ascii_address = inet_ntoa(srch_user->connection.addr.sin_addr);
+    pthread_mutex_lock(&user->channels_lock);
+    user->channels[index] = user->channels[--user->channel_qty];
+    pthread_mutex_unlock(&user->channels_lock);
 
-            strcpy(pkt->data, ascii_address);
-            strcat(pkt->data, "\n");
-            irc_send(&srch_user->channel->admin->connection, pkt, 0);
-            break;
-        case cmd_nickname:
-            strtok(pkt->data, " \n");
-
-            char* new_nick = strtok(NULL, " \n");
-            size_t new_nick_len = strlen(new_nick);
-            new_nick[new_nick_len] = '\0';
-            printf("new_nick: %s\n", new_nick);
-
-            user_t* existing_user = server_search_client_by_name(server, new_nick);
-            if(existing_user) {
-                printf("Attempted to change nick to existing name (%s)\n", new_nick);
-                irc_packet_t out_pkt = {
-                    .user = "server",
-                    .data = "Attempted to change nick to existing name\n",
-                    .length = sizeof("Attempted to change nick to existing name\n")
-                };
-                ssize_t sent_bytes = irc_send(&user->connection, &out_pkt, 0);
-                break;
-            } else {
-                printf("name change to (%s) sucessfull :)\n", new_nick);
-                irc_packet_t out_pkt = {
-                    .user = "server",
-                    .data = "nick ok :)\n",
-                    .length = sizeof("nick ok :)\n")
-                };
-                ssize_t sent_bytes = irc_send(&user->connection, &out_pkt, 0);
-
-                strcpy(user->name, new_nick);
-                break;
-            }
+    // Plain messages fall back to another joined channel
+    if (user->channel == channel) user->channel = user->channel_qty ? user->channels[user->channel_qty-1].channel : NULL;
+    if (user->lobby == channel) user->lobby = NULL;
+    if (channel->admin == user) channel->admin = NULL;
+    fed_announce(channel->reactor->server, fed_part, user, channel);
 
+    log_info("%s left %s (now has %d members)", user->name, channel->name, channel->user_qty);
+    if (channel->user_qty == 0) {
+        server_destroy_channel(channel->reactor->server, channel);
     }
 }
 
+// Tells a v2 user which nickname about's sender ID stands for
+void server_announce_user(server_t* server, user_t* about, user_t* to) {
+    if (to->proto != irc_proto_v2) return;
 
-struct channel_args {
-    server_t* server;
-    channel_t* channel;
-};
+    shared_buf_t* frame = shared_buf_new(IRC_V2_HEADER_MAX + IRC_NAME_LEN);
+    if (!frame) return;
+    frame->len = irc_v2_encode(irc_v2_name, user_sender_id(about), about->name, strlen(about->name), frame->data);
 
-void* channel_chat(void* args) {
-    struct channel_args* ch_args = (struct channel_args*) args;
-    server_t* server = ch_args->server;
-    channel_t* channel = ch_args->channel;
-    free(ch_args);
+    server_send_frame(server, to, frame);
+    shared_buf_unref(frame);
+}
 
-    irc_packet_t pkt;
+// Announces user to every v2 member of the channel, and every member to user if it speaks v2.
+// Caller must hold channel->lock.
+void channel_announce_user(channel_t* channel, user_t* user, bool both_ways) {
+    server_t* server = channel->reactor->server;
+    for (int i = 0; i < channel->user_qty; i++) {
+        user_t* member = channel->members[i];
+        if (member != user || !both_ways) server_announce_user(server, user, member);
+        if (both_ways && member != user) server_announce_user(server, member, user);
+    }
+}
 
-    struct epoll_event in_events[20];
-    while(channel->user_qty) {
-        int ready_qty = epoll_wait(channel->in_epoll, in_events, channel->user_qty, -1);
-        if (ready_qty == -1) {
-            perror("channel_chat::epoll_wait");
-            exit(1);
-            continue;
+// Caller must hold channel->lock. The channel becomes the user's current one, and its reactor
+// the one reading the user.
+bool channel_add_user(channel_t* channel, user_t* user, char* password) {
+    if(!user || !channel || channel->closing) return false;
+    if (user->channel_qty == USER_CHANNEL_MAX) {
+        log_warn("%s tried to join %s but already sits in %d channels", user->name, channel->name, USER_CHANNEL_MAX);
+        return false;
+    }
+    if(channel->password && channel->password[0] != '\0') {
+        if (!password) {
+            log_warn("%s tried to join %s but submitted no password", user->name, channel->name);
+            return false;
+        } else if (strcmp(password, channel->password)) {
+            log_warn("%s tried to join %s but submitted wrong password", user->name, channel->name);
+            return false;
         }
+    }
 
-        for (int n = 0; n < ready_qty; n++) {
-            user_t* user = in_events[n].data.ptr;
-            printf("Got event %u from user %s (chanel %s)!\n",
-                in_events[n].events,
-                user->name,
-                user->channel->name);
+    if (channel->user_qty == channel->member_cap) {
+        int new_cap = channel->member_cap ? channel->member_cap*2 : CHANNEL_CLIENT_QTY;
+        user_t** members = realloc(channel->members, new_cap * sizeof(user_t*));
+        if (!members) {
+            log_perror("channel_add_user::realloc");
+            return false;
+        }
+        channel->members = members;
+        channel->member_cap = new_cap;
+    }
 
-            if (in_events[n].events & EPOLLRDHUP) {
-                printf("EPOLLRDHUP Client has disconnected\n");
-                server_close_connection(server, user->channel, user);
-                continue;
-            }
+    pthread_mutex_lock(&user->channels_lock);
+    if (user->channel_qty == user->channel_cap) {
+        int new_cap = user->channel_cap ? user->channel_cap*2 : USER_CHANNELS_MIN_CAP;
+        membership_t* channels = realloc(user->channels, new_cap * sizeof(membership_t));
+        if (!channels) {
+            log_perror("channel_add_user::realloc");
+            pthread_mutex_unlock(&user->channels_lock);
+            return false;
+        }
+        user->channels = channels;
+        user->channel_cap = new_cap;
+    }
+    user->channels[user->channel_qty++] = (membership_t) { .channel = channel, .slot = channel->user_qty };
+    pthread_mutex_unlock(&user->channels_lock);
 
-            int received = irc_recv(&user->connection, &pkt, 0);
-            if (received == 0) {
-                printf("Client has disconnected\n");
-                server_close_connection(server, user->channel, user);
-                continue;
-            } else if (received == -1) {
-                // perror("channel_chat::irc_recv");
-                continue;
-            } else if (received == -2) {
-                continue;
-            }
+    user->channel = channel;
+    channel->members[channel->user_qty] = user;
+    metric_add(channel->user_qty, 1);
+    reactor_attach_user(channel->reactor, user);
+
+    server_t* server = channel->reactor->server;
+    channel_announce_user(channel, user, true);
+    channel_text_echo(channel, user, "JOIN");
+    fed_announce(server, fed_join, user, channel);
+    if (user->proto == irc_proto_text) {
+        char names[MSG_LEN];
+        size_t names_len = 0;
+        for (int i = 0; i < channel->user_qty && names_len + IRC_NAME_LEN + 1 < MSG_LEN; i++) {
+            names_len += sprintf(names + names_len, "%s%s", i ? " " : "", channel->members[i]->name);
+        }
 
-            irc_cmds_e cmd_type = parse_msg(pkt.data);
-            printf("(%s) %s: %s", all_irc_cmd_types[cmd_type], user->name, pkt.data);
-            handle_cmds(cmd_type, user, &pkt, server);
+        // Members on other servers too
+        pthread_rwlock_rdlock(&server->fed.lock);
+        fed_channel_t* remote = name_map_get(&server->fed.channels, channel->name);
+        for (int i = 0; remote && i < remote->member_qty && names_len + IRC_NAME_LEN + 1 < MSG_LEN; i++) {
+            names_len += sprintf(names + names_len, " %s", remote->members[i]->name);
         }
+        pthread_rwlock_unlock(&server->fed.lock);
+        names[names_len] = '\0';
 
-        memset(pkt.data, '\0', pkt.length);
+        text_send_line(server, user, ":%s 353 %s = %s :%s", IRC_TEXT_SERVER_NAME, user->name, channel->name, names);
+        text_send_line(server, user, ":%s 366 %s %s :End of NAMES list", IRC_TEXT_SERVER_NAME, user->name, channel->name);
     }
+    log_info("%s joined %s (now has %d members, %d channels joined)", user->name, channel->name, channel->user_qty, user->channel_qty);
+    return true;
+}
 
-    printf("chanel_chat::channel %s shutting down... (destroying thread)\n", channel->name);
-    server_destroy_channel(server, channel);
-    return NULL;
+// Tops replay up with whatever the channel's history got since it was collected, and queues it
+// all for user. Caller must hold channel->lock and be inside an epoch section.
+static void channel_send_history(channel_t* channel, user_t* user, history_replay_t* replay) {
+    history_collect(&channel->history, user->proto, replay);
+    server_send_frames(channel->reactor->server, user, replay->frames, replay->qty);
+}
+
+// channel_add_user followed by the channel's history. The bulk of it is collected before taking
+// channel->lock, so relays to the channel carry on meanwhile; under the lock only what they
+// added since is caught up, which leaves no gap nor overlap with what the user gets live.
+// Caller must be inside an epoch section.
+bool channel_join(channel_t* channel, user_t* user, char* password) {
+    history_replay_t replay = {0};
+    history_collect(&channel->history, user->proto, &replay);
+
+    pthread_mutex_lock(&channel->lock);
+    bool joined = channel_add_user(channel, user, password);
+    if (joined) channel_send_history(channel, user, &replay);
+    pthread_mutex_unlock(&channel->lock);
+
+    history_replay_release(&replay);
+    return joined;
 }
 
-void server_add_channel(server_t* server, char* name, user_t* user, char* password) {
-    pthread_mutex_lock(&server->ch_mutex);
+server_config_t server_config_default() {
+    return (server_config_t) {
+        .reactor_qty = 0,
+        .acceptor_qty = 0,
+        .backlog = SERVER_BACKLOG,
+        .fanout_worker_qty = 0,
+        .fanout_min_members = FANOUT_MIN_MEMBERS,
+        .history_qty = HISTORY_MESSAGES,
+        .history_bytes = HISTORY_BYTES,
+        .log_dir = NULL,
+        .log_commit_ms = MSGLOG_COMMIT_MS,
+        .log_retain_bytes = MSGLOG_RETAIN_BYTES,
+        .log_retain_s = MSGLOG_RETAIN_SECONDS,
+        .out_queue_max_bytes = 1 << 20,
+        .slow_policy = slow_disconnect,
+        .text_port = IRC_TEXT_PORT,
+        .metrics_path = NULL,
+        .fed_name = NULL,
+        .fed_port = 0,
+        .fed_dial = NULL,
+        .fed_dial_qty = 0,
+        .ping_interval_s = PING_INTERVAL_S,
+        .ping_timeout_s = PING_TIMEOUT_S,
+        .handshake_timeout_s = HANDSHAKE_TIMEOUT_S,
+        .flood = {
+            .msgs_per_s = FLOOD_MSGS_PER_S,
+            .msg_burst = FLOOD_MSG_BURST,
+            .bytes_per_s = FLOOD_BYTES_PER_S,
+            .byte_burst = FLOOD_BYTE_BURST
+        },
+        .flood_policy = flood_delay
+    };
+}
 
-    if (server->channel_qty == CHANNEL_QTY) {
-        printf("server_add_channel::channel-search found no available slots :/\n");
+// Non-blocking listener that shares its port with every other acceptor's
+static irc_sock_t server_listen(int addr_family, char* addr, in_port_t port, int backlog) {
+    irc_sock_t listening = irc_sock_new(addr_family, addr, port);
+    if (setsockopt(listening.sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1) {
+        perror("server_listen::setsockopt(SO_REUSEPORT)");
         exit(1);
-        return;
     }
+    fcntl(listening.sock, F_SETFL, fcntl(listening.sock, F_GETFL) | O_NONBLOCK);
 
-    channel_t* new_channel = NULL;
-    for (int i = 0; i < CHANNEL_QTY; i++) {
-        if(server->channels[i].name[0] == '\0') {
-            new_channel = &server->channels[i];
-            break;
-        }
+    // Assign name+address to socket
+    if (bind(listening.sock, (const struct sockaddr*) &listening.addr, listening.addr_len) == -1) {
+        perror("server_listen::bind");
+        exit(1);
     }
 
-    strncpy(new_channel->name, name, CHANNEL_NAME_LEN);
-    if (password) {
-        strncpy(new_channel->password, password, CHANNEL_PASS_LEN);
+    // Put it on listening mode
+    if (listen(listening.sock, backlog) == -1) {
+        perror("server_listen::listen");
+        exit(1);
     }
-    printf("new channel name is %s\n", new_channel->name);
+    return listening;
+}
 
-    int clients_in = epoll_create1(0);
-    if (clients_in == -1) {
-        perror("channel_chat::epoll_create1");
+static void acceptor_watch(acceptor_t* acceptor, irc_sock_t* listening, uint32_t text) {
+    struct epoll_event event = { .events = EPOLLIN, .data.u32 = text };
+    if (epoll_ctl(acceptor->epoll, EPOLL_CTL_ADD, listening->sock, &event) == -1) {
+        perror("acceptor_watch::epoll_ctl");
         exit(1);
     }
-    new_channel->in_epoll = clients_in;
+}
+
+void reactor_uring_free(reactor_t* reactor) {
+    if (reactor->uring) uring_free(reactor->uring);     // also unregisters buffers and files
+    uring_buf_ring_free(&reactor->bufs);
+    if (reactor->wake.fd != -1) close(reactor->wake.fd);
+    free(reactor->files);
+    free(reactor->uring);
+    reactor->uring = NULL;
+    reactor->files = NULL;
+    reactor->wake.fd = -1;
+}
+
+// Sets reactor up for the io_uring engine; returns 0, or -errno if the kernel can't do it
+int reactor_uring_init(reactor_t* reactor) {
+    reactor->uring = malloc(sizeof(uring_t));
+    if (!reactor->uring) return -ENOMEM;
+    reactor->wake = (uring_wake_t) { .kind = uring_op_wake, .fd = -1 };
+
+    // uring_init leaves the ring ready for uring_free even when it fails
+    int err = uring_init(reactor->uring, REACTOR_URING_ENTRIES, REACTOR_URING_CQ_ENTRIES);
+    if (!err) err = uring_buf_ring_init(reactor->uring, &reactor->bufs, 0, REACTOR_URING_BUFS, REACTOR_URING_BUF_LEN);
+    if (!err) err = uring_register_files(reactor->uring, REACTOR_URING_FILES);
+    if (!err && !(reactor->files = calloc(REACTOR_URING_FILES, sizeof(uring_recv_t*)))) err = -ENOMEM;
+    if (!err && (reactor->wake.fd = eventfd(0, EFD_CLOEXEC)) == -1) err = -errno;
+    if (err) {
+        reactor_uring_free(reactor);
+        return err;
+    }
 
-    int clients_out = epoll_create1(0);
-    if (clients_out == -1) {
-        perror("channel_chat::epoll_create1");
+    pthread_mutex_init(&reactor->mail_lock, NULL);
+    return 0;
+}
+
+server_t server_new(int addr_family, char* addr, in_port_t port, server_config_t* config) {
+    int reactor_qty = config->reactor_qty;
+    if (reactor_qty <= 0) reactor_qty = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactor_qty <= 0) reactor_qty = 1;
+
+    int acceptor_qty = config->acceptor_qty > 0 ? config->acceptor_qty : reactor_qty;
+    acceptor_t* acceptors = calloc(acceptor_qty, sizeof(acceptor_t));
+    if (!acceptors) {
+        perror("server_new::calloc");
         exit(1);
     }
-    new_channel->out_epoll = clients_out;
+    for (int i = 0; i < acceptor_qty; i++) {
+        acceptor_t* acceptor = &acceptors[i];
+        acceptor->id = i;
+        acceptor->next_reactor = i;
+        acceptor->epoll = epoll_create1(0);
+        if (acceptor->epoll == -1) {
+            perror("server_new::epoll_create1");
+            exit(1);
+        }
+
+        acceptor->listening = server_listen(addr_family, addr, port, config->backlog);
+        acceptor_watch(acceptor, &acceptor->listening, false);
+
+        acceptor->text_listening = (irc_sock_t) { .sock = -1 };
+        if (config->text_port) {
+            acceptor->text_listening = server_listen(addr_family, addr, config->text_port, config->backlog);
+            acceptor_watch(acceptor, &acceptor->text_listening, true);
+        }
+    }
 
-    new_channel->admin = user;
-    channel_add_user(new_channel, user, password);
+    int fanout_worker_qty = config->fanout_worker_qty > 0 ? config->fanout_worker_qty : reactor_qty;
+    server_t server = {
+        .acceptors = acceptors,
+        .acceptor_qty = acceptor_qty,
+        .epoch = malloc(sizeof(epoch_t)),
+        .reactors = calloc(reactor_qty, sizeof(reactor_t)),
+        .reactor_qty = reactor_qty,
+        .config = *config,
+        .fanout_reactors = calloc(fanout_worker_qty, sizeof(reactor_t)),
+        .fanout_worker_qty = fanout_worker_qty
+    };
+
+    for (int i = 0; i < fanout_worker_qty; i++) {
+        server.fanout_reactors[i].id = reactor_qty + i;
+        server.fanout_reactors[i].epoll = -1;
+    }
+
+    for (int i = 0; i < reactor_qty; i++) {
+        server.reactors[i].id = i;
+        server.reactors[i].epoll = epoll_create1(0);
+        if (server.reactors[i].epoll == -1) {
+            perror("server_new::epoll_create1");
+            exit(1);
+        }
+    }
+
+    // Every reactor runs the same engine: io_uring only if all of them got a ring
+    for (int i = 0; i < reactor_qty && server.config.engine == engine_uring; i++) {
+        int err = reactor_uring_init(&server.reactors[i]);
+        if (!err) continue;
+
+        log_warn("io_uring unavailable (%s), falling back to epoll", strerror(-err));
+        for (int j = 0; j < i; j++) reactor_uring_free(&server.reactors[j]);
+        server.config.engine = engine_epoll;
+    }
+
+    epoch_init(server.epoch);
+    channel_dir_init(&server.channels, server.epoch);
+    msglog_store_init(&server.logs, config->log_dir, MSGLOG_SEGMENT_BYTES,
+        config->log_retain_bytes, config->log_retain_s, config->log_commit_ms);
+
+    table_init(&server.users.table, sizeof(user_t));
+    name_map_init(&server.users.by_name);
+    name_map_init(&server.users.remote);
+    pthread_rwlock_init(&server.users.lock, NULL);
+
+    federation_t* fed = &server.fed;
+    if (config->fed_name) {
+        snprintf(fed->name, FED_NAME_LEN, "%s", config->fed_name);
+    } else {
+        char host[FED_NAME_LEN] = "localhost";
+        gethostname(host, sizeof(host)-1);
+        snprintf(fed->name, FED_NAME_LEN, "%.50s:%d", host, port);
+    }
+    fed->id = hash_name(fed->name) ? hash_name(fed->name) : 1;
+    fed->enabled = config->fed_port || config->fed_dial_qty;
+    fed->next_seq = msglog_now_ms() * 1000000;
+    pthread_rwlock_init(&fed->lock, NULL);
+    name_map_init(&fed->users);
+    name_map_init(&fed->channels);
+    fed->reactors = calloc(FED_LINKS_MAX, sizeof(reactor_t));
+    for (int i = 0; i < FED_LINKS_MAX; i++) {
+        fed->reactors[i].id = reactor_qty + fanout_worker_qty + i;
+        fed->reactors[i].epoll = -1;
+    }
+
+    return server;
+}
+
+channel_t* server_search_channel_by_name(server_t* server, char* name);
+
+// Removes user from channel (if any). Caller must be inside an epoch section.
+void channel_part(channel_t* channel, user_t* user) {
+    if (!channel) return;
+
+    pthread_mutex_lock(&channel->lock);
+    channel_remove_user(channel, user);
+    pthread_mutex_unlock(&channel->lock);
+}
+
+
+bool is_admin(user_t* user) {
+    log_debug("%s tried an admin only cmd", user->name);
+    if (user->channel == NULL) return false;
+    if(user != user->channel->admin) return false;
+    log_debug("verification sucessfull");
 
-    struct channel_args* ch_args = malloc(sizeof(struct channel_args));
-    ch_args->server = server;
-    ch_args->channel = new_channel;
-    server->channel_qty++;
-    pthread_create(&new_channel->thread, NULL, channel_chat, ch_args);
+    return true;
+}
+
+// The reader only holds a pool block while a read is being handled or a partial frame waits for
+// the rest of it, so an idle connection costs no more than its user_t. On the thread reading the
+// connection, which recycles the block right away.
+static bool user_acquire_reader(user_t* user) {
+    if (user->in) return true;
+    user->in = buf_pool_alloc(sizeof(irc_reader_t));
+    if (!user->in) {
+        log_perror("user_acquire_reader::buf_pool_alloc");
+        return false;
+    }
+    user->in->start = user->in->end = 0;
+    return true;
+}
+
+static void user_release_reader(user_t* user, bool partial_too) {
+    if (!user->in || (!partial_too && user->in->start != user->in->end)) return;
+    buf_pool_free(user->in, sizeof(irc_reader_t));
+    user->in = NULL;
+}
+
+// Allocates a stable slot for a new user; NULL if the nickname is already taken. A NULL name
+// (text users before NICK) gets a slot that is not listed by name until server_rename_user.
+user_t* server_register_user(server_t* server, char* name) {
+    pthread_rwlock_wrlock(&server->users.lock);
+
+    user_t* user = NULL;
+    handle_t handle;
+    if (!name || (!name_map_get(&server->users.by_name, name) && !name_map_get(&server->users.remote, name))) {
+        user = table_alloc(&server->users.table, &handle);
+    }
+
+    if (user) {
+        if (name) strncpy(user->name, name, IRC_NAME_LEN-1);
+        user->handle = handle;
+        user->can_speak = true;
+        user->connection.sock = -1;
+        pthread_mutex_init(&user->channels_lock, NULL);
+        out_queue_init(&user->out);
+        if (name) name_map_insert(&server->users.by_name, user->name, user);
+    }
+    if (user) __atomic_add_fetch(&server->user_qty, 1, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&server->users.lock);
+    return user;
+}
+
+// A left user's slot, waiting for the epoch to hand it out again
+typedef struct _user_retired {
+    server_t* server;
+    uint32_t index;
+} user_retired_t;
+
+static void server_recycle_user(void* ptr) {
+    user_retired_t* retired = ptr;
+    server_t* server = retired->server;
+    pthread_rwlock_wrlock(&server->users.lock);
+    table_recycle(&server->users.table, retired->index);
+    pthread_rwlock_unlock(&server->users.lock);
+    free(retired);
+}
+
+// The handle goes stale right away, but threads that looked the user up before (flushes, timers,
+// fan-out workers) may still use it until their epoch section ends, so the slot is not zeroed
+// and handed out again before then
+void server_unregister_user(server_t* server, user_t* user) {
+    user_retired_t* retired = malloc(sizeof(user_retired_t));
+    if (!retired) log_perror("server_unregister_user::malloc");
+
+    pthread_rwlock_wrlock(&server->users.lock);
+
+    // Unnamed (or still unregistered) users never got an entry of their own
+    bool named = name_map_get(&server->users.by_name, user->name) == user;
+    if (named) name_map_remove(&server->users.by_name, user->name);
+    handle_t handle = user->handle;
+    table_retire(&server->users.table, handle);
+    __atomic_sub_fetch(&server->user_qty, 1, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&server->users.lock);
+    if (named) fed_announce_uid(server, fed_quit, handle_pack(handle), NULL, NULL);
+
+    // Without the record the slot is leaked rather than reused too early
+    if (retired) {
+        *retired = (user_retired_t) { .server = server, .index = handle.index };
+        epoch_retire(server->epoch, retired, server_recycle_user);
+    }
+}
+
+// Fails if another user, here or on another server, already owns the nickname
+bool server_rename_user(server_t* server, user_t* user, char* new_name) {
+    pthread_rwlock_wrlock(&server->users.lock);
+
+    bool renamed = !name_map_get(&server->users.by_name, new_name) && !name_map_get(&server->users.remote, new_name);
+    if (renamed) {
+        if (name_map_get(&server->users.by_name, user->name) == user) {
+            name_map_remove(&server->users.by_name, user->name);
+        }
+        size_t name_len = strnlen(new_name, IRC_NAME_LEN-1);
+        memmove(user->name, new_name, name_len);    // new_name may be user->name itself
+        user->name[name_len] = '\0';
+        name_map_insert(&server->users.by_name, user->name, user);
+    }
+
+    pthread_rwlock_unlock(&server->users.lock);
+    if (renamed) fed_announce(server, fed_nick, user, NULL);
+    return renamed;
+}
+
+// NULL if the user behind the handle has left the server. The user stays valid to use until the
+// caller's epoch section ends, even if it leaves meanwhile.
+user_t* server_get_user(server_t* server, handle_t handle) {
+    return table_get(&server->users.table, handle);
+}
+
+// Only the reactor that owns the user's connection may call this
+bool server_close_connection(server_t* server, channel_t* channel, user_t* user) {
+    log_info("%s has left the server", user->name);
+
+    // Last joined first, so every removal pops the end of user->channels
+    while (user->channel_qty) {
+        channel = user->channels[user->channel_qty-1].channel;
+        pthread_mutex_lock(&channel->lock);
+        metric_add(channel->metrics.disconnects, 1);
+        channel_remove_user(channel, user);
+        pthread_mutex_unlock(&channel->lock);
+    }
+    free(user->channels);
+    user->channels = NULL;
+    user->channel_cap = 0;
+
+    if (current_metrics) metric_add(current_metrics->disconnects, 1);
+    reactor_detach_user(user);
+    out_queue_clear(&user->out);
+    user_close_socket(user);
+    user_release_reader(user, true);
+
+    server_unregister_user(server, user);
+    return true;
+}
+
+// Safe from any thread inside an epoch section: the owning reactor sees the hangup and closes
+// the connection itself. The user may leave once users.lock is released, but its slot waits
+// for the epoch, and user_shutdown skips a closed socket.
+bool server_kick_user(server_t* server, char* name) {
+    pthread_rwlock_rdlock(&server->users.lock);
+    user_t* user = name_map_get(&server->users.by_name, name);
+    pthread_rwlock_unlock(&server->users.lock);
+
+    if (user) {
+        log_info("kicking %s", user->name);
+        user_shutdown(user);
+    }
+    return user != NULL;
+}
+
+void channel_free(void* ptr) {
+    channel_t* channel = ptr;
+    pthread_mutex_destroy(&channel->lock);
+    history_free(&channel->history);
+    free(channel->members);
+    buf_pool_free(channel, sizeof(channel_t));
+}
+
+// Caller must hold channel->lock; lock-free readers may still see the channel until
+// their epoch section ends, so it is retired instead of freed
+void server_destroy_channel(server_t* server, channel_t* channel) {
+    int channel_qty = __atomic_sub_fetch(&server->channel_qty, 1, __ATOMIC_RELAXED);
+    log_info("deleting channel %s with %d users (%d channels)", channel->name, channel->user_qty, channel_qty);
+
+    channel->closing = true;
+    channel_dir_remove(&server->channels, channel->name);
+    msglog_close(&server->logs, channel->log);
+    channel->log = NULL;
+    epoch_retire(server->epoch, channel, channel_free);
+}
+
+void ping_client(server_t* server, user_t* user) {
+    irc_packet_t pkt = {
+        .user = "server",
+        .length = sizeof("pong\n"),
+        .data = "pong\n"
+    };
+
+    log_debug("pinging user (%s)", user->name);
+    server_send_pkt(server, user, &pkt);
+}
+
+// Keepalive probe in the user's framing: a PING for text clients, otherwise a frame binary
+// clients ignore (see irc_v2_ping)
+static void server_probe_user(server_t* server, user_t* user) {
+    if (user->proto == irc_proto_text) {
+        text_send_line(server, user, "PING :%s", IRC_TEXT_SERVER_NAME);
+        return;
+    }
+    if (user->proto == irc_proto_v1) {
+        irc_packet_t pkt = { .user = "server", .length = 0 };
+        server_send_pkt(server, user, &pkt);
+        return;
+    }
+
+    shared_buf_t* frame = shared_buf_new(IRC_V2_HEADER_MAX);
+    if (!frame) return;
+    frame->len = irc_v2_encode(irc_v2_ping, IRC_V2_SERVER_ID, "", 0, frame->data);
+    server_send_frame(server, user, frame);
+    shared_buf_unref(frame);
+}
+
+// Whether the peer's TCP acknowledged everything sent to it, the probe included. Under out.lock,
+// like user_shutdown: a closed socket's number may already be someone else's.
+static bool user_probe_acked(user_t* user) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    pthread_mutex_lock(&user->out.lock);
+    bool acked = !user->closed && getsockopt(user->connection.sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0
+        && !info.tcpi_unacked;
+    pthread_mutex_unlock(&user->out.lock);
+    return acked;
+}
+
+// Keepalive timer of a user, on the reactor it registered on; it stays on that reactor's wheel
+// wherever the user is read later, so everything here is safe from a thread that does not read
+// the connection: the probe is queued like any frame, and a timeout only shuts the socket down
+// for the reading reactor to see the hangup. Input merely stamps active_ms, the timer is armed
+// again from here alone, at most once per interval.
+static void reactor_keepalive(void* ctx, uint64_t key) {
+    reactor_t* reactor = ctx;
+    server_t* server = reactor->server;
+    user_t* user = server_get_user(server, handle_unpack(key));
+    if (!user) return;                      // left, the timer dies with it
+
+    uint64_t now_ms = reactor->timers.now_ms;
+    uint64_t active_ms = __atomic_load_n(&user->active_ms, __ATOMIC_RELAXED);
+    if (user->pinged_ms && active_ms < user->pinged_ms) {
+        // Silent since the probe: text clients owe a PONG, binary ones at least TCP's ack of it
+        if (user->proto == irc_proto_text || !user_probe_acked(user)) {
+            log_info("%s timed out, silent for %llu s", user->name, (unsigned long long) (now_ms - active_ms) / 1000);
+            metric_add(reactor->metrics.timeouts, 1);
+            user_shutdown(user);
+            return;
+        }
+        active_ms = now_ms;
+    }
+    user->pinged_ms = 0;
+
+    uint64_t idle_until = active_ms + server->config.ping_interval_s * 1000ull;
+    if (now_ms < idle_until) {
+        timer_wheel_arm(&reactor->timers, key, idle_until);
+        return;
+    }
+
+    user->pinged_ms = now_ms;
+    server_probe_user(server, user);
+    timer_wheel_arm(&reactor->timers, key, now_ms + server->config.ping_timeout_s * 1000ull);
+}
+
+// Once the user registered, on the reactor that read the handshake
+static void user_arm_keepalive(server_t* server, user_t* user) {
+    reactor_t* reactor = current_reactor;
+    if (!reactor || !reactor->timers.tick_ms || !server->config.ping_interval_s) return;
+
+    timer_wheel_arm(&reactor->timers, handle_pack(user->handle),
+        reactor->timers.now_ms + server->config.ping_interval_s * 1000ull);
+}
+
+// Takes no lock; caller must be inside an epoch section while it uses the channel
+channel_t* server_search_channel_by_name(server_t* server, char* name) {
+    channel_t* channel = channel_dir_get(&server->channels, name);
+    if (channel) log_debug("found channel %s", channel->name);
+
+    return channel;
+}
+
+user_t* server_search_client_by_name(server_t* server, char* name) {
+    pthread_rwlock_rdlock(&server->users.lock);
+    user_t* user = name_map_get(&server->users.by_name, name);
+    pthread_rwlock_unlock(&server->users.lock);
+
+    return user;
+}
+
+// Keeps pkt for users joining later, in every framing since nobody knows theirs yet; relayed
+// holds the frames the relay already encoded, if any. Caller must hold channel->lock.
+static void channel_remember(channel_t* channel, irc_packet_t* pkt, shared_buf_t** relayed) {
+    if (!channel->history.cap) return;
+
+    shared_buf_t* frames[irc_proto_qty];
+    for (int proto = 0; proto < irc_proto_qty; proto++) {
+        if (proto == irc_proto_v2) frames[proto] = server_encode_replay_v2(pkt);
+        else if (relayed[proto]) frames[proto] = shared_buf_ref(relayed[proto]);
+        else frames[proto] = server_encode_pkt(proto, IRC_V2_REPLAY_ID, pkt, channel->name);  // v1 and text name pkt->user
+    }
+    history_append(&channel->history, frames);
+    for (int proto = 0; proto < irc_proto_qty; proto++) {
+        if (frames[proto]) shared_buf_unref(frames[proto]);
+    }
+}
+
+static bool channel_warm_record(msglog_record_t* record, void* ctx) {
+    irc_packet_t pkt;
+    const char* name;
+    const char* data;
+    size_t name_len;
+    if (!msglog_record_parts(record, &pkt.length, &name, &name_len, &data)) return true;
+    memcpy(pkt.user, name, name_len);
+    pkt.user[name_len < IRC_NAME_LEN ? name_len : IRC_NAME_LEN-1] = '\0';
+    memcpy(pkt.data, data, pkt.length);
+
+    shared_buf_t* relayed[irc_proto_qty] = {0};
+    channel_remember(ctx, &pkt, relayed);
+    return true;
+}
+
+// Seeds a new channel's history with the end of its durable log, so a restart doesn't leave
+// the first ones to join with nothing. Caller must hold channel->lock.
+static void channel_warm_history(channel_t* channel) {
+    if (!channel->log || !channel->history.cap) return;
+
+    uint64_t synced = msglog_synced_seq(channel->log);
+    uint64_t since = synced > channel->history.cap ? synced - channel->history.cap : 0;
+    msglog_scan(channel->log, since, 0, channel_warm_record, channel);
+}
+
+// One relay: the channel's members get pkt from sender, each in the framing it speaks
+typedef struct _relay_job {
+    fanout_job_t job;                       // first, fan-out tasks get it back as a relay_job_t
+    server_t* server;
+    channel_t* channel;
+    user_t* sender;                         // NULL for a user of another server, named by pkt->user
+    irc_packet_t* pkt;
+    shared_buf_t* frames[irc_proto_qty];    // encoded once per framing, shared by every queue
+    bool lazy;                              // single thread: encode frames on first use
+    uint64_t sent;                          // summed over the shards
+    uint64_t sent_bytes;
+    uint64_t dropped;
+} relay_job_t;
+
+// The frame members speaking proto get. Senders on other servers have no ID here, so v2 members
+// get them named right before the message, like the channel history.
+static shared_buf_t* relay_encode(relay_job_t* relay, irc_proto_e proto) {
+    if (!relay->sender && proto == irc_proto_v2) return server_encode_replay_v2(relay->pkt);
+    uint32_t sender = relay->sender ? user_sender_id(relay->sender) : IRC_V2_REPLAY_ID;
+    return server_encode_pkt(proto, sender, relay->pkt, relay->channel->name);
+}
+
+// Queues the frame to members [begin, end) of the channel; caller holds channel->lock
+static void relay_range(fanout_job_t* job, int begin, int end) {
+    relay_job_t* relay = (relay_job_t*) job;
+    channel_t* channel = relay->channel;
+
+    uint64_t sent = 0, sent_bytes = 0, dropped = 0;
+    for (int n = begin; n < end; n++) {
+        user_t* user_to = channel->members[n];
+        if (relay->sender == user_to) continue;
+
+        shared_buf_t** frame = &relay->frames[user_to->proto];
+        if (!*frame && relay->lazy) *frame = relay_encode(relay, user_to->proto);
+        if (!*frame) continue;
+
+        out_result_e result = server_send_frame(relay->server, user_to, *frame);
+        log_debug("\tsend result %d to user %s", result, user_to->name);
+        if (result == out_pending || result == out_queued) {
+            sent++;
+            sent_bytes += (*frame)->len;
+        } else {
+            dropped++;
+        }
+    }
+
+    __atomic_add_fetch(&relay->sent, sent, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&relay->sent_bytes, sent_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&relay->dropped, dropped, __ATOMIC_RELAXED);
+}
+
+// Relays pkt from sender to the channel's members, and on over the links with members of it on
+// other servers. A message of another server has no sender: it came in over link from, already
+// encoded as frame, and goes on as is. Returns false if the channel was closing meanwhile.
+//
+// Channels of at least fanout_min_members are split into FANOUT_SHARD_MEMBERS shards that the
+// fan-out workers queue (and flush) in parallel with this thread; smaller ones are relayed here.
+// The channel stays locked until the last shard is done, which keeps its messages in order, on
+// the links as well.
+static bool channel_relay(server_t* server, channel_t* channel, user_t* sender, irc_packet_t* pkt, fed_link_t* from, shared_buf_t* frame) {
+    relay_job_t relay = {
+        .job.run = relay_range,
+        .server = server,
+        .channel = channel,
+        .sender = sender,
+        .pkt = pkt
+    };
+
+    pthread_mutex_lock(&channel->lock);
+    if (channel->closing) {
+        pthread_mutex_unlock(&channel->lock);
+        return false;
+    }
+
+    int member_qty = channel->user_qty;
+    int fanout = member_qty - (sender != NULL);
+    log_debug("channel_relay::%s to %d members of %s", pkt->user, fanout, channel->name);
+    if (server->fanout.worker_qty && member_qty >= server->config.fanout_min_members) {
+        // Workers can't encode lazily: they would race for the same slot
+        for (int proto = 0; proto < irc_proto_qty; proto++) relay.frames[proto] = relay_encode(&relay, proto);
+        fanout_run(&server->fanout, &relay.job, member_qty, FANOUT_SHARD_MEMBERS);
+    } else {
+        relay.lazy = true;
+        relay_range(&relay.job, 0, member_qty);
+    }
+
+    uint32_t links = __atomic_load_n(&channel->links, __ATOMIC_RELAXED);
+    if (from) links &= ~(1u << from->id);
+    if (links && !frame) {
+        fed_event_t event = {
+            .type = fed_msg,
+            .origin = server->fed.id,
+            .seq = __atomic_add_fetch(&server->fed.next_seq, 1, __ATOMIC_RELAXED),
+            .server = server->fed.id,
+            .uid = handle_pack(sender->handle),
+            .name = pkt->user,
+            .name_len = strnlen(pkt->user, IRC_NAME_LEN),
+            .channel = channel->name,
+            .channel_len = strlen(channel->name),
+            .data = pkt->data,
+            .data_len = pkt->length
+        };
+        shared_buf_t* encoded = fed_encode(&event);
+        if (encoded) fed_send(&server->fed, encoded, links, -1);
+        if (encoded) shared_buf_unref(encoded);
+    } else if (links) {
+        fed_send(&server->fed, frame, links, -1);
+    }
+
+    channel_remember(channel, pkt, relay.frames);
+    if (channel->log) msglog_append(channel->log, pkt);
+
+    metric_add(channel->metrics.msgs_in, 1);
+    metric_add(channel->metrics.bytes_in, pkt->length);
+    metric_add(channel->metrics.msgs_out, relay.sent);
+    metric_add(channel->metrics.bytes_out, relay.sent_bytes);
+    metric_add(channel->metrics.drops, relay.dropped);
+    pthread_mutex_unlock(&channel->lock);
+
+    reactor_t* reactor = current_reactor;
+    if (reactor) {
+        metric_add(reactor->metrics.relays, 1);
+        metric_add(reactor->metrics.fanout, fanout);
+        hist_record(&reactor->metrics.fanout_size, fanout);
+        if (reactor->relay_qty < REACTOR_FLUSH_FRAMES) reactor->relay_ns[reactor->relay_qty++] = reactor->recv_ns;
+    }
+    for (int proto = 0; proto < irc_proto_qty; proto++) {
+        if (relay.frames[proto]) shared_buf_unref(relay.frames[proto]);
+    }
+    return true;
+}
+
+void server_relay_msg(user_t* user, irc_packet_t* pkt) {
+    channel_relay(user->channel->reactor->server, user->channel, user, pkt, NULL, NULL);
+}
+
+// Fan-out workers queue frames the way a reactor thread does, on a reactor_t of their own, and
+// flush it after every shard
+static void fanout_worker_enter(void* ctx) {
+    current_reactor = ctx;
+    current_metrics = &((reactor_t*) ctx)->metrics;
+}
+
+static void fanout_worker_after(void* ctx) {
+    server_t* server = ((reactor_t*) ctx)->server;
+    epoch_enter(server->epoch);
+    reactor_flush_dirty(ctx);
+    epoch_exit(server->epoch);
+    epoch_poll(server->epoch);
+}
+
+// Caller holds fed->lock
+static fed_server_t* fed_find_server(federation_t* fed, uint32_t id) {
+    for (int i = 0; i < fed->server_qty; i++) {
+        if (fed->servers[i].id == id) return &fed->servers[i];
+    }
+    return NULL;
+}
+
+// Caller holds fed->lock for writing
+static fed_server_t* fed_add_server(federation_t* fed, uint32_t id, int link) {
+    if (id == fed->id || fed->server_qty == FED_SERVERS_MAX) return NULL;
+    fed_server_t* known = fed_find_server(fed, id);
+    if (known) return known;
+
+    fed_server_t* added = &fed->servers[fed->server_qty++];
+    *added = (fed_server_t) { .id = id, .link = link };
+    return added;
+}
+
+// Link a user's messages reach this server by, -1 if its server is unknown. Caller holds fed->lock.
+static int fed_user_link(federation_t* fed, fed_user_t* user) {
+    fed_server_t* server = fed_find_server(fed, user->server);
+    return server ? server->link : -1;
+}
+
+static fed_user_t* fed_get_user(federation_t* fed, uint32_t server, uint64_t uid) {
+    char key[sizeof(((fed_user_t*) NULL)->key)];
+    snprintf(key, sizeof(key), "%08x%016llx", server, (unsigned long long) uid);
+    return name_map_get(&fed->users, key);
+}
+
+// Points the local channel of that name, if any, at the links fc now has members behind. The
+// local channel reads it when created, so it can't miss an update whichever comes first. Caller
+// holds fed->lock for writing and is inside an epoch section.
+static void fed_channel_update(server_t* server, fed_channel_t* fc) {
+    uint32_t links = 0;
+    for (int i = 0; i < FED_LINKS_MAX; i++) {
+        if (fc->behind[i]) links |= 1u << i;
+    }
+    channel_t* channel = channel_dir_get(&server->channels, fc->name);
+    if (channel) __atomic_store_n(&channel->links, links, __ATOMIC_RELAXED);
+}
+
+// Links with members of the named channel beyond them. Caller holds fed->lock.
+static uint32_t fed_channel_links(federation_t* fed, const char* name) {
+    fed_channel_t* fc = name_map_get(&fed->channels, name);
+    uint32_t links = 0;
+    for (int i = 0; fc && i < FED_LINKS_MAX; i++) {
+        if (fc->behind[i]) links |= 1u << i;
+    }
+    return links;
+}
+
+// Caller holds fed->lock for writing and is inside an epoch section
+static void fed_channel_join(server_t* server, fed_user_t* user, const char* name) {
+    federation_t* fed = &server->fed;
+    fed_channel_t* fc = name_map_get(&fed->channels, name);
+    for (int i = 0; fc && i < user->channel_qty; i++) {
+        if (user->channels[i] == fc) return;
+    }
+
+    if (!fc) {
+        fc = calloc(1, sizeof(fed_channel_t));
+        if (!fc) {
+            log_perror("fed_channel_join::calloc");
+            return;
+        }
+        strncpy(fc->name, name, CHANNEL_NAME_LEN-1);
+        name_map_insert(&fed->channels, fc->name, fc);
+    }
+    if (fc->member_qty == fc->member_cap) {
+        int new_cap = fc->member_cap ? fc->member_cap*2 : CHANNEL_CLIENT_QTY;
+        fed_user_t** members = realloc(fc->members, new_cap * sizeof(fed_user_t*));
+        if (!members) return;
+        fc->members = members;
+        fc->member_cap = new_cap;
+    }
+    if (user->channel_qty == user->channel_cap) {
+        int new_cap = user->channel_cap ? user->channel_cap*2 : USER_CHANNELS_MIN_CAP;
+        fed_channel_t** channels = realloc(user->channels, new_cap * sizeof(fed_channel_t*));
+        if (!channels) return;
+        user->channels = channels;
+        user->channel_cap = new_cap;
+    }
+    fc->members[fc->member_qty++] = user;
+    user->channels[user->channel_qty++] = fc;
+
+    int link = fed_user_link(fed, user);
+    if (link >= 0 && fc->behind[link]++ == 0) fed_channel_update(server, fc);
+}
+
+// Caller holds fed->lock for writing and is inside an epoch section
+static void fed_channel_part(server_t* server, fed_user_t* user, fed_channel_t* fc) {
+    federation_t* fed = &server->fed;
+    int index = 0;
+    while (index < user->channel_qty && user->channels[index] != fc) index++;
+    if (index == user->channel_qty) return;
+    user->channels[index] = user->channels[--user->channel_qty];
+
+    for (int i = 0; i < fc->member_qty; i++) {
+        if (fc->members[i] == user) {
+            fc->members[i] = fc->members[--fc->member_qty];
+            break;
+        }
+    }
+
+    int link = fed_user_link(fed, user);
+    if (link >= 0 && --fc->behind[link] == 0) fed_channel_update(server, fc);
+    if (!fc->member_qty) {
+        name_map_remove(&fed->channels, fc->name);
+        free(fc->members);
+        free(fc);
+    }
+}
+
+// Lists user under its nickname, unless the nickname is taken by a user of a server with a
+// lower id: every server settles a clash alike, and the loser's own server disconnects it.
+// Caller holds fed->lock for writing and is inside an epoch section.
+static void fed_user_index(server_t* server, fed_user_t* user) {
+    pthread_rwlock_wrlock(&server->users.lock);
+    fed_user_t* other = name_map_get(&server->users.remote, user->name);
+    user_t* local = name_map_get(&server->users.by_name, user->name);
+
+    if ((!other || user->server < other->server) && (!local || user->server < server->fed.id)) {
+        if (other) {
+            name_map_remove(&server->users.remote, other->name);
+            other->named = false;
+        }
+        name_map_insert(&server->users.remote, user->name, user);
+        user->named = true;
+    } else {
+        local = NULL;
+    }
+    pthread_rwlock_unlock(&server->users.lock);
+
+    // The owning reactor sees the hangup and closes the connection
+    if (local) {
+        log_warn("%s is taken on another server too, disconnecting ours", local->name);
+        user_shutdown(local);
+    }
+}
+
+static void fed_user_unindex(server_t* server, fed_user_t* user) {
+    if (!user->named) return;
+
+    pthread_rwlock_wrlock(&server->users.lock);
+    name_map_remove(&server->users.remote, user->name);
+    user->named = false;
+    pthread_rwlock_unlock(&server->users.lock);
+}
+
+// Caller holds fed->lock for writing and is inside an epoch section
+static void fed_user_drop(server_t* server, fed_user_t* user) {
+    while (user->channel_qty) fed_channel_part(server, user, user->channels[user->channel_qty-1]);
+    fed_user_unindex(server, user);
+    name_map_remove(&server->fed.users, user->key);
+    free(user->channels);
+    free(user);
+}
+
+typedef struct _fed_drop {
+    server_t* server;
+    uint32_t id;
+} fed_drop_t;
+
+static void fed_drop_user_of(void* value, void* arg) {
+    fed_drop_t* drop = arg;
+    fed_user_t* user = value;
+    if (user->server == drop->id) fed_user_drop(drop->server, user);
+}
+
+// Forgets a server and every user of it. Caller holds fed->lock for writing and is inside an
+// epoch section.
+static void fed_drop_server(server_t* server, fed_server_t* dropped) {
+    federation_t* fed = &server->fed;
+    fed_drop_t drop = { .server = server, .id = dropped->id };
+    name_map_foreach(&fed->users, fed_drop_user_of, &drop);
+
+    log_info("fed_drop_server::%s (%08x) is gone", dropped->name, dropped->id);
+    *dropped = fed->servers[--fed->server_qty];
+}
+
+// Applies a frame of the network's to this server's view of it. Everything is idempotent: a link
+// coming up is told the state it may have heard of already. Caller holds fed->lock for writing
+// and is inside an epoch section.
+static void fed_apply(server_t* server, fed_link_t* link, fed_event_t* event) {
+    federation_t* fed = &server->fed;
+    if (event->name_len >= IRC_NAME_LEN && event->type != fed_server) return;
+    if (event->name_len >= FED_NAME_LEN || event->channel_len >= CHANNEL_NAME_LEN) return;
+
+    char name[FED_NAME_LEN];
+    char channel[CHANNEL_NAME_LEN];
+    memcpy(name, event->name, event->name_len);
+    name[event->name_len] = '\0';
+    memcpy(channel, event->channel, event->channel_len);
+    channel[event->channel_len] = '\0';
+
+    fed_user_t* user = event->type >= fed_nick ? fed_get_user(fed, event->server, event->uid) : NULL;
+    switch (event->type) {
+        case fed_server: {
+            fed_server_t* added = fed_add_server(fed, event->server, link->id);
+            if (added && !added->name[0] && name[0]) {
+                strcpy(added->name, name);
+                log_info("fed_apply::%s (%08x) joined the network behind link %d", name, event->server, link->id);
+            }
+            break;
+        }
+        case fed_squit: {
+            fed_server_t* dropped = fed_find_server(fed, event->server);
+            if (dropped && dropped->link == link->id) fed_drop_server(server, dropped);
+            break;
+        }
+        case fed_nick:
+            if (!event->name_len || event->server == fed->id) break;
+            if (!user) {
+                user = calloc(1, sizeof(fed_user_t));
+                if (!user) {
+                    log_perror("fed_apply::calloc");
+                    break;
+                }
+                snprintf(user->key, sizeof(user->key), "%08x%016llx", event->server, (unsigned long long) event->uid);
+                user->server = event->server;
+                user->uid = event->uid;
+                name_map_insert(&fed->users, user->key, user);
+            } else if (!strcmp(user->name, name)) {
+                break;
+            }
+            fed_user_unindex(server, user);
+            strcpy(user->name, name);
+            fed_user_index(server, user);
+            break;
+        case fed_quit:
+            if (user) fed_user_drop(server, user);
+            break;
+        case fed_join:
+            if (user && channel[0]) fed_channel_join(server, user, channel);
+            break;
+        case fed_part: {
+            fed_channel_t* fc = name_map_get(&fed->channels, channel);
+            if (user && fc) fed_channel_part(server, user, fc);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+typedef struct _fed_burst_user {
+    uint64_t handle;
+    char name[IRC_NAME_LEN];
+} fed_burst_user_t;
+
+typedef struct _fed_burst {
+    server_t* server;
+    uint32_t mask;                          // the new link only
+    int link;
+    fed_burst_user_t* users;                // this server's, as of the burst
+    int user_qty;
+    int user_cap;
+} fed_burst_t;
+
+static void fed_burst_collect(void* value, void* arg) {
+    fed_burst_t* burst = arg;
+    user_t* user = value;
+    if (burst->user_qty == burst->user_cap) {
+        int new_cap = burst->user_cap ? burst->user_cap*2 : REACTOR_DIRTY_MIN_CAP;
+        fed_burst_user_t* users = realloc(burst->users, new_cap * sizeof(fed_burst_user_t));
+        if (!users) return;
+        burst->users = users;
+        burst->user_cap = new_cap;
+    }
+    fed_burst_user_t* collected = &burst->users[burst->user_qty++];
+    collected->handle = handle_pack(user->handle);
+    memcpy(collected->name, user->name, IRC_NAME_LEN);
+}
+
+static void fed_burst_remote(void* value, void* arg) {
+    fed_burst_t* burst = arg;
+    federation_t* fed = &burst->server->fed;
+    fed_user_t* user = value;
+    if (fed_user_link(fed, user) == burst->link) return;
+
+    fed_event_t event = { .type = fed_nick, .server = user->server, .uid = user->uid,
+        .name = user->name, .name_len = strlen(user->name) };
+    fed_emit(fed, &event, burst->mask);
+    for (int i = 0; i < user->channel_qty; i++) {
+        event = (fed_event_t) { .type = fed_join, .server = user->server, .uid = user->uid,
+            .channel = user->channels[i]->name, .channel_len = strlen(user->channels[i]->name) };
+        fed_emit(fed, &event, burst->mask);
+    }
+}
+
+// Tells a new peer everything this side of the network has: servers, users and who sits in
+// which channel, all as frames of this server's. Caller holds fed->lock for writing, and has
+// just set the link up: whatever changes from now on is announced to it as well.
+static void fed_burst(server_t* server, fed_link_t* link) {
+    federation_t* fed = &server->fed;
+    fed_burst_t burst = { .server = server, .mask = 1u << link->id, .link = link->id };
+
+    fed_event_t event = { .type = fed_server, .server = fed->id, .name = fed->name, .name_len = strlen(fed->name) };
+    fed_emit(fed, &event, burst.mask);
+    for (int i = 0; i < fed->server_qty; i++) {
+        fed_server_t* known = &fed->servers[i];
+        if (known->link == link->id || !known->name[0]) continue;     // nameless ones get theirs forwarded
+        event = (fed_event_t) { .type = fed_server, .server = known->id, .name = known->name, .name_len = strlen(known->name) };
+        fed_emit(fed, &event, burst.mask);
+    }
+
+    // Our users' nicknames as of now; their channels are read one user at a time
+    pthread_rwlock_rdlock(&server->users.lock);
+    name_map_foreach(&server->users.by_name, fed_burst_collect, &burst);
+    pthread_rwlock_unlock(&server->users.lock);
+
+    epoch_enter(server->epoch);
+    for (int i = 0; i < burst.user_qty; i++) {
+        fed_burst_user_t* collected = &burst.users[i];
+        user_t* user = server_get_user(server, handle_unpack(collected->handle));
+        if (!user) continue;
+
+        event = (fed_event_t) { .type = fed_nick, .server = fed->id, .uid = collected->handle,
+            .name = collected->name, .name_len = strnlen(collected->name, IRC_NAME_LEN) };
+        fed_emit(fed, &event, burst.mask);
+
+        pthread_mutex_lock(&user->channels_lock);
+        for (int j = 0; j < user->channel_qty; j++) {
+            channel_t* channel = user->channels[j].channel;
+            event = (fed_event_t) { .type = fed_join, .server = fed->id, .uid = collected->handle,
+                .channel = channel->name, .channel_len = strlen(channel->name) };
+            fed_emit(fed, &event, burst.mask);
+        }
+        pthread_mutex_unlock(&user->channels_lock);
+    }
+    epoch_exit(server->epoch);
+    free(burst.users);
+
+    name_map_foreach(&fed->users, fed_burst_remote, &burst);
+}
+
+// Link threads relay what they read the way a reactor thread does, on a reactor_t of their own
+static void fed_link_enter(fed_link_t* link) {
+    current_reactor = link->ctx;
+    current_metrics = &((reactor_t*) link->ctx)->metrics;
+}
+
+// Names this server and every server it knows, to spot a link that would close a loop
+static shared_buf_t* fed_link_hello(fed_links_t* links) {
+    federation_t* fed = &((server_t*) links->owner)->fed;
+    uint32_t ids[FED_SERVERS_MAX + 1];
+    int id_qty = 0;
+
+    pthread_rwlock_rdlock(&fed->lock);
+    ids[id_qty++] = htole32(fed->id);
+    for (int i = 0; i < fed->server_qty; i++) ids[id_qty++] = htole32(fed->servers[i].id);
+    fed_event_t event = { .type = fed_hello, .origin = fed->id, .server = fed->id,
+        .name = fed->name, .name_len = strlen(fed->name), .data = (const char*) ids, .data_len = id_qty * sizeof(uint32_t) };
+    shared_buf_t* frame = fed_encode(&event);
+    pthread_rwlock_unlock(&fed->lock);
+    return frame;
+}
+
+// Refuses a peer that knows any server this one already does: both sides of the link would
+// then reach it, a loop in the tree. The peer's servers are claimed right away, before their
+// names arrive, so two links racing into the same network can't both be let in.
+static bool fed_link_greet(fed_link_t* link, fed_event_t* hello) {
+    server_t* server = link->links->owner;
+    federation_t* fed = &server->fed;
+    int name_len = hello->name_len < FED_NAME_LEN ? hello->name_len : FED_NAME_LEN-1;
+
+    pthread_rwlock_wrlock(&fed->lock);
+    bool loop = false;
+    for (uint32_t i = 0; i < hello->data_len / sizeof(uint32_t); i++) {
+        uint32_t id;
+        memcpy(&id, hello->data + i * sizeof(uint32_t), sizeof(id));
+        id = le32toh(id);
+        loop |= id == fed->id || fed_find_server(fed, id);
+    }
+    if (!loop) {
+        for (uint32_t i = 0; i < hello->data_len / sizeof(uint32_t); i++) {
+            uint32_t id;
+            memcpy(&id, hello->data + i * sizeof(uint32_t), sizeof(id));
+            fed_add_server(fed, le32toh(id), link->id);
+        }
+        fed_link_set_up(link, hello->server);
+        fed_burst(server, link);
+    }
+    pthread_rwlock_unlock(&fed->lock);
+
+    if (loop) log_warn("fed_link_greet::refusing %.*s, linking it would close a loop", name_len, hello->name);
+    else log_info("fed_link_greet::linked to %.*s (%08x) on link %d", name_len, hello->name, hello->server, link->id);
+    return !loop;
+}
+
+// A message of another server: delivered to this server's members of the channel, and passed on
+// to the links with members beyond. Caller is inside an epoch section.
+static void fed_receive_msg(server_t* server, fed_link_t* link, fed_event_t* event, const char* raw, size_t raw_len) {
+    if (event->name_len >= IRC_NAME_LEN || event->channel_len >= CHANNEL_NAME_LEN || event->data_len >= MSG_LEN) return;
+
+    char name[CHANNEL_NAME_LEN];
+    memcpy(name, event->channel, event->channel_len);
+    name[event->channel_len] = '\0';
+
+    irc_packet_t pkt;
+    pkt.length = event->data_len;
+    memcpy(pkt.user, event->name, event->name_len);
+    pkt.user[event->name_len] = '\0';
+    memcpy(pkt.data, event->data, event->data_len);
+    pkt.data[event->data_len] = '\0';
+
+    shared_buf_t* frame = shared_buf_new(raw_len);
+    if (!frame) return;
+    memcpy(frame->data, raw, raw_len);
+
+    // Without members here only the links need it
+    channel_t* channel = server_search_channel_by_name(server, name);
+    if (!channel || !channel_relay(server, channel, NULL, &pkt, link, frame)) {
+        pthread_rwlock_rdlock(&server->fed.lock);
+        fed_send(&server->fed, frame, fed_channel_links(&server->fed, name), link->id);
+        pthread_rwlock_unlock(&server->fed.lock);
+    }
+    shared_buf_unref(frame);
+}
+
+// Every frame is handled once, whichever link brings it first, and goes on to the other links:
+// all of them, but for messages, which only go where the channel has members
+static void fed_link_frame(fed_link_t* link, fed_event_t* event, const char* raw, size_t raw_len) {
+    server_t* server = link->links->owner;
+    federation_t* fed = &server->fed;
+    if (event->type == fed_hello || event->origin == fed->id) return;
+    if (!fed_links_admit(&fed->links, event->origin, event->seq)) return;
+
+    epoch_enter(server->epoch);
+    if (event->type == fed_msg) {
+        fed_receive_msg(server, link, event, raw, raw_len);
+    } else {
+        shared_buf_t* frame = shared_buf_new(raw_len);
+        pthread_rwlock_wrlock(&fed->lock);
+        fed_apply(server, link, event);
+        if (frame) {
+            memcpy(frame->data, raw, raw_len);
+            fed_send(fed, frame, ~0u, link->id);
+        }
+        pthread_rwlock_unlock(&fed->lock);
+        if (frame) shared_buf_unref(frame);
+    }
+    epoch_exit(server->epoch);
+}
+
+static void fed_link_idle(fed_link_t* link) {
+    server_t* server = link->links->owner;
+    epoch_enter(server->epoch);
+    reactor_flush_dirty(link->ctx);
+    epoch_exit(server->epoch);
+    epoch_poll(server->epoch);
+}
+
+// A netsplit: every server behind the link is gone for the rest of the network too
+static void fed_link_down(fed_link_t* link) {
+    server_t* server = link->links->owner;
+    federation_t* fed = &server->fed;
+    log_warn("fed_link_down::lost link %d (%08x)", link->id, link->peer);
+
+    epoch_enter(server->epoch);
+    pthread_rwlock_wrlock(&fed->lock);
+    for (int i = fed->server_qty; i-- > 0;) {
+        fed_server_t* dropped = &fed->servers[i];
+        if (dropped->link != link->id) continue;
+
+        fed_event_t event = { .type = fed_squit, .server = dropped->id };
+        fed_emit(fed, &event, ~0u);
+        fed_drop_server(server, dropped);
+    }
+    pthread_rwlock_unlock(&fed->lock);
+    epoch_exit(server->epoch);
+}
+
+typedef void (*cmd_handler_fn)(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt);
+
+static void cmd_handle_msg(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (!user->can_speak || !user->channel) return;
+
+    server_relay_msg(user, pkt);
+}
+
+static void cmd_handle_connect(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    log_debug("server cannot connect");
+}
+
+// /join <channel_name> [password]: joins one more channel, or makes an already joined one
+// current. The first channel joined on top of #main leaves it.
+static void cmd_handle_join(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (cmd->argc < 1) return;
+
+    char* ch_name = cmd->argv[0].ptr;
+    char* password = cmd->argc > 1 ? cmd->argv[1].ptr : NULL;
+    log_debug("user %s is joining channel %s", user->name, ch_name);
+
+    channel_t* joined = user_find_channel(user, ch_name);
+    if (joined) {
+        user->channel = joined;
+        if (user->lobby == joined) user->lobby = NULL;
+        return;
+    }
+    if (user->channel_qty >= USER_CHANNEL_MAX) {
+        irc_packet_t out_pkt = {
+            .user = "server",
+            .data = "You have joined too many channels\n",
+            .length = sizeof("You have joined too many channels\n")
+        };
+        server_send_pkt(server, user, &out_pkt);
+        return;
+    }
+
+    // Verificação se o canal existe
+    bool added;
+    channel_t* channel = server_search_channel_by_name(server, ch_name);
+    if (channel) {
+        added = channel_join(channel, user, password);
+    } else {
+        // Validate channel name
+        bool valid_name = ch_name[0] == '#';
+        valid_name &= strchr(ch_name, ',') == NULL;
+
+        if (!valid_name) {
+            log_warn("Attempted to create channel with invalid name (%s)", ch_name);
+            irc_packet_t out_pkt = {
+                .user = "server",
+                .data = "Attempted to create channel with invalid name\n",
+                .length = sizeof("Attempted to create channel with invalid name\n")
+            };
+            server_send_pkt(server, user, &out_pkt);
+            return;
+        }
+
+        added = server_add_channel(server, ch_name, user, password);
+    }
+    if (!added) return;
+
+    if (user->lobby && user->lobby != user->channel) channel_part(user->lobby, user);
+    user->can_speak = true;
+}
+
+// /part [channel_name]: leaves the named channel, or the current one
+static void cmd_handle_part(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    channel_t* channel = cmd->argc ? user_find_channel(user, cmd->argv[0].ptr) : user->channel;
+    if (!channel) return;
+
+    log_debug("user %s is leaving channel %s", user->name, channel->name);
+    channel_part(channel, user);
+}
+
+static void cmd_handle_quit(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    server_close_connection(server, user->channel, user);
+}
+
+static void cmd_handle_ping(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    ping_client(server, user);
+}
+
+static void cmd_handle_kick(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (cmd->argc < 1 || !is_admin(user)) return;
+
+    server_kick_user(server, cmd->argv[0].ptr);
+}
+
+static void cmd_handle_mute(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (cmd->argc < 1 || !is_admin(user)) return;
+
+    user_t* muted_user = server_search_client_by_name(server, cmd->argv[0].ptr);
+    if(!muted_user) return;
+    muted_user->can_speak = false;
+}
+
+static void cmd_handle_unmute(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (cmd->argc < 1 || !is_admin(user)) return;
+
+    user_t* unmuted_user = server_search_client_by_name(server, cmd->argv[0].ptr);
+    if(!unmuted_user) return;
+    unmuted_user->can_speak = true;
+}
+
+static void cmd_handle_whois(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (cmd->argc < 1 || !is_admin(user)) return;
+
+    user_t* srch_user = server_search_client_by_name(server, cmd->argv[0].ptr);
+    if(!srch_user || !user_in_channel(srch_user, user->channel)) return;
+
+    char* ascii_address = inet_ntoa(srch_user->connection.addr.sin_addr);
+
+    pkt->length = snprintf(pkt->data, MSG_LEN, "%s\n", ascii_address);
+    server_send_pkt(server, user, pkt);
+}
+
+static void cmd_handle_nickname(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (cmd->argc < 1) return;
+
+    char* new_nick = cmd->argv[0].ptr;
+
+    if(!server_rename_user(server, user, new_nick)) {
+        log_warn("Attempted to change nick to existing name (%s)", new_nick);
+        irc_packet_t out_pkt = {
+            .user = "server",
+            .data = "Attempted to change nick to existing name\n",
+            .length = sizeof("Attempted to change nick to existing name\n")
+        };
+        server_send_pkt(server, user, &out_pkt);
+        return;
+    }
+
+    log_info("name change to (%s) sucessfull :)", new_nick);
+    irc_packet_t out_pkt = {
+        .user = "server",
+        .data = "nick ok :)\n",
+        .length = sizeof("nick ok :)\n")
+    };
+    server_send_pkt(server, user, &out_pkt);
+
+    for (int i = 0; i < user->channel_qty; i++) {
+        channel_t* channel = user->channels[i].channel;
+        pthread_mutex_lock(&channel->lock);
+        channel_announce_user(channel, user, false);
+        pthread_mutex_unlock(&channel->lock);
+    }
+}
+
+// Sums the counters of every reactor (fan-out workers and server links included) into total
+void server_metrics_total(server_t* server, reactor_metrics_t* total) {
+    memset(total, 0, sizeof(reactor_metrics_t));
+    for (int i = 0; i < server->reactor_qty; i++) reactor_metrics_merge(total, &server->reactors[i].metrics);
+    for (int i = 0; i < server->fanout_worker_qty; i++) reactor_metrics_merge(total, &server->fanout_reactors[i].metrics);
+    if (!server->fed.enabled) return;
+    for (int i = 0; i < FED_LINKS_MAX; i++) reactor_metrics_merge(total, &server->fed.reactors[i].metrics);
+}
+
+// /stats: server totals, relay latency percentiles and the admin's own channel
+static void cmd_handle_stats(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    if (!is_admin(user)) return;
+
+    reactor_metrics_t* total = malloc(sizeof(reactor_metrics_t));
+    if (!total) return;
+    server_metrics_total(server, total);
+
+    channel_t* channel = user->channel;
+    channel_metrics_t* ch = &channel->metrics;
+    int len = snprintf(pkt->data, MSG_LEN,
+        "server: %d users, %d channels, in %llu msgs/%llu B, out %llu msgs/%llu B, %llu relays (avg fan-out %.1f), "
+        "%llu drops, %llu disconnects (%llu slow), deepest queue %llu B\n"
+        "relay latency: p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n"
+        "%s: %d members, in %llu msgs/%llu B, out %llu msgs/%llu B, %llu drops, %llu disconnects\n",
+        metric_get(server->user_qty), metric_get(server->channel_qty),
+        (unsigned long long) total->msgs_in, (unsigned long long) total->bytes_in,
+        (unsigned long long) total->msgs_out, (unsigned long long) total->bytes_out,
+        (unsigned long long) total->relays, total->relays ? (double) total->fanout / total->relays : 0.0,
+        (unsigned long long) total->drops, (unsigned long long) total->disconnects,
+        (unsigned long long) total->slow_disconnects, (unsigned long long) total->queue_bytes_hwm,
+        hist_quantile(&total->relay_latency, 0.5) / 1e3, hist_quantile(&total->relay_latency, 0.99) / 1e3,
+        hist_quantile(&total->relay_latency, 0.999) / 1e3, total->relay_latency.max / 1e3,
+        channel->name, metric_get(channel->user_qty),
+        (unsigned long long) metric_get(ch->msgs_in), (unsigned long long) metric_get(ch->bytes_in),
+        (unsigned long long) metric_get(ch->msgs_out), (unsigned long long) metric_get(ch->bytes_out),
+        (unsigned long long) metric_get(ch->drops), (unsigned long long) metric_get(ch->disconnects));
+    free(total);
+
+    pkt->length = len < MSG_LEN ? len : MSG_LEN-1;
+    server_send_pkt(server, user, pkt);
+}
+
+// One /history replay: the requester's framing of each record, all in one buffer
+typedef struct _history_scan {
+    shared_buf_t* out;
+    size_t cap;
+    irc_proto_e proto;
+    const char* target;
+    int qty;
+    uint64_t first_seq;
+    uint64_t last_seq;
+} history_scan_t;
+
+static bool history_scan_record(msglog_record_t* record, void* ctx) {
+    history_scan_t* scan = ctx;
+    short length;
+    const char* name;
+    const char* data;
+    size_t name_len;
+    if (!msglog_record_parts(record, &length, &name, &name_len, &data)) return true;
+
+    // A text line's length is only known once encoded, so it is encoded aside first
+    char line[IRC_TEXT_LINE_MAX];
+    size_t need;
+    if (scan->proto == irc_proto_text) {
+        char source[3*IRC_NAME_LEN];
+        snprintf(source, sizeof(source), "%.*s!%.*s@%s", (int) name_len, name, (int) name_len, name, IRC_TEXT_SERVER_NAME);
+        need = irc_text_encode(line, sizeof(line), source, "PRIVMSG", scan->target, data, length);
+    } else {
+        need = scan->proto == irc_proto_v1 ? IRC_HEADER_LEN + length : 2*IRC_V2_HEADER_MAX + name_len + length;
+    }
+    if (scan->out->len + need > scan->cap) return false;
+
+    char* at = scan->out->data + scan->out->len;
+    if (scan->proto == irc_proto_v1) {
+        memcpy(at, record->frame, need);
+        scan->out->len += need;
+    } else if (scan->proto == irc_proto_v2) {
+        size_t len = irc_v2_encode(irc_v2_name, IRC_V2_REPLAY_ID, name, name_len, at);
+        scan->out->len += len + irc_v2_encode(irc_v2_msg, IRC_V2_REPLAY_ID, data, length, at + len);
+    } else {
+        memcpy(at, line, need);
+        scan->out->len += need;
+    }
+
+    if (!scan->qty++) scan->first_seq = record->seq;
+    scan->last_seq = record->seq;
+    return true;
+}
+
+// /history <seq>|<minutes>m: the current channel's durable log from that message on, or from
+// that many minutes ago, read straight from the log's mapping into one frame buffer of at most
+// MSGLOG_REPLAY_BYTES, followed by a notice saying which messages it held
+static void cmd_handle_history(server_t* server, user_t* user, irc_cmd_t* cmd, irc_packet_t* pkt) {
+    channel_t* channel = user->channel;
+    if (!channel || cmd->argc < 1) return;
+
+    char* unit;
+    uint64_t since = strtoull(cmd->argv[0].ptr, &unit, 10);
+    uint64_t since_seq = 0, since_ms = 0;
+    if (*unit == 'm') {
+        uint64_t now_ms = msglog_now_ms();
+        since_ms = since * 60000 < now_ms ? now_ms - since * 60000 : 1;
+    } else {
+        since_seq = since;
+    }
+
+    // The channel's reference could go away with its last member, this one can't
+    pthread_mutex_lock(&channel->lock);
+    msglog_t* log = channel->closing ? NULL : channel->log;
+    if (log) msglog_ref(&server->logs, log);
+    pthread_mutex_unlock(&channel->lock);
+
+    history_scan_t scan = { .cap = MSGLOG_REPLAY_BYTES, .proto = user->proto, .target = channel->name };
+    if (log && (scan.out = shared_buf_new(scan.cap))) {
+        scan.out->len = 0;
+        msglog_scan(log, since_seq, since_ms, history_scan_record, &scan);
+        if (scan.qty) server_send_frame(server, user, scan.out);
+        shared_buf_unref(scan.out);
+    }
+    msglog_close(&server->logs, log);
+
+    if (!log) pkt->length = snprintf(pkt->data, MSG_LEN, "%s keeps no log\n", channel->name);
+    else if (!scan.qty) pkt->length = snprintf(pkt->data, MSG_LEN, "%s: no messages since then\n", channel->name);
+    else pkt->length = snprintf(pkt->data, MSG_LEN, "%s: %d messages, %llu to %llu\n", channel->name, scan.qty,
+        (unsigned long long) scan.first_seq, (unsigned long long) scan.last_seq);
+    strcpy(pkt->user, "server");
+    server_send_pkt(server, user, pkt);
+}
+
+// Indexed by irc_cmds_e, filled in at compile time
+static const cmd_handler_fn cmd_handlers[_len] = {
+    [cmd_connect] = cmd_handle_connect,
+    [cmd_quit] = cmd_handle_quit,
+    [cmd_ping] = cmd_handle_ping,
+    [cmd_join] = cmd_handle_join,
+    [cmd_nickname] = cmd_handle_nickname,
+    [cmd_kick] = cmd_handle_kick,
+    [cmd_mute] = cmd_handle_mute,
+    [cmd_unmute] = cmd_handle_unmute,
+    [cmd_whois] = cmd_handle_whois,
+    [cmd_stats] = cmd_handle_stats,
+    [cmd_part] = cmd_handle_part,
+    [cmd_history] = cmd_handle_history,
+    [cmd_msg] = cmd_handle_msg,
+};
+
+// cmd comes from irc_parse_cmd (or the text front end); its arguments point into pkt->data
+void handle_cmds(irc_cmd_t* cmd, user_t* user, irc_packet_t* pkt, server_t* server) {
+    cmd_handlers[cmd->type](server, user, cmd, pkt);
+}
+
+// Every user starts out in #main, its lobby until it joins another channel. Caller must be
+// inside an epoch section.
+void server_join_main(server_t* server, user_t* user) {
+    channel_t* main_channel = server_search_channel_by_name(server, "#main");
+    bool joined = false;
+    if (main_channel) joined = channel_join(main_channel, user, NULL);
+
+    // Missing, or emptied since the lookup
+    if (!joined) joined = server_add_channel(server, "#main", user, NULL);
+    if (joined) user->lobby = user->channel;
+}
+
+// Binary clients open with their nickname, IRC_NAME_LEN bytes prefixed with IRC_V2_HELLO for the
+// v2 framing, and wait for "accepted" or "rejected". Returns false if the connection got closed.
+static bool binary_register(server_t* server, user_t* user, char* hello) {
+    hello[IRC_NAME_LEN-1] = '\0';
+    if (!memcmp(hello, IRC_V2_HELLO, IRC_V2_HELLO_LEN)) {
+        user->proto = irc_proto_v2;
+        memmove(hello, hello + IRC_V2_HELLO_LEN, IRC_NAME_LEN - IRC_V2_HELLO_LEN);
+    }
+
+    // Not a frame, and nothing else can be queued yet: it goes straight to the socket
+    bool accepted = server_rename_user(server, user, hello);
+    send(user->connection.sock, accepted ? "accepted" : "rejected", sizeof("accepted"), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (!accepted) {
+        log_info("refused %s, the nickname is taken", hello);
+        server_close_connection(server, user->channel, user);
+        return false;
+    }
+
+    __atomic_store_n(&user->registered, true, __ATOMIC_RELEASE);
+    user_arm_keepalive(server, user);
+    server_join_main(server, user);
+    return true;
+}
+
+// Text users register once both NICK and USER arrived; only then is the nick claimed
+static void text_try_register(server_t* server, user_t* user) {
+    if (user->registered || !user->sent_user || !user->name[0]) return;
+
+    if (!server_rename_user(server, user, user->name)) {
+        text_send_line(server, user, ":%s 433 * %s :Nickname is already in use", IRC_TEXT_SERVER_NAME, user->name);
+        user->name[0] = '\0';
+        return;
+    }
+
+    __atomic_store_n(&user->registered, true, __ATOMIC_RELEASE);
+    user_arm_keepalive(server, user);
+    log_info("%s registered over the text protocol", user->name);
+    text_send_line(server, user, ":%s 001 %s :Welcome to minirc %s", IRC_TEXT_SERVER_NAME, user->name, user->name);
+    text_send_line(server, user, ":%s 422 %s :MOTD File is missing", IRC_TEXT_SERVER_NAME, user->name);
+    server_join_main(server, user);
+}
+
+static bool text_valid_nick(const char* nick) {
+    size_t len = strlen(nick);
+    return len && len < IRC_NAME_LEN && nick[0] != '#' && nick[0] != ':' && !strchr(nick, ',');
+}
+
+// Translates one RFC 1459 line into the matching handle_cmds call, so text and binary users
+// share every command's semantics. Only PING, the handshake and replies binary clients have
+// no use for are answered here directly.
+void text_handle_line(server_t* server, user_t* user, char* line, size_t len, irc_packet_t* pkt) {
+    irc_text_msg_t msg;
+    if (!irc_text_parse(line, len, &msg)) return;
+
+    const char* me = user->name[0] ? user->name : "*";
+    const char* command = msg.command;
+    log_debug("(text) %s: %s", me, command);
+
+    strncpy(pkt->user, user->name, IRC_NAME_LEN);
+    irc_cmd_t cmd = { .argc = 0 };
+    if (!strcasecmp(command, "PING")) {
+        text_send_line(server, user, ":%s PONG %s :%s", IRC_TEXT_SERVER_NAME, IRC_TEXT_SERVER_NAME,
+            msg.param_qty ? msg.params[0] : "");
+        return;
+    }
+    if (!strcasecmp(command, "PONG")) return;
+    if (!strcasecmp(command, "QUIT")) {
+        cmd.type = cmd_quit;
+        handle_cmds(&cmd, user, pkt, server);
+        return;
+    }
+
+    if (!strcasecmp(command, "NICK")) {
+        if (!msg.param_qty) {
+            text_send_line(server, user, ":%s 431 %s :No nickname given", IRC_TEXT_SERVER_NAME, me);
+        } else if (!text_valid_nick(msg.params[0])) {
+            text_send_line(server, user, ":%s 432 %s %s :Erroneous nickname", IRC_TEXT_SERVER_NAME, me, msg.params[0]);
+        } else if (!user->registered) {
+            strncpy(user->name, msg.params[0], IRC_NAME_LEN-1);
+            text_try_register(server, user);
+        } else {
+            cmd.type = cmd_nickname;
+            cmd.argv[cmd.argc++] = irc_slice_of(msg.params[0]);
+            handle_cmds(&cmd, user, pkt, server);
+        }
+        return;
+    }
+    if (!strcasecmp(command, "USER")) {
+        if (user->registered) {
+            text_send_line(server, user, ":%s 462 %s :You may not reregister", IRC_TEXT_SERVER_NAME, me);
+        } else if (msg.param_qty < 4) {
+            text_send_line(server, user, ":%s 461 %s USER :Not enough parameters", IRC_TEXT_SERVER_NAME, me);
+        } else {
+            user->sent_user = true;
+            text_try_register(server, user);
+        }
+        return;
+    }
+
+    if (!user->registered) {
+        text_send_line(server, user, ":%s 451 %s :You have not registered", IRC_TEXT_SERVER_NAME, me);
+        return;
+    }
+
+    // Commands naming a channel act on it by making it the user's current channel first
+    if (!strcasecmp(command, "PRIVMSG") || !strcasecmp(command, "NOTICE")) {
+        channel_t* target = msg.param_qty ? user_find_channel(user, msg.params[0]) : NULL;
+        if (msg.param_qty < 2) {
+            text_send_line(server, user, ":%s 412 %s :No text to send", IRC_TEXT_SERVER_NAME, me);
+        } else if (!target) {
+            text_send_line(server, user, ":%s 404 %s %s :Cannot send to channel", IRC_TEXT_SERVER_NAME, me, msg.params[0]);
+        } else {
+            user->channel = target;
+            pkt->length = snprintf(pkt->data, MSG_LEN, "%s\n", msg.params[1]);
+            if (pkt->length >= MSG_LEN) pkt->length = MSG_LEN-1;
+            cmd.type = cmd_msg;
+            handle_cmds(&cmd, user, pkt, server);
+        }
+        return;
+    }
+
+    // Channel commands share the binary protocol's handlers, arguments point into the line
+    int needed = 1;
+    if (!strcasecmp(command, "JOIN")) {
+        cmd.type = cmd_join;
+    } else if (!strcasecmp(command, "PART")) {
+        cmd.type = cmd_part;
+    } else if (!strcasecmp(command, "KICK")) {
+        cmd.type = cmd_kick;
+        needed = 2;
+    } else if (!strcasecmp(command, "WHOIS")) {
+        cmd.type = cmd_whois;
+    } else if (!strcasecmp(command, "HISTORY")) {
+        cmd.type = cmd_history;
+        needed = 2;
+    } else if (!strcasecmp(command, "STATS")) {
+        cmd.type = cmd_stats;
+        needed = 0;
+    } else if (!strcasecmp(command, "MODE")) {
+        // Only voice maps onto something minirc has: -v mutes, +v unmutes
+        if (msg.param_qty < 3) return;
+        if (!strcmp(msg.params[1], "-v")) cmd.type = cmd_mute;
+        else if (!strcmp(msg.params[1], "+v")) cmd.type = cmd_unmute;
+        else return;
+        needed = 3;
+    } else {
+        text_send_line(server, user, ":%s 421 %s %s :Unknown command", IRC_TEXT_SERVER_NAME, me, command);
+        return;
+    }
+
+    if (msg.param_qty < needed) {
+        text_send_line(server, user, ":%s 461 %s %s :Not enough parameters", IRC_TEXT_SERVER_NAME, me, command);
+        return;
+    }
+
+    if (cmd.type == cmd_join || cmd.type == cmd_part) {
+        // One command per channel of a comma list, JOIN pairing each with the matching key
+        char* name = msg.params[0];
+        char* keys = cmd.type == cmd_join && msg.param_qty > 1 ? msg.params[1] : NULL;
+        while (name) {
+            char* next = strchr(name, ',');
+            if (next) *next++ = '\0';
+            char* key = keys;
+            if (keys && (keys = strchr(keys, ','))) *keys++ = '\0';
+
+            cmd.argc = 0;
+            cmd.argv[cmd.argc++] = irc_slice_of(name);
+            if (key && key[0]) cmd.argv[cmd.argc++] = irc_slice_of(key);
+            if (cmd.type == cmd_part && !user_find_channel(user, name)) {
+                text_send_line(server, user, ":%s 442 %s %s :You're not on that channel", IRC_TEXT_SERVER_NAME, me, name);
+            } else {
+                handle_cmds(&cmd, user, pkt, server);
+            }
+            name = next;
+        }
+        return;
+    }
+
+    if (cmd.type == cmd_kick || cmd.type == cmd_mute || cmd.type == cmd_unmute || cmd.type == cmd_history) {
+        channel_t* target = user_find_channel(user, msg.params[0]);
+        if (!target) {
+            text_send_line(server, user, ":%s 442 %s %s :You're not on that channel", IRC_TEXT_SERVER_NAME, me, msg.params[0]);
+            return;
+        }
+        user->channel = target;
+    }
+    if (needed) {
+        // The nickname (or where history starts) is the last required parameter
+        cmd.argv[cmd.argc++] = irc_slice_of(msg.params[needed-1]);
+    }
+    handle_cmds(&cmd, user, pkt, server);
+}
+
+#define REACTOR_EVENT_QTY 64
+
+// flood_delay: stops reading a user that ran into debt until the refill repays it, so TCP pushes
+// back on the client instead of the reactor queueing its flood (see reactor_unthrottle). On the
+// thread reading the connection.
+static void reactor_throttle_user(reactor_t* reactor, user_t* user) {
+    pthread_mutex_lock(&user->out.lock);
+    if (user->throttled) {
+        pthread_mutex_unlock(&user->out.lock);
+        return;
+    }
+    user->throttled = true;
+    // io_uring: the recv's last completion sees the flag and does not re-arm
+    uring_recv_t* op = user->recv_op;
+    if (op && op->reactor == reactor && !op->cancelling) reactor_uring_cancel_recv(op);
+    // epoll: the set still holding the connection is this one even with a handoff pending
+    else if (!reactor->uring) reactor_ctl_user(reactor, EPOLL_CTL_MOD, user);
+    pthread_mutex_unlock(&user->out.lock);
+
+    metric_add(reactor->metrics.throttles, 1);
+    timer_wheel_arm(&reactor->throttles, handle_pack(user->handle),
+        reactor->recv_ns / 1000000 + flood_wait_ms(&user->flood, &reactor->server->config.flood));
+}
+
+// Dispatches the complete frames user->in holds, each charged to the flood buckets first. With
+// hold set, flood_delay leaves the frames past the debt buffered for reactor_unthrottle, unless
+// a /join handed the user to another reactor meanwhile. Returns false if the user got closed.
+static bool reactor_dispatch_frames(server_t* server, user_t* user, irc_packet_t* pkt, bool hold) {
+    handle_t handle = user->handle;
+    reactor_t* reactor = current_reactor;
+    flood_limits_t* limits = &server->config.flood;
+    bool flood_control = reactor && (limits->msgs_per_s || limits->bytes_per_s);
+    bool drop = server->config.flood_policy == flood_drop;
+    if (!user->in) return true;
+
+    while (true) {
+        irc_read_status_e status;
+        char* line;
+        size_t line_len;
+        if (!user->registered && user->proto != irc_proto_text) {
+            char hello[IRC_NAME_LEN];
+            if (irc_reader_next_hello(user->in, hello) == irc_read_more) break;
+            if (!binary_register(server, user, hello)) return false;
+            continue;
+        }
+        if (flood_control && hold && flood_in_debt(&user->flood) && user->reactor == reactor) break;
+
+        if (user->proto == irc_proto_text) {
+            status = irc_reader_next_line(user->in, &line, &line_len);
+        } else if (user->proto == irc_proto_v2) {
+            irc_v2_frame_t frame;
+            status = irc_reader_next_v2(user->in, &frame);
+            if (status == irc_read_frame && frame.type != irc_v2_msg) continue;
+            if (status == irc_read_frame) {
+                pkt->length = frame.length;
+                memcpy(pkt->data, frame.data, frame.length);
+                pkt->data[frame.length] = '\0';
+            }
+        } else {
+            status = irc_reader_next(user->in, pkt);
+        }
+        if (status == irc_read_more) break;
+        if (status == irc_read_invalid) {
+            log_warn("%s sent a malformed frame", user->name);
+            server_close_connection(server, user->channel, user);
+            return false;
+        }
+
+        // Charged before anything is parsed, whatever the frame turns out to be
+        if (flood_control && !flood_charge(&user->flood, user->proto == irc_proto_text ? line_len : pkt->length, drop)) {
+            metric_add(reactor->metrics.throttles, 1);
+            continue;
+        }
+
+        if (user->proto == irc_proto_text) {
+            text_handle_line(server, user, line, line_len, pkt);
+        } else {
+            // The sender is whoever owns the connection, not what the packet claims
+            strncpy(pkt->user, user->name, IRC_NAME_LEN);
+
+            log_debug("%s: %s", user->name, pkt->data);
+            irc_cmd_t cmd;
+            irc_parse_cmd(pkt->data, pkt->length, &cmd);
+            handle_cmds(&cmd, user, pkt, server);
+        }
+
+        // Cap how long coalesced frames may wait behind a pipelining client
+        if (reactor) metric_add(reactor->metrics.msgs_in, 1);
+        if (reactor && ++reactor->frames_since_flush >= REACTOR_FLUSH_FRAMES) reactor_flush_dirty(reactor);
+
+        // /quit (or a failed send) may have closed the connection under us
+        if (!server_get_user(server, handle)) return false;
+    }
+    user_release_reader(user, false);
+    return true;
+}
+
+// Handles every complete frame user->in holds. received is what the read that filled it returned:
+// 0 (EOF) or -1 (error, errno set) close the connection once the frames before it are handled.
+// Returns false if the connection got closed, or (epoll) handed to another reactor.
+bool reactor_handle_frames(server_t* server, user_t* user, irc_packet_t* pkt, ssize_t received) {
+    reactor_t* reactor = current_reactor;
+    flood_limits_t* limits = &server->config.flood;
+    if (reactor && received > 0) {
+        reactor->recv_ns = metrics_now_ns();
+        metric_add(reactor->metrics.bytes_in, received);
+        __atomic_store_n(&user->active_ms, reactor->recv_ns / 1000000, __ATOMIC_RELAXED);
+        if (limits->msgs_per_s || limits->bytes_per_s) flood_refill(&user->flood, limits, reactor->recv_ns / 1000000);
+    }
+    if (received == -1) log_perror("reactor_handle_input::recv");
+
+    // A closing connection gets the rest of its frames handled regardless
+    if (!reactor_dispatch_frames(server, user, pkt, received > 0)) return false;
+
+    if (received <= 0) {
+        log_info("%s has disconnected", user->name);
+        server_close_connection(server, user->channel, user);
+        return false;
+    }
+    if (reactor && flood_in_debt(&user->flood)) reactor_throttle_user(reactor, user);
+    if (reactor && !reactor->uring) return reactor_settle_user(reactor, user);
+    return true;
+}
+
+bool reactor_handle_input(server_t* server, user_t* user, irc_packet_t* pkt) {
+    if (!user_acquire_reader(user)) {
+        server_close_connection(server, user->channel, user);
+        return false;
+    }
+    ssize_t received = irc_reader_fill(user->in, user->connection.sock);
+    if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        user_release_reader(user, false);
+        return true;
+    }
+
+    return reactor_handle_frames(server, user, pkt, received);
+}
+
+// Starts reading the user on reactor's ring with op, through a registered file slot when its
+// handle's one is free. Needs user->out.lock, only on reactor's thread.
+static bool reactor_uring_submit_recv(reactor_t* reactor, user_t* user, uring_recv_t* op) {
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->uring);
+    if (!sqe) {
+        log_error("reactor_uring_submit_recv::submission ring full");
+        return false;
+    }
+
+    op->kind = uring_op_recv;
+    op->handle = user->handle;
+    op->reactor = reactor;
+    op->cancelling = false;
+
+    uint32_t slot = user->handle.index;
+    if (!op->fixed && slot < REACTOR_URING_FILES && !reactor->files[slot] &&
+        uring_update_file(reactor->uring, slot, user->connection.sock) == 0) {
+        reactor->files[slot] = op;
+        op->fixed = true;
+    }
+
+    uring_prep_recv(sqe, op->fixed ? (int) slot : user->connection.sock, op->fixed,
+        reactor->bufs.bgid, !op->once, (uintptr_t) op);
+    user->recv_op = op;
+    return true;
+}
+
+// Starts reading a user that no recv reads yet, once if it comes out of a flood pause (a
+// multishot recv would take its whole backlog before it could be stopped again). Needs
+// user->out.lock, only on reactor's thread.
+static void reactor_uring_start_recv(reactor_t* reactor, user_t* user, bool once) {
+    // The ring waits for data itself; a non-blocking socket would just fail with EAGAIN
+    fcntl(user->connection.sock, F_SETFL, fcntl(user->connection.sock, F_GETFL) & ~O_NONBLOCK);
+    uring_recv_t* op = calloc(1, sizeof(uring_recv_t));
+    if (!op) {
+        log_perror("reactor_uring_start_recv::calloc");
+        return;
+    }
+    op->once = once;
+    if (!reactor_uring_submit_recv(reactor, user, op)) free(op);
+}
+
+// Throttle timer of a user, on the reactor that paused it. Once the refill repaid the debt, the
+// frames held back go first, still paused and only if this reactor reads the connection (nobody
+// else touches user->in meanwhile); then reading resumes, on whichever reactor the user belongs to
+// by now, unless those frames ran into debt again.
+static void reactor_unthrottle(void* ctx, uint64_t key) {
+    reactor_t* reactor = ctx;
+    server_t* server = reactor->server;
+    user_t* user = server_get_user(server, handle_unpack(key));
+    if (!user || !user->throttled) return;
+
+    uint64_t now_ms = reactor->throttles.now_ms;
+    flood_refill(&user->flood, &server->config.flood, now_ms);
+    if (!flood_in_debt(&user->flood) && user->reactor == reactor) {
+        irc_packet_t pkt;
+        if (!reactor_dispatch_frames(server, user, &pkt, true)) return;
+        if (!reactor->uring) reactor_settle_user(reactor, user);
+    }
+    if (flood_in_debt(&user->flood)) {
+        timer_wheel_arm(&reactor->throttles, key, now_ms + flood_wait_ms(&user->flood, &server->config.flood));
+        return;
+    }
+
+    pthread_mutex_lock(&user->out.lock);
+    user->throttled = false;
+    // io_uring: a recv still being cancelled re-arms itself once it completes
+    if (user->reactor && user->reactor->uring && !user->recv_op) {
+        if (user->reactor == reactor) reactor_uring_start_recv(reactor, user, true);
+        else reactor_uring_post(user->reactor, reactor_mail_attach, user);
+    } else if (user->reactor && !user->reactor->uring) {
+        reactor_ctl_user(user->reactor, EPOLL_CTL_MOD, user);
+    }
+    pthread_mutex_unlock(&user->out.lock);
+}
+
+static void reactor_uring_received(reactor_t* reactor, uring_recv_t* op, struct io_uring_cqe* cqe, irc_packet_t* pkt) {
+    server_t* server = reactor->server;
+    int res = cqe->res;
+
+    user_t* user = server_get_user(server, op->handle);
+    if (user && user->recv_op != op) user = NULL;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char* data = uring_buf_ring_data(&reactor->bufs, bid);
+        bool fits = !user || res <= 0 || (user_acquire_reader(user) && irc_reader_feed(user->in, data, res));
+        // A paused user's frames still held back make room for what its recv read before stopping
+        if (!fits && user->throttled) {
+            if (!reactor_dispatch_frames(server, user, pkt, false)) user = NULL;
+            fits = !user || irc_reader_feed(user->in, data, res);
+        }
+        uring_buf_ring_add(&reactor->bufs, bid);
+        uring_buf_ring_publish(&reactor->bufs);
+
+        if (!fits) {
+            log_warn("%s sent a malformed frame", user->name);
+            server_close_connection(server, user->channel, user);
+            user = NULL;
+        }
+    }
+
+    if (user && res > 0 && !reactor_handle_frames(server, user, pkt, res)) user = NULL;
+    if (cqe->flags & IORING_CQE_F_MORE) return;
+
+    // The recv is over. Closed users have nothing left to do with it, a hangup or an error
+    // closes the connection, anything else (moved, out of buffers) hands it to its reactor.
+    if (!user) {
+        reactor_uring_release_file(op);
+        free(op);
+        return;
+    }
+    if (res == 0 || (res < 0 && res != -ENOBUFS && res != -ECANCELED)) {
+        pthread_mutex_lock(&user->out.lock);
+        reactor_uring_release_file(op);
+        user->recv_op = NULL;
+        pthread_mutex_unlock(&user->out.lock);
+        free(op);
+
+        errno = -res;
+        reactor_handle_frames(server, user, pkt, res ? -1 : 0);
+        return;
+    }
+
+    pthread_mutex_lock(&user->out.lock);
+    user->recv_op = NULL;
+    if (user->throttled) {
+        reactor_uring_release_file(op);     // reactor_unthrottle starts a new one
+    } else if (user->reactor == reactor) {
+        // Back to multishot once a read no longer fills a whole buffer
+        op->once = op->once && res == REACTOR_URING_BUF_LEN;
+        if (reactor_uring_submit_recv(reactor, user, op)) op = NULL;
+    } else {
+        reactor_uring_release_file(op);
+        if (user->reactor) reactor_uring_post(user->reactor, reactor_mail_attach, user);
+    }
+    pthread_mutex_unlock(&user->out.lock);
+    free(op);
+}
+
+static void reactor_uring_arm_wake(reactor_t* reactor) {
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor->uring);
+    if (!sqe) {
+        log_error("reactor_uring_arm_wake::submission ring full");
+        return;
+    }
+    uring_prep_read(sqe, reactor->wake.fd, &reactor->wake.value, sizeof(reactor->wake.value), (uintptr_t) &reactor->wake);
+}
+
+// Handles what other threads posted since the last wake-up
+static void reactor_uring_read_mail(reactor_t* reactor) {
+    pthread_mutex_lock(&reactor->mail_lock);
+    reactor_mail_t* mail = reactor->mail;
+    int mail_qty = reactor->mail_qty;
+    reactor->mail = NULL;
+    reactor->mail_qty = reactor->mail_cap = 0;
+    reactor->mail_signalled = false;
+    pthread_mutex_unlock(&reactor->mail_lock);
+
+    for (int i = 0; i < mail_qty; i++) {
+        user_t* user = server_get_user(reactor->server, handle_unpack(mail[i].handle));
+        if (!user) continue;
+
+        if (mail[i].kind == reactor_mail_flush) {
+            reactor_uring_send_user(reactor, user);
+            continue;
+        }
+
+        pthread_mutex_lock(&user->out.lock);
+        uring_recv_t* op = user->recv_op;
+        if (mail[i].kind == reactor_mail_cancel && op && op->reactor == reactor) {
+            reactor_uring_cancel_recv(op);
+        } else if (mail[i].kind == reactor_mail_attach && !op && user->reactor == reactor && !user->throttled) {
+            reactor_uring_start_recv(reactor, user, false);
+        }
+        pthread_mutex_unlock(&user->out.lock);
+    }
+    free(mail);
+
+    reactor_uring_arm_wake(reactor);
+}
+
+// How long the reactor may sleep before a keepalive or throttle timer is due, -1 if none is armed
+static int reactor_timeout(reactor_t* reactor) {
+    uint64_t now_ms = metrics_now_ns() / 1000000;
+    int timeout = timer_wheel_timeout(&reactor->timers, now_ms);
+    int throttle_timeout = timer_wheel_timeout(&reactor->throttles, now_ms);
+    if (timeout == -1 || (throttle_timeout != -1 && throttle_timeout < timeout)) timeout = throttle_timeout;
+    return timeout;
+}
+
+static void reactor_advance_timers(reactor_t* reactor) {
+    uint64_t now_ms = metrics_now_ns() / 1000000;
+    timer_wheel_advance(&reactor->timers, now_ms);
+    timer_wheel_advance(&reactor->throttles, now_ms);
+}
+
+// io_uring event loop: one io_uring_enter both submits everything the previous iteration
+// queued (sends of a whole fan-out, re-armed recvs) and waits for the next completions
+static void reactor_uring_run(reactor_t* reactor) {
+    server_t* server = reactor->server;
+    uring_t* uring = reactor->uring;
+    irc_packet_t pkt;
+
+    reactor_uring_arm_wake(reactor);
+    while (true) {
+        int timeout = reactor_timeout(reactor);
+        if (uring_submit_wait(uring, timeout) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+            perror("reactor_uring_run::io_uring_enter");
+            exit(1);
+        }
+
+        epoch_enter(server->epoch);
+        reactor_advance_timers(reactor);
+        struct io_uring_cqe* next;
+        while ((next = uring_peek_cqe(uring))) {
+            // Handlers may submit, hand the slot back first
+            struct io_uring_cqe cqe = *next;
+            uring_cqe_seen(uring);
+
+            uring_op_kind_e* op = (uring_op_kind_e*) (uintptr_t) cqe.user_data;
+            if (!op) continue;              // cancellations
+
+            switch (*op) {
+                case uring_op_recv:
+                    reactor_uring_received(reactor, (uring_recv_t*) op, &cqe, &pkt);
+                    break;
+                case uring_op_send:
+                    reactor_uring_sent(reactor, (uring_send_t*) op, cqe.res);
+                    break;
+                case uring_op_wake:
+                    reactor_uring_read_mail(reactor);
+                    break;
+            }
+        }
+        reactor_flush_dirty(reactor);
+        epoch_exit(server->epoch);
+        epoch_poll(server->epoch);
+    }
+}
+
+void* reactor_run(void* args) {
+    reactor_t* reactor = (reactor_t*) args;
+    server_t* server = reactor->server;
+    current_reactor = reactor;
+    current_metrics = &reactor->metrics;
+
+    if (reactor->uring) {
+        reactor_uring_run(reactor);
+        return NULL;
+    }
+
+    irc_packet_t pkt;
+
+    struct epoll_event in_events[REACTOR_EVENT_QTY];
+    while(true) {
+        // Sleeps until the next keepalive or throttle deadline at most; nothing scans the connections
+        int timeout = reactor_timeout(reactor);
+        int ready_qty = epoll_wait(reactor->epoll, in_events, REACTOR_EVENT_QTY, timeout);
+        if (ready_qty == -1) {
+            if (errno == EINTR) continue;
+            perror("reactor_run::epoll_wait");
+            exit(1);
+        }
+
+        // Probes go out with this iteration's flush
+        epoch_enter(server->epoch);
+        reactor_advance_timers(reactor);
+        for (int n = 0; n < ready_qty; n++) {
+            // A user closed earlier in this batch leaves a stale handle behind
+            user_t* user = server_get_user(server, handle_unpack(in_events[n].data.u64));
+            if (!user) continue;
+
+            log_debug("Got event %u from user %s (reactor %d)!",
+                in_events[n].events,
+                user->name,
+                reactor->id);
+
+            if (in_events[n].events & EPOLLOUT) {
+                server_flush_user(server, user);
+            }
+
+            // Drain what the client managed to send before hanging up; a user that moved to
+            // another reactor meanwhile gets its hangup seen there
+            if (in_events[n].events & EPOLLIN) {
+                if (!reactor_handle_input(server, user, &pkt)) continue;
+            }
+
+            if (in_events[n].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                log_info("%s hung up", user->name);
+                server_close_connection(server, user->channel, user);
+                continue;
+            }
+        }
+        reactor_flush_dirty(reactor);
+        epoch_exit(server->epoch);
+        epoch_poll(server->epoch);
+    }
+
+    return NULL;
+}
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void metrics_write_hist(FILE* out, const char* name, const char* labels, hist_t* hist) {
+    for (int i = 0; i < sizeof(metrics_quantiles)/sizeof(metrics_quantiles[0]); i++) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} %llu\n", name, labels, labels[0] ? "," : "",
+            metrics_quantiles[i], (unsigned long long) hist_quantile(hist, metrics_quantiles[i]));
+    }
+    fprintf(out, "%s_sum{%s} %llu\n", name, labels, (unsigned long long) hist->sum);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) hist->count);
+}
+
+// A label value as the text format wants it: backslash, double quote and line feed escaped.
+// Channel names are whatever users joined, they must not break out of the quotes.
+static void metrics_escape_label(char* out, const char* value) {
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"') *out++ = '\\';
+        if (*value == '\n') {
+            *out++ = '\\';
+            *out++ = 'n';
+            continue;
+        }
+        *out++ = *value;
+    }
+    *out = '\0';
+}
+
+static void metrics_write_channel(void* value, void* arg) {
+    channel_t* channel = value;
+    FILE* out = arg;
+    channel_metrics_t* m = &channel->metrics;
+
+    char name[2*CHANNEL_NAME_LEN];
+    metrics_escape_label(name, channel->name);
+    fprintf(out, "minirc_channel_members{channel=\"%s\"} %d\n", name, metric_get(channel->user_qty));
+    fprintf(out, "minirc_channel_messages_in_total{channel=\"%s\"} %llu\n", name, (unsigned long long) metric_get(m->msgs_in));
+    fprintf(out, "minirc_channel_bytes_in_total{channel=\"%s\"} %llu\n", name, (unsigned long long) metric_get(m->bytes_in));
+    fprintf(out, "minirc_channel_messages_out_total{channel=\"%s\"} %llu\n", name, (unsigned long long) metric_get(m->msgs_out));
+    fprintf(out, "minirc_channel_bytes_out_total{channel=\"%s\"} %llu\n", name, (unsigned long long) metric_get(m->bytes_out));
+    fprintf(out, "minirc_channel_drops_total{channel=\"%s\"} %llu\n", name, (unsigned long long) metric_get(m->drops));
+    fprintf(out, "minirc_channel_disconnects_total{channel=\"%s\"} %llu\n", name, (unsigned long long) metric_get(m->disconnects));
+}
+
+// Prometheus text exposition of every reactor's and every channel's counters
+void server_write_metrics(server_t* server, FILE* out) {
+    reactor_metrics_t* snapshot = malloc(sizeof(reactor_metrics_t));
+    if (!snapshot) return;
+
+    fprintf(out, "minirc_channels %d\n", metric_get(server->channel_qty));
+    fprintf(out, "minirc_users %d\n", metric_get(server->user_qty));
+    if (server->logs.dir) {
+        fprintf(out, "minirc_log_commits_total %llu\n", (unsigned long long) metric_get(server->logs.commits));
+        fprintf(out, "minirc_log_synced_bytes_total %llu\n", (unsigned long long) metric_get(server->logs.synced_bytes));
+    }
+    if (server->fed.enabled) {
+        fed_links_t* links = &server->fed.links;
+        fprintf(out, "minirc_federation_links_up %d\n", __builtin_popcount(__atomic_load_n(&links->up, __ATOMIC_RELAXED)));
+        fprintf(out, "minirc_federation_frames_in_total %llu\n", (unsigned long long) metric_get(links->frames_in));
+        fprintf(out, "minirc_federation_frames_out_total %llu\n", (unsigned long long) metric_get(links->frames_out));
+        fprintf(out, "minirc_federation_duplicates_total %llu\n", (unsigned long long) metric_get(links->duplicates));
+    }
+    int link_qty = server->fed.enabled ? FED_LINKS_MAX : 0;
+    for (int i = 0; i < server->reactor_qty + server->fanout_worker_qty + link_qty; i++) {
+        char labels[32];
+        reactor_t* reactor;
+        if (i < server->reactor_qty) {
+            reactor = &server->reactors[i];
+            snprintf(labels, sizeof(labels), "reactor=\"%d\"", i);
+        } else if (i < server->reactor_qty + server->fanout_worker_qty) {
+            reactor = &server->fanout_reactors[i - server->reactor_qty];
+            snprintf(labels, sizeof(labels), "fanout_worker=\"%d\"", i - server->reactor_qty);
+        } else {
+            reactor = &server->fed.reactors[i - server->reactor_qty - server->fanout_worker_qty];
+            snprintf(labels, sizeof(labels), "link=\"%d\"", i - server->reactor_qty - server->fanout_worker_qty);
+        }
+
+        memset(snapshot, 0, sizeof(reactor_metrics_t));
+        reactor_metrics_merge(snapshot, &reactor->metrics);
+
+        fprintf(out, "minirc_messages_in_total{%s} %llu\n", labels, (unsigned long long) snapshot->msgs_in);
+        fprintf(out, "minirc_bytes_in_total{%s} %llu\n", labels, (unsigned long long) snapshot->bytes_in);
+        fprintf(out, "minirc_messages_out_total{%s} %llu\n", labels, (unsigned long long) snapshot->msgs_out);
+        fprintf(out, "minirc_bytes_out_total{%s} %llu\n", labels, (unsigned long long) snapshot->bytes_out);
+        fprintf(out, "minirc_relays_total{%s} %llu\n", labels, (unsigned long long) snapshot->relays);
+        fprintf(out, "minirc_fanout_total{%s} %llu\n", labels, (unsigned long long) snapshot->fanout);
+        fprintf(out, "minirc_drops_total{%s} %llu\n", labels, (unsigned long long) snapshot->drops);
+        fprintf(out, "minirc_disconnects_total{%s} %llu\n", labels, (unsigned long long) snapshot->disconnects);
+        fprintf(out, "minirc_slow_disconnects_total{%s} %llu\n", labels, (unsigned long long) snapshot->slow_disconnects);
+        fprintf(out, "minirc_timeouts_total{%s} %llu\n", labels, (unsigned long long) snapshot->timeouts);
+        fprintf(out, "minirc_throttles_total{%s} %llu\n", labels, (unsigned long long) snapshot->throttles);
+        fprintf(out, "minirc_queue_bytes_max{%s} %llu\n", labels, (unsigned long long) snapshot->queue_bytes_hwm);
+        metrics_write_hist(out, "minirc_relay_latency_ns", labels, &snapshot->relay_latency);
+        metrics_write_hist(out, "minirc_fanout_size", labels, &snapshot->fanout_size);
+    }
+    free(snapshot);
+
+    epoch_enter(server->epoch);
+    channel_dir_foreach(&server->channels, metrics_write_channel, out);
+    epoch_exit(server->epoch);
+}
+
+// Serves one metrics dump per connection on the local Unix socket
+void* metrics_run(void* args) {
+    server_t* server = (server_t*) args;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, server->config.metrics_path, sizeof(addr.sun_path)-1);
+
+    // A socket left behind by a server that is gone is replaced, one still answering is not
+    struct stat st;
+    if (sock != -1 && lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe != -1 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+        if (probe != -1) close(probe);
+        if (live) {
+            log_warn("metrics_run::%s is served by another process, not serving metrics", addr.sun_path);
+            close(sock);
+            return NULL;
+        }
+        unlink(addr.sun_path);
+    }
+
+    if (sock == -1 || bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(sock, SERVER_CLIENT_QTY) == -1) {
+        log_perror("metrics_run::bind");
+        return NULL;
+    }
+    chmod(addr.sun_path, 0600);
+    log_info("metrics on unix:%s", addr.sun_path);
+
+    while (true) {
+        int client_sock = accept(sock, NULL, NULL);
+        if (client_sock == -1) continue;
+
+        char* dump = NULL;
+        size_t dump_len = 0;
+        FILE* out = open_memstream(&dump, &dump_len);
+        if (out) {
+            server_write_metrics(server, out);
+            fclose(out);
+
+            for (size_t sent = 0; sent < dump_len; ) {
+                ssize_t n = send(client_sock, dump + sent, dump_len - sent, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                sent += n;
+            }
+            free(dump);
+        }
+        close(client_sock);
+    }
+    return NULL;
+}
+
+// Takes over a freshly accepted connection; its reactor runs the handshake
+static void server_intake(server_t* server, acceptor_t* acceptor, int sock, struct sockaddr_in* addr, socklen_t addr_len, bool text) {
+    user_t* user = server_register_user(server, NULL);
+    if (!user) {
+        close(sock);
+        return;
+    }
+
+    user->connection = (irc_sock_t) { .addr_family = addr->sin_family, .sock = sock, .addr = *addr, .addr_len = addr_len };
+    user->proto = text ? irc_proto_text : irc_proto_v1;
+
+    reactor_t* reactor = &server->reactors[acceptor->next_reactor++ % server->reactor_qty];
+    reactor_attach_user(reactor, user);
+
+    if (server->config.handshake_timeout_s) {
+        timer_wheel_arm(&acceptor->timers, handle_pack(user->handle),
+            acceptor->timers.now_ms + server->config.handshake_timeout_s * 1000ull);
+    }
+}
+
+// A connection still unregistered at its handshake deadline is shut down, its reactor then
+// sees the hangup and closes it. Runs inside the acceptor's epoch section, so the user stays
+// valid even if its reactor closes it meanwhile.
+static void acceptor_handshake_expired(void* ctx, uint64_t key) {
+    acceptor_t* acceptor = ctx;
+    user_t* user = server_get_user(acceptor->server, handle_unpack(key));
+    if (!user || __atomic_load_n(&user->registered, __ATOMIC_ACQUIRE)) return;
+
+    log_info("dropping a connection that did not register within %d s", acceptor->server->config.handshake_timeout_s);
+    user_shutdown(user);
+}
+
+// Takes up to ACCEPTOR_BATCH pending connections off listening; the listener is level-triggered,
+// so a longer queue is picked up again on the next wake-up, after the other listener had its turn
+static void acceptor_drain(acceptor_t* acceptor, irc_sock_t* listening, bool text) {
+    for (int i = 0; i < ACCEPTOR_BATCH; i++) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int sock = accept4(listening->sock, (struct sockaddr*) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+
+            log_perror("acceptor_drain::accept4");
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) usleep(ACCEPTOR_BACKOFF_US);
+            return;
+        }
+        server_intake(acceptor->server, acceptor, sock, &addr, addr_len, text);
+    }
+}
+
+void* acceptor_run(void* args) {
+    acceptor_t* acceptor = (acceptor_t*) args;
+
+    struct epoll_event events[2];
+    while (true) {
+        int timeout = timer_wheel_timeout(&acceptor->timers, metrics_now_ns() / 1000000);
+        int ready_qty = epoll_wait(acceptor->epoll, events, 2, timeout);
+        if (ready_qty == -1) {
+            if (errno == EINTR) continue;
+            perror("acceptor_run::epoll_wait");
+            exit(1);
+        }
+        epoch_enter(acceptor->server->epoch);
+        timer_wheel_advance(&acceptor->timers, metrics_now_ns() / 1000000);
+        epoch_exit(acceptor->server->epoch);
+        epoch_poll(acceptor->server->epoch);
+
+        for (int n = 0; n < ready_qty; n++) {
+            bool text = events[n].data.u32;
+            acceptor_drain(acceptor, text ? &acceptor->text_listening : &acceptor->listening, text);
+        }
+    }
+    return NULL;
+}
+
+// Spawns the reactor pool and the acceptors; server must already live at its final address
+void server_start(server_t* server) {
+    // Reactors relay as soon as they run, the pool must be there by then
+    fanout_pool_init(&server->fanout, server->fanout_worker_qty, fanout_worker_enter, fanout_worker_after);
+    for (int i = 0; i < server->fanout_worker_qty; i++) {
+        server->fanout_reactors[i].server = server;
+        server->fanout.workers[i].ctx = &server->fanout_reactors[i];
+    }
+    fanout_pool_start(&server->fanout);
+    log_info("server_start::%d fan-out workers (channels from %d members)", server->fanout_worker_qty, server->config.fanout_min_members);
+
+    msglog_store_start(&server->logs);
+    if (server->logs.dir) log_info("server_start::channel logs in %s (commit every %d ms)", server->logs.dir, server->logs.commit_ms);
+
+    fed_hooks_t hooks = {
+        .enter = fed_link_enter,
+        .hello = fed_link_hello,
+        .greet = fed_link_greet,
+        .frame = fed_link_frame,
+        .idle = fed_link_idle,
+        .down = fed_link_down
+    };
+    fed_links_init(&server->fed.links, &hooks, server);
+    if (server->fed.enabled) {
+        for (int i = 0; i < FED_LINKS_MAX; i++) {
+            server->fed.reactors[i].server = server;
+            server->fed.links.links[i].ctx = &server->fed.reactors[i];
+        }
+        fed_links_start(&server->fed.links, server->config.fed_port, server->config.fed_dial, server->config.fed_dial_qty);
+        log_info("server_start::%s (%08x) links on port %d, dialling %d servers", server->fed.name, server->fed.id,
+            server->config.fed_port, server->config.fed_dial_qty);
+    }
+
+    for (int i = 0; i < server->reactor_qty; i++) {
+        reactor_t* reactor = &server->reactors[i];
+        reactor->server = server;
+        timer_wheel_init(&reactor->timers, TIMER_TICK_MS, metrics_now_ns() / 1000000, reactor_keepalive, reactor);
+        timer_wheel_init(&reactor->throttles, FLOOD_TICK_MS, metrics_now_ns() / 1000000, reactor_unthrottle, reactor);
+        pthread_create(&reactor->thread, NULL, reactor_run, reactor);
+    }
+    log_info("server_start::%d %s reactor threads", server->reactor_qty, reactor_engine_names[server->config.engine]);
+
+    for (int i = 0; i < server->acceptor_qty; i++) {
+        acceptor_t* acceptor = &server->acceptors[i];
+        acceptor->server = server;
+        timer_wheel_init(&acceptor->timers, TIMER_TICK_MS, metrics_now_ns() / 1000000, acceptor_handshake_expired, acceptor);
+        pthread_create(&acceptor->thread, NULL, acceptor_run, acceptor);
+    }
+    log_info("server_start::%d acceptor threads (backlog %d)", server->acceptor_qty, server->config.backlog);
+    flood_limits_t* flood = &server->config.flood;
+    if (flood->msgs_per_s || flood->bytes_per_s) {
+        log_info("server_start::flood control (%s) at %u msgs/s (burst %u), %u bytes/s (burst %u)",
+            server->config.flood_policy == flood_drop ? "drop" : "delay",
+            flood->msgs_per_s, flood->msg_burst, flood->bytes_per_s, flood->byte_burst);
+    }
+    if (server->config.ping_interval_s) {
+        log_info("server_start::PING after %d s idle, disconnect %d s later", server->config.ping_interval_s, server->config.ping_timeout_s);
+    }
+
+    if (server->config.metrics_path && server->config.metrics_path[0]) {
+        pthread_create(&server->metrics_thread, NULL, metrics_run, server);
+    }
+}
+
+// Caller must be inside an epoch section. If another thread created the channel first, the
+// user joins that one instead. Returns whether the user joined.
+bool server_add_channel(server_t* server, char* name, user_t* user, char* password) {
+    channel_t* new_channel = buf_pool_alloc(sizeof(channel_t));
+    if (!new_channel) {
+        log_perror("server_add_channel::buf_pool_alloc");
+        return false;
+    }
+    memset(new_channel, 0, sizeof(channel_t));
+    pthread_mutex_init(&new_channel->lock, NULL);
+
+    strncpy(new_channel->name, name, CHANNEL_NAME_LEN-1);
+    if (password) {
+        strncpy(new_channel->password, password, CHANNEL_PASS_LEN);
+    }
+    log_debug("new channel name is %s", new_channel->name);
+
+    new_channel->reactor = &server->reactors[hash_name(name) % server->reactor_qty];
+    new_channel->admin = user;
+    history_init(&new_channel->history, server->config.history_qty, server->config.history_bytes, server->epoch);
+
+    // Locked before it is published, so nobody can empty and destroy it before its creator joins
+    pthread_mutex_lock(&new_channel->lock);
+    channel_t* existing = channel_dir_insert(&server->channels, new_channel->name, new_channel);
+    if (existing) {
+        log_info("server_add_channel::%s was created concurrently, joining it", name);
+        pthread_mutex_unlock(&new_channel->lock);
+        channel_free(new_channel);
+        return channel_join(existing, user, password);
+    }
 
-    pthread_mutex_unlock(&server->ch_mutex);
+    __atomic_add_fetch(&server->channel_qty, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_rdlock(&server->fed.lock);
+    new_channel->links = fed_channel_links(&server->fed, new_channel->name);
+    pthread_rwlock_unlock(&server->fed.lock);
+    new_channel->log = msglog_open(&server->logs, new_channel->name);
+    channel_warm_history(new_channel);
+    bool joined = channel_add_user(new_channel, user, password);
+    if (!joined) server_destroy_channel(server, new_channel);   // whoever waits on the lock finds it closing
+
+    // Not empty if the channel's log was there before it
+    history_replay_t replay = {0};
+    if (joined) channel_send_history(new_channel, user, &replay);
+    history_replay_release(&replay);
+
+    pthread_mutex_unlock(&new_channel->lock);
+    return joined;
 }
 
 
@@ -0,0 +1,53 @@
+#ifndef IRC_SHARED_BUF_H_
+#define IRC_SHARED_BUF_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "buf_pool.h"
+
+// Immutable, reference-counted byte buffer. A relayed message is encoded into one of these
+// exactly once and every recipient's outbound queue holds a reference to the same bytes,
+// so fan-out costs O(members) pointers instead of O(members x size) copies. The buffer is
+// freed when the last holder (usually the slowest recipient) drops its reference. Buffers come
+// from the calling thread's pool, so a relay allocates nothing from malloc in steady state.
+typedef struct _shared_buf {
+    uint32_t refs;
+    uint32_t len;                           // may shrink once the data is encoded
+    uint32_t size;                          // bytes its pool block takes, what memory bounds count
+    char data[];
+} shared_buf_t;
+
+// The caller owns the single initial reference and fills data before sharing it
+shared_buf_t* shared_buf_new(size_t len) {
+    shared_buf_t* buf = buf_pool_alloc(sizeof(shared_buf_t) + len);
+    if (!buf) {
+        perror("shared_buf_new::buf_pool_alloc");
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->len = len;
+    buf->size = buf_pool_block_size(sizeof(shared_buf_t) + len);
+    return buf;
+}
+
+// A buffer holding a copy of data, for frames formatted on the stack: allocating the worst case
+// up front would put a short line in the block class of the longest one
+shared_buf_t* shared_buf_copy(const void* data, size_t len) {
+    shared_buf_t* buf = shared_buf_new(len);
+    if (buf) memcpy(buf->data, data, len);
+    return buf;
+}
+
+static inline shared_buf_t* shared_buf_ref(shared_buf_t* buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+static inline void shared_buf_unref(shared_buf_t* buf) {
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) buf_pool_free(buf, buf->size);
+}
+
+#endif
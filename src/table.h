@@ -0,0 +1,121 @@
+#ifndef IRC_TABLE_H_
+#define IRC_TABLE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Growable table of fixed-size slots. Slots live in chunks that are never moved nor freed,
+// so a slot's address is stable for its whole lifetime and removing one never touches the
+// others. A handle (index + generation) goes stale as soon as its slot is retired, which lets
+// epoll events and cross-thread references detect reuse instead of aliasing a new occupant.
+// A retired slot is only handed out again once table_recycle says nobody can still use it.
+#define TABLE_CHUNK_SHIFT 10
+#define TABLE_CHUNK_SLOTS (1 << TABLE_CHUNK_SHIFT)
+#define TABLE_MAX_CHUNKS 4096              // 4M slots
+#define TABLE_NIL UINT32_MAX
+
+typedef struct _handle {
+    uint32_t index;
+    uint32_t gen;                           // odd while the slot is live
+} handle_t;
+
+typedef struct _table_slot {
+    uint32_t gen;
+    uint32_t next_free;
+    _Alignas(16) char data[];
+} table_slot_t;
+
+typedef struct _table {
+    size_t elem_size;
+    size_t slot_size;
+    table_slot_t* chunks[TABLE_MAX_CHUNKS];
+    uint32_t chunk_qty;
+    uint32_t free_head;
+    uint32_t live_qty;
+} table_t;
+
+static inline uint64_t handle_pack(handle_t handle) {
+    return ((uint64_t) handle.gen << 32) | handle.index;
+}
+
+static inline handle_t handle_unpack(uint64_t packed) {
+    return (handle_t) { .index = (uint32_t) packed, .gen = (uint32_t) (packed >> 32) };
+}
+
+void table_init(table_t* table, size_t elem_size) {
+    memset(table, 0, sizeof(table_t));
+    table->elem_size = elem_size;
+    table->slot_size = (sizeof(table_slot_t) + elem_size + 15) & ~(size_t) 15;
+    table->free_head = TABLE_NIL;
+}
+
+static inline table_slot_t* table_slot(table_t* table, uint32_t index) {
+    table_slot_t* chunk = __atomic_load_n(&table->chunks[index >> TABLE_CHUNK_SHIFT], __ATOMIC_ACQUIRE);
+    if (!chunk) return NULL;
+    return (table_slot_t*) ((char*) chunk + (index & (TABLE_CHUNK_SLOTS-1)) * table->slot_size);
+}
+
+// Returns a zeroed element, or NULL once TABLE_MAX_CHUNKS is exhausted
+void* table_alloc(table_t* table, handle_t* out) {
+    if (table->free_head == TABLE_NIL) {
+        if (table->chunk_qty == TABLE_MAX_CHUNKS) return NULL;
+
+        table_slot_t* chunk = calloc(TABLE_CHUNK_SLOTS, table->slot_size);
+        if (!chunk) {
+            perror("table_alloc::calloc");
+            return NULL;
+        }
+
+        // Thread the new slots onto the free list, lowest index first
+        uint32_t base = table->chunk_qty << TABLE_CHUNK_SHIFT;
+        for (uint32_t i = 0; i < TABLE_CHUNK_SLOTS; i++) {
+            table_slot_t* slot = (table_slot_t*) ((char*) chunk + i * table->slot_size);
+            slot->next_free = i+1 < TABLE_CHUNK_SLOTS ? base+i+1 : TABLE_NIL;
+        }
+        __atomic_store_n(&table->chunks[table->chunk_qty++], chunk, __ATOMIC_RELEASE);
+        table->free_head = base;
+    }
+
+    uint32_t index = table->free_head;
+    table_slot_t* slot = table_slot(table, index);
+    table->free_head = slot->next_free;
+    table->live_qty++;
+
+    memset(slot->data, 0, table->elem_size);
+    __atomic_store_n(&slot->gen, slot->gen+1, __ATOMIC_RELEASE);
+
+    *out = (handle_t) { .index = index, .gen = slot->gen };
+    return slot->data;
+}
+
+// Makes every handle of the slot stale. Its element stays as it is, for whoever got it from
+// table_get before, until table_recycle puts the slot back on the free list.
+bool table_retire(table_t* table, handle_t handle) {
+    table_slot_t* slot = table_slot(table, handle.index);
+    if (!slot || slot->gen != handle.gen) return false;
+
+    __atomic_store_n(&slot->gen, slot->gen+1, __ATOMIC_RELEASE);
+    table->live_qty--;
+    return true;
+}
+
+// Once no thread can still use the retired slot at index
+void table_recycle(table_t* table, uint32_t index) {
+    table_slot_t* slot = table_slot(table, index);
+    slot->next_free = table->free_head;
+    table->free_head = index;
+}
+
+// NULL if the handle's slot has been retired (and possibly reused) since it was issued
+void* table_get(table_t* table, handle_t handle) {
+    if (handle.index >> TABLE_CHUNK_SHIFT >= TABLE_MAX_CHUNKS) return NULL;
+
+    table_slot_t* slot = table_slot(table, handle.index);
+    if (!slot || __atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != handle.gen) return NULL;
+    return slot->data;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef IRC_TIMER_WHEEL_H_
+#define IRC_TIMER_WHEEL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+
+// Hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS slots, where a slot of one level
+// spans a whole turn of the level below. A timer goes into the lowest level whose turn still
+// reaches its expiry, so arming it is a push onto one slot. Advancing fires the lowest level's
+// slots tick by tick, and whenever a level completes a turn the next slot of the level above is
+// cascaded down, so a timer is moved at most TIMER_LEVELS-1 times however far out it was armed.
+// Occupancy bitmaps let the owner sleep until the next tick with something in it.
+//
+// Timers carry an opaque key (say a packed handle) instead of a callback of their own: the
+// owner's fire gets the key back and decides what it still means. Cancelling is free, a timer
+// whose key went stale is just dropped when it fires; keeping one timer armed per key is up to
+// the owner. Only the owner's thread arms and advances a wheel.
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_SHIFT 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_SHIFT)
+#define TIMER_SPAN (1ull << (TIMER_SLOT_SHIFT * TIMER_LEVELS))     // ticks, later expiries are clamped
+#define TIMER_SLOT_MIN_CAP 16
+
+typedef struct _timer_entry {
+    uint64_t key;
+    uint64_t expires;                       // tick
+} timer_entry_t;
+
+typedef struct _timer_slot {
+    timer_entry_t* entries;                 // grows on demand and keeps its room once emptied
+    uint32_t qty;
+    uint32_t cap;
+} timer_slot_t;
+
+typedef struct _timer_wheel {
+    timer_slot_t slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];        // bit per non-empty slot
+    uint64_t tick;                          // every tick up to this one has fired
+    uint32_t tick_ms;
+    uint64_t now_ms;                        // as of the last timer_wheel_advance, for fire to read
+    uint64_t qty;                           // armed timers, stale ones included
+    void (*fire)(void* ctx, uint64_t key);
+    void* ctx;
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t* wheel, uint32_t tick_ms, uint64_t now_ms, void (*fire)(void* ctx, uint64_t key), void* ctx) {
+    *wheel = (timer_wheel_t) { .tick = now_ms / tick_ms, .tick_ms = tick_ms, .now_ms = now_ms, .fire = fire, .ctx = ctx };
+}
+
+// expires may be the current tick only while cascading, into the slot about to fire
+static void timer_wheel_insert(timer_wheel_t* wheel, uint64_t key, uint64_t expires) {
+    uint64_t delta = expires - wheel->tick;
+    int level = delta ? (63 - __builtin_clzll(delta)) / TIMER_SLOT_SHIFT : 0;
+    int index = (expires >> (TIMER_SLOT_SHIFT * level)) & (TIMER_SLOTS-1);
+
+    timer_slot_t* slot = &wheel->slots[level][index];
+    if (slot->qty == slot->cap) {
+        uint32_t new_cap = slot->cap ? slot->cap*2 : TIMER_SLOT_MIN_CAP;
+        timer_entry_t* entries = realloc(slot->entries, new_cap * sizeof(timer_entry_t));
+        if (!entries) {
+            perror("timer_wheel_insert::realloc");
+            return;
+        }
+        slot->entries = entries;
+        slot->cap = new_cap;
+    }
+    slot->entries[slot->qty++] = (timer_entry_t) { .key = key, .expires = expires };
+    wheel->occupied[level] |= 1ull << index;
+    wheel->qty++;
+}
+
+// Fires key's timer on the first tick at or past at_ms
+void timer_wheel_arm(timer_wheel_t* wheel, uint64_t key, uint64_t at_ms) {
+    uint64_t expires = (at_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (expires <= wheel->tick) expires = wheel->tick + 1;
+    if (expires - wheel->tick >= TIMER_SPAN) expires = wheel->tick + TIMER_SPAN - 1;
+    timer_wheel_insert(wheel, key, expires);
+}
+
+// First tick after the current one that cascades or fires a non-empty slot, UINT64_MAX if none
+static uint64_t timer_wheel_next(timer_wheel_t* wheel) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (!occupied) continue;
+
+        // Rotate so bit 0 is the slot the level handles next
+        int shift = TIMER_SLOT_SHIFT * level;
+        uint64_t turn = wheel->tick >> shift;
+        int from = (turn + 1) & (TIMER_SLOTS-1);
+        uint64_t rotated = from ? (occupied >> from) | (occupied << (TIMER_SLOTS - from)) : occupied;
+        uint64_t at = (turn + 1 + __builtin_ctzll(rotated)) << shift;
+        if (at < next) next = at;
+    }
+    return next;
+}
+
+// Cascades every level that completed a turn at the current tick, top down, then fires its slot
+static void timer_wheel_step(timer_wheel_t* wheel) {
+    uint64_t tick = wheel->tick;
+    int top = 0;
+    while (top+1 < TIMER_LEVELS && !(tick & ((1ull << (TIMER_SLOT_SHIFT * (top+1))) - 1))) top++;
+
+    // Entries of a cascaded slot expire within one turn of the level below, never back into it
+    for (int level = top; level > 0; level--) {
+        int index = (tick >> (TIMER_SLOT_SHIFT * level)) & (TIMER_SLOTS-1);
+        timer_slot_t* slot = &wheel->slots[level][index];
+        uint32_t qty = slot->qty;
+        slot->qty = 0;
+        wheel->occupied[level] &= ~(1ull << index);
+        wheel->qty -= qty;
+        for (uint32_t i = 0; i < qty; i++) timer_wheel_insert(wheel, slot->entries[i].key, slot->entries[i].expires);
+    }
+
+    // fire may arm again, but always past this tick's slot
+    int index = tick & (TIMER_SLOTS-1);
+    timer_slot_t* slot = &wheel->slots[0][index];
+    for (uint32_t i = 0; i < slot->qty; i++) wheel->fire(wheel->ctx, slot->entries[i].key);
+    wheel->qty -= slot->qty;
+    slot->qty = 0;
+    wheel->occupied[0] &= ~(1ull << index);
+}
+
+// Fires every timer due by now_ms, skipping straight over the ticks with nothing to do
+void timer_wheel_advance(timer_wheel_t* wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / wheel->tick_ms;
+    wheel->now_ms = now_ms;
+    while (wheel->tick < target) {
+        uint64_t next = timer_wheel_next(wheel);
+        if (next > target) {
+            wheel->tick = target;
+            break;
+        }
+        wheel->tick = next;
+        timer_wheel_step(wheel);
+    }
+}
+
+// Milliseconds the owner may sleep before the next tick with work, -1 (forever) if none is armed
+int timer_wheel_timeout(timer_wheel_t* wheel, uint64_t now_ms) {
+    if (!wheel->qty) return -1;
+
+    uint64_t at_ms = timer_wheel_next(wheel) * wheel->tick_ms;
+    if (at_ms <= now_ms) return 0;
+    return at_ms - now_ms < INT_MAX ? (int) (at_ms - now_ms) : INT_MAX;
+}
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef IRC_URING_H_
+#define IRC_URING_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring binding over the raw syscalls (no liburing). One uring_t is owned by one
+// thread: only that thread gets SQEs, submits and reaps. SQEs are handed out locally and
+// published to the kernel in one go by uring_submit, so a whole batch of sends costs a single
+// io_uring_enter. Also wraps provided buffer rings (the kernel picks a receive buffer when
+// data arrives instead of one being pinned per idle connection) and the registered file table.
+
+typedef struct _uring {
+    int fd;
+    uint32_t features;
+    uint32_t* sq_head;                      // shared with the kernel
+    uint32_t* sq_tail;
+    uint32_t* sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sqe_tail;                      // next SQE handed out, published on submit
+    struct io_uring_sqe* sqes;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_len;
+    void* cq_map;                           // == sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_len;
+    size_t sqes_len;
+} uring_t;
+
+typedef struct _uring_buf_ring {
+    struct io_uring_buf_ring* ring;         // shared with the kernel
+    char* bufs;
+    uint32_t entries;                       // power of two
+    uint32_t buf_len;
+    uint16_t tail;                          // local, published by uring_buf_ring_publish
+    uint16_t bgid;
+} uring_buf_ring_t;
+
+static inline int uring_sys_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uring_sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int uring_sys_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void uring_free(uring_t* uring) {
+    if (uring->sqes) munmap(uring->sqes, uring->sqes_len);
+    if (uring->cq_map && uring->cq_map != uring->sq_map) munmap(uring->cq_map, uring->cq_map_len);
+    if (uring->sq_map) munmap(uring->sq_map, uring->sq_map_len);
+    if (uring->fd >= 0) close(uring->fd);
+    memset(uring, 0, sizeof(uring_t));
+    uring->fd = -1;
+}
+
+// Returns 0, or -errno when the kernel has no (usable) io_uring
+int uring_init(uring_t* uring, unsigned entries, unsigned cq_entries) {
+    memset(uring, 0, sizeof(uring_t));
+    uring->fd = -1;
+
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN,
+        .cq_entries = cq_entries
+    };
+    int fd = uring_sys_setup(entries, &params);
+    if (fd == -1 && errno == EINVAL) {
+        // Kernels before 5.19 refuse COOP_TASKRUN
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+        fd = uring_sys_setup(entries, &params);
+    }
+    if (fd == -1) return -errno;
+    uring->fd = fd;
+    uring->features = params.features;
+
+    uring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_map_len > uring->sq_map_len) uring->sq_map_len = uring->cq_map_len;
+        uring->cq_map_len = uring->sq_map_len;
+    }
+
+    uring->sq_map = mmap(NULL, uring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (uring->sq_map == MAP_FAILED) {
+        uring->sq_map = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_map = uring->sq_map;
+    } else {
+        uring->cq_map = mmap(NULL, uring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (uring->cq_map == MAP_FAILED) {
+            uring->cq_map = NULL;
+            goto fail;
+        }
+    }
+
+    uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        goto fail;
+    }
+
+    char* sq = uring->sq_map;
+    uring->sq_head = (uint32_t*) (sq + params.sq_off.head);
+    uring->sq_tail = (uint32_t*) (sq + params.sq_off.tail);
+    uring->sq_array = (uint32_t*) (sq + params.sq_off.array);
+    uring->sq_mask = *(uint32_t*) (sq + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->sqe_tail = *uring->sq_tail;
+
+    char* cq = uring->cq_map;
+    uring->cq_head = (uint32_t*) (cq + params.cq_off.head);
+    uring->cq_tail = (uint32_t*) (cq + params.cq_off.tail);
+    uring->cq_mask = *(uint32_t*) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return 0;
+
+fail: ;
+    int err = errno;
+    uring_free(uring);
+    return -err;
+}
+
+// Publishes every SQE handed out so far; returns how many the kernel has not consumed yet,
+// including leftovers of a failed enter
+static unsigned uring_publish(uring_t* uring) {
+    uint32_t tail = *uring->sq_tail;
+    for (; tail != uring->sqe_tail; tail++) uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+    __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+    return tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Publishes every SQE handed out so far and enters the kernel, waiting for wait_nr completions.
+// Returns what io_uring_enter returns (-1 with errno set on error).
+int uring_submit(uring_t* uring, unsigned wait_nr) {
+    unsigned to_submit = uring_publish(uring);
+    if (!to_submit && !wait_nr) return 0;
+    return uring_sys_enter(uring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// uring_submit(uring, 1) that stops waiting after timeout_ms (-1 with errno ETIME), or never if
+// timeout_ms is negative
+int uring_submit_wait(uring_t* uring, int timeout_ms) {
+    if (timeout_ms < 0) return uring_submit(uring, 1);
+
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000ll };
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t) &ts };
+    return syscall(__NR_io_uring_enter, uring->fd, uring_publish(uring), 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+// A zeroed SQE, or NULL if the submission ring is still full after flushing it to the kernel
+struct io_uring_sqe* uring_get_sqe(uring_t* uring) {
+    if (uring->sqe_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        uring_submit(uring, 0);
+        if (uring->sqe_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) return NULL;
+    }
+
+    struct io_uring_sqe* sqe = &uring->sqes[uring->sqe_tail++ & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Next completion, or NULL; hand it back with uring_cqe_seen
+static inline struct io_uring_cqe* uring_peek_cqe(uring_t* uring) {
+    uint32_t head = *uring->cq_head;
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &uring->cqes[head & uring->cq_mask];
+}
+
+static inline void uring_cqe_seen(uring_t* uring) {
+    __atomic_store_n(uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Receives into a buffer of group bgid, once or (multishot) every time data arrives until stopped
+static inline void uring_prep_recv(struct io_uring_sqe* sqe, int fd, bool fixed, uint16_t bgid, bool multishot, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT | (fixed ? IOSQE_FIXED_FILE : 0);
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe* sqe, int fd, bool fixed, struct msghdr* msg, unsigned flags, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf, unsigned len, uint64_t user_data) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+}
+
+// Cancels the request submitted with target as its user_data
+static inline void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+// Sparse table of qty registered files, filled in by uring_update_file; returns 0 or -errno
+int uring_register_files(uring_t* uring, unsigned qty) {
+    int* fds = malloc(qty * sizeof(int));
+    if (!fds) return -ENOMEM;
+    for (unsigned i = 0; i < qty; i++) fds[i] = -1;
+
+    int ret = uring_sys_register(uring->fd, IORING_REGISTER_FILES, fds, qty);
+    int err = errno;
+    free(fds);
+    return ret < 0 ? -err : 0;
+}
+
+// Installs fd in slot (-1 empties it); returns 0 or -errno
+int uring_update_file(uring_t* uring, unsigned slot, int fd) {
+    struct io_uring_files_update update = { .offset = slot, .fds = (uintptr_t) &fd };
+    int ret = uring_sys_register(uring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    return ret < 0 ? -errno : 0;
+}
+
+static inline void uring_buf_ring_add(uring_buf_ring_t* br, uint16_t bid) {
+    struct io_uring_buf* buf = &br->ring->bufs[br->tail & (br->entries-1)];
+    buf->addr = (uintptr_t) (br->bufs + (size_t) bid * br->buf_len);
+    buf->len = br->buf_len;
+    buf->bid = bid;
+    br->tail++;
+}
+
+// Makes the buffers added since the last call visible to the kernel
+static inline void uring_buf_ring_publish(uring_buf_ring_t* br) {
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+static inline char* uring_buf_ring_data(uring_buf_ring_t* br, uint16_t bid) {
+    return br->bufs + (size_t) bid * br->buf_len;
+}
+
+// Registers entries buffers of buf_len bytes as group bgid; returns 0 or -errno (EINVAL before 5.19)
+int uring_buf_ring_init(uring_t* uring, uring_buf_ring_t* br, uint16_t bgid, uint32_t entries, uint32_t buf_len) {
+    memset(br, 0, sizeof(uring_buf_ring_t));
+    br->entries = entries;
+    br->buf_len = buf_len;
+    br->bgid = bgid;
+
+    size_t ring_len = entries * sizeof(struct io_uring_buf);
+    br->ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->ring == MAP_FAILED) {
+        br->ring = NULL;
+        return -errno;
+    }
+    br->bufs = malloc((size_t) entries * buf_len);
+    if (!br->bufs) {
+        munmap(br->ring, ring_len);
+        br->ring = NULL;
+        return -ENOMEM;
+    }
+
+    struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t) br->ring, .ring_entries = entries, .bgid = bgid };
+    if (uring_sys_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        free(br->bufs);
+        munmap(br->ring, ring_len);
+        br->ring = NULL;
+        br->bufs = NULL;
+        return -err;
+    }
+
+    for (uint32_t i = 0; i < entries; i++) uring_buf_ring_add(br, i);
+    uring_buf_ring_publish(br);
+    return 0;
+}
+
+void uring_buf_ring_free(uring_buf_ring_t* br) {
+    if (br->ring) munmap(br->ring, br->entries * sizeof(struct io_uring_buf));
+    free(br->bufs);
+    memset(br, 0, sizeof(uring_buf_ring_t));
+}
+
+#endif